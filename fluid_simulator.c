@@ -3,24 +3,141 @@
 #include <stdlib.h>
 #include <math.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include <assert.h>
+#if defined(RB_NARROW_PHASE_THREADS) || defined(CAPTURE_FILE)
+#include <pthread.h>
+#endif
+
+// HOST_BUILD compiles the simulation on a desktop for benchmarking. The A9 mode switches and interrupt
+// attributes are left out, so nothing that touches the board's MMIO may run in that build. The display
+// goes through the host backend (see DISPLAY UTILS) instead.
+#ifdef HOST_BUILD
+#include <time.h>
+#define ARM_ISR
+#else
+#define ARM_ISR __attribute__ ((interrupt))
+#endif
 
 #define SW_BASE				    0xFF200040
 
+// =======================================================================================================
+//                                              TIMEKEEPING
+// =======================================================================================================
+
+// One clock for everything that measures or paces time. timeNow counts TIME_TICKS_PER_US per us and
+// never goes backwards. On the board it is the A9 global timer, a 64 bit count at 200 MHz. On the host it
+// is clock_gettime(CLOCK_MONOTONIC) in ns. timeTicks counts TIME_TICK_HZ periods since timeSetup: on the
+// board the FPGA interval timer interrupts once a period and the interrupt counts, while the host works
+// the count out from the clock.
+
+#define A9_GLOBAL_TIMER         0xFFFEC200
+#define INTERVAL_TIMER_BASE     0xFF202000 // TIMER_BASE in address_map_nios2.h
+#define INTERVAL_TIMER_HZ       100000000
+#define INTERVAL_TIMER_IRQ      72
+#define TIME_TICK_HZ            60 // One simulation step of DEFAULT_SPF seconds each, one per vsync
+#ifdef HOST_BUILD
+#define TIME_TICKS_PER_US       1000
+#else
+#define TIME_TICKS_PER_US       200
+#endif
+
+volatile unsigned int timeTickCount = 0; // Interval timer interrupts since timeSetup
+long long timeStartNs = 0;
+
+unsigned long long timeNow() {
+#ifdef HOST_BUILD
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#else
+	volatile unsigned int * timerPtr = (volatile unsigned int *) A9_GLOBAL_TIMER;
+	unsigned int high, low;
+	do {
+		high = timerPtr[1];
+		low = timerPtr[0];
+	} while (timerPtr[1] != high); // The low word wrapped between the two reads
+	return ((unsigned long long) high << 32) | low;
+#endif
+}
+
+long long timeNanoseconds() {
+	return timeNow() * (1000 / TIME_TICKS_PER_US);
+}
+
+unsigned int timeTicks() {
+#ifdef HOST_BUILD
+	return (timeNanoseconds() - timeStartNs) * TIME_TICK_HZ / 1000000000ll;
+#else
+	return timeTickCount;
+#endif
+}
+
+// Starts the clock and, on the board, the tick interrupt. It goes through the GIC along with the mouse's,
+// so the interrupts themselves are only enabled once the mouse is set up.
+void timeSetup() {
+#ifndef HOST_BUILD
+	volatile unsigned int * globalPtr = (volatile unsigned int *) A9_GLOBAL_TIMER;
+	volatile int * timerPtr = (volatile int *) INTERVAL_TIMER_BASE;
+	int period = INTERVAL_TIMER_HZ / TIME_TICK_HZ - 1;
+
+	globalPtr[2] = 1; // Enable, no prescaler
+
+	*(timerPtr + 1) = 0b1000; // Stop while the period is set
+	*(timerPtr + 2) = period & 0xFFFF;
+	*(timerPtr + 3) = period >> 16;
+	*(timerPtr + 0) = 0; // Clear a timeout left over
+	*(timerPtr + 1) = 0b0111; // Start, continuous, interrupt on timeout
+
+	*((volatile int*) 0xFFFED848) = 0x00000001; // IRQ 72 to CPU 0
+	*((volatile int*) 0xFFFED108) = 1 << (INTERVAL_TIMER_IRQ - 64);
+#endif
+	timeTickCount = 0;
+	timeStartNs = timeNanoseconds();
+}
+
+// Called from the IRQ handler once a period.
+void timeTickInterrupt() {
+	*((volatile int *) INTERVAL_TIMER_BASE) = 0; // Acknowledge the timeout
+	timeTickCount++;
+}
+
 // =======================================================================================================
 //                                              DISPLAY UTILS
 // =======================================================================================================
 
-#define FPGA_PIXEL_BUF_BASE		0x08000000
-#define FPGA_PIXEL_BUF_END		0x0803FFFF
+// Memory the A9 sees through the HPS-to-FPGA bridge. address_map_nios2.h has the Nios II view of the
+// same memories, which puts the on-chip buffers at 0x08000000 and 0x09000000. On the A9 those addresses
+// land in DDR3, where p_sim_arm.amp keeps the program.
+#define FPGA_PIXEL_BUF_BASE		0xC8000000
+#define FPGA_PIXEL_BUF_END		0xC803FFFF
+#define FPGA_CHAR_BASE          0xC9000000
+#define SDRAM_BASE              0xC0000000
+#define NUM_PIXEL_BUFFERS       2
 #define VGA_CONTROLLER_BASE 	0xff203020
 #define NUM_LINES 				8
 #define NUM_PIXELS_IN_SCREEN 	76800 // 320px by 240px
+#define FB_ROW_BYTES            1024 // Rows are 320px wide but sit on a 512px stride
+#define FB_ROW_PIXELS           (FB_ROW_BYTES / 2)
 
+// The largest screen and simulation domain the static buffers hold. The board runs at exactly this size.
+// Host builds can raise it (say -DMAX_X=1280 -DMAX_Y=720) and then pick the sizes at startup.
+#ifndef MAX_X
 #define MAX_X 320
+#endif
+#ifndef MAX_Y
 #define MAX_Y 240
+#endif
+
+// The size of the particle set and of the rigid body pool. The render queue is sized from them.
+#ifndef NUM_PARTICLES
+#define NUM_PARTICLES       200 // 192, 48, 12
+#endif
+#define MAX_BODIES          32 // Pool size. More can be spawned at runtime up to this many.
 
 bool isFluidSim = false;
+bool isCoupledSim = false; // Fluid and rigid bodies in one world (isFluidSim is also set)
 bool lastFluidSim = false;
 bool play = false;
 int speedMult = 0;
@@ -34,28 +151,145 @@ int vgaSetup(void);
 void swap(int*, int*);
 int abs(int);
 void waitForVsync();
+void requestBufferSwap();
+bool bufferSwapPending();
+void swapBuffers();
 short int hueToRGB565(float);
 
 // Drawing Function Prototpes
 void drawIndividualPixel(int, int, short int);
+void setPixelBufferRows(uintptr_t);
 void drawBresenhamLine(int, int, int, int, short int);
+void fillSpan(int, int, int, short int);
+void fillConvexPolygon(int *, int *, int, short int);
+void fillDisc(int, int, int, short int);
 void drawBox(int, int, short int);
 void clearWholeScreen();
 void tracebackErase();
 
+// The controller scans one buffer out while we draw into the other. They trade places on vsync.
+uintptr_t pixelBuffers[NUM_PIXEL_BUFFERS];
+int backBuffer = 0; // Index into pixelBuffers of the buffer being drawn
+
 // Global telling us the starting address of the Pixel Buffer
-int CURRENT_BACK_BUFFER_ADDRESS;
+uintptr_t CURRENT_BACK_BUFFER_ADDRESS;
+
+// Size of the screen, chosen at startup with setDisplayGeometry before vgaSetup. The display backend
+// fills in the stride, since the controller decides how its rows are laid out.
+typedef struct DisplayGeometry {
+
+	int width, height; // At most MAX_X by MAX_Y
+	int stride; // Pixels from the start of one row to the next
+
+} DisplayGeometry;
+
+DisplayGeometry screen = {MAX_X, MAX_Y, FB_ROW_PIXELS};
+
+// ----- Display backends -----
+// Everything that talks to the display controller goes through a DisplayBackend. Pixel writes don't:
+// both backends hand out plain memory laid out as 512px-stride RGB565 rows, and the drawing code writes
+// it through fbRows. The DE1-SoC backend drives the VGA controller's registers. The host backend keeps
+// the buffers in arrays and simulates the controller, swapping on a vsync every 1/HOST_VSYNC_HZ s
+// (at once if it is 0), so the whole frame loop runs headless on a desktop.
+
+typedef struct DisplayBackend {
+
+	const char * name;
+	void (*setup)(uintptr_t *, DisplayGeometry *); // Fills in the pixel buffers and the stride, with buffer 0 on screen and 1 behind it
+	void (*requestSwap)(void); // Trade front and back at the next vsync
+	bool (*swapPending)(void);
+
+} DisplayBackend;
+
+// The controller is built for 320x240 on a 512px stride, so that is the only size it shows correctly.
+void de1SetupDisplay(uintptr_t * buffers, DisplayGeometry * geometry) {
+
+	volatile int *vgaCtlPtr = (volatile int *)VGA_CONTROLLER_BASE;
+	buffers[0] = FPGA_PIXEL_BUF_BASE;
+	buffers[1] = SDRAM_BASE;
+	geometry->stride = FB_ROW_PIXELS;
+
+	// Swap buffer 0 onto the screen, then hand the controller buffer 1 as the back buffer.
+	*(vgaCtlPtr + 1) = buffers[0];
+	waitForVsync();
+	*(vgaCtlPtr + 1) = buffers[1];
+
+}
+
+void de1RequestSwap() {
+	volatile int *vgaCtlPtr = (volatile int*)VGA_CONTROLLER_BASE;
+	*vgaCtlPtr = 1; // 1->Front Buffer Address. Kickstarts our swap/rendering process
+}
+
+bool de1SwapPending() {
+	volatile int *vgaCtlPtr = (volatile int*)VGA_CONTROLLER_BASE;
+	return (*(vgaCtlPtr + 3) & 0x01) != 0;
+}
+
+const DisplayBackend de1Display = {"DE1-SoC VGA", de1SetupDisplay, de1RequestSwap, de1SwapPending};
+
+#ifdef HOST_BUILD
+#ifndef HOST_VSYNC_HZ
+#define HOST_VSYNC_HZ           60
+#endif
+
+// Memory stand-ins for the two pixel buffers. Screens up to 512px wide are laid out like the board's;
+// wider ones get rows just wide enough, kept to whole doublewords for blitSpan.
+#define HOST_MAX_STRIDE         (MAX_X <= FB_ROW_PIXELS ? FB_ROW_PIXELS : (MAX_X + 3) & ~3)
+short int hostPixelBuffers[NUM_PIXEL_BUFFERS][MAX_Y * HOST_MAX_STRIDE] __attribute__ ((aligned (8)));
+uintptr_t hostFrontBuffer; // What the simulated controller is scanning out
+uintptr_t hostBackBuffer;
+bool hostSwapRequested = false;
+long long hostSwapAtNs; // The vsync the requested swap lands on
+int hostSwaps = 0;
+
+void hostSetupDisplay(uintptr_t * buffers, DisplayGeometry * geometry) {
+	geometry->stride = geometry->width <= FB_ROW_PIXELS ? FB_ROW_PIXELS : (geometry->width + 3) & ~3;
+	for (int b = 0; b < NUM_PIXEL_BUFFERS; b++) buffers[b] = (uintptr_t) hostPixelBuffers[b];
+	hostFrontBuffer = buffers[0];
+	hostBackBuffer = buffers[1];
+}
+
+void hostRequestSwap() {
+	hostSwapAtNs = timeNanoseconds();
+#if HOST_VSYNC_HZ > 0
+	long long period = 1000000000ll / HOST_VSYNC_HZ;
+	hostSwapAtNs = (hostSwapAtNs / period + 1) * period;
+#endif
+	hostSwapRequested = true;
+}
+
+bool hostSwapPending() {
+	if (hostSwapRequested && timeNanoseconds() >= hostSwapAtNs) {
+		uintptr_t front = hostFrontBuffer;
+		hostFrontBuffer = hostBackBuffer;
+		hostBackBuffer = front;
+		hostSwapRequested = false;
+		hostSwaps++;
+	}
+	return hostSwapRequested;
+}
+
+const DisplayBackend hostDisplay = {"host memory", hostSetupDisplay, hostRequestSwap, hostSwapPending};
+const DisplayBackend * display = &hostDisplay;
+#else
+const DisplayBackend * display = &de1Display;
+#endif
 
 // Setup the vga Display for drawing to the back buffer.
 int vgaSetup(void) {
-	
-	waitForVsync();
 
-	volatile int *vgaCtlPtr = (volatile int *)VGA_CONTROLLER_BASE;
-	CURRENT_BACK_BUFFER_ADDRESS = *vgaCtlPtr;
-	
-	clearWholeScreen();
-	
+	display->setup(pixelBuffers, &screen);
+
+	for (int b = 0; b < NUM_PIXEL_BUFFERS; b++) {
+		setPixelBufferRows(pixelBuffers[b]);
+		clearWholeScreen();
+	}
+
+	backBuffer = 1;
+	CURRENT_BACK_BUFFER_ADDRESS = pixelBuffers[backBuffer];
+	setPixelBufferRows(CURRENT_BACK_BUFFER_ADDRESS);
+
 	return 0;
 	
 }
@@ -114,34 +348,180 @@ void swap(int *a, int*b){
 	*b = temp;
 }
 
+// Swaps on the VGA controller and spins until it is done. Only the DE1-SoC backend's setup calls it.
 void waitForVsync(){
 
-	volatile int *vgaCtlPtr = (volatile int*)VGA_CONTROLLER_BASE;
-	*vgaCtlPtr = 1; // 1->Front Buffer Address. Kickstarts our swap/rendering process
-	
-	// Poll status bit for a 0
-	while ((*(vgaCtlPtr + 3) & 0x01)!=0);
-		
+	de1RequestSwap();
+	while (de1SwapPending());
+
+}
+
+// Asks the controller to put the finished back buffer on screen at the next vsync, and points the pixel
+// writes at the buffer it replaces. That buffer stays on screen, so nothing may be drawn into it until
+// bufferSwapPending() goes false.
+void requestBufferSwap(){
+
+	display->requestSwap();
+
+	backBuffer = (backBuffer + 1) % NUM_PIXEL_BUFFERS;
+	CURRENT_BACK_BUFFER_ADDRESS = pixelBuffers[backBuffer];
+	setPixelBufferRows(CURRENT_BACK_BUFFER_ADDRESS);
+
+}
+
+// True until the controller has made the requested swap.
+bool bufferSwapPending(){
+	return display->swapPending();
+}
+
+// Swaps and waits for it. The main loop does its next frame's work during the wait instead (see FRAME
+// SCHEDULER).
+void swapBuffers(){
+
+	requestBufferSwap();
+	while (bufferSwapPending());
+
+}
+
+// Pixels outside the clip rectangle are dropped. The renderer narrows it to the region being repainted.
+typedef struct Rect {
+
+    int x0, y0, x1, y1; // Inclusive
+
+} Rect;
+
+Rect clipRect = {0, 0, MAX_X - 1, MAX_Y - 1};
+
+Rect screenRect(){
+	return (Rect){0, 0, screen.width - 1, screen.height - 1};
+}
+
+// Start of each row in the pixel buffer, so drawing never multiplies by the stride.
+volatile short int *fbRows[MAX_Y];
+
+// Points the row table at a pixel buffer. Call it whenever the buffer being drawn to changes.
+void setPixelBufferRows(uintptr_t base){
+	for (int y = 0; y < screen.height; y++) fbRows[y] = (volatile short int *) (base + y * screen.stride * sizeof(short int));
+}
+
+// Picks the screen size. Call it before vgaSetup. Returns false if the size is beyond MAX_X by MAX_Y.
+bool setDisplayGeometry(int width, int height){
+
+	if (width < 1 || height < 1 || width > MAX_X || height > MAX_Y) return false;
+	screen.width = width;
+	screen.height = height;
+	clipRect = screenRect();
+	return true;
+
 }
 
 // Draws just one pixel to the appropriate frame buffer.
 void drawIndividualPixel(int x, int y, short int colour){
-	volatile short int *pixelAddress;
-	pixelAddress = (volatile short int *) (CURRENT_BACK_BUFFER_ADDRESS + (y << 10) + (x << 1)); 
-	*pixelAddress = colour;
+	if (x < clipRect.x0 || x > clipRect.x1 || y < clipRect.y0 || y > clipRect.y1) return;
+	fbRows[y][x] = colour;
 }
 
-// Writes black to every pixel in the pixel buffer
-void clearWholeScreen(){
-	
-	for(int x = 0; x < MAX_X; x++){ // 320px
-		for(int y = 0; y < MAX_Y; y++) { // by 240px
-			drawIndividualPixel(x, y, 0); // draw a black pixel
+// Fills pixels x0..x1 of row y. Halfword stores run up to an 8 byte boundary, then the middle of the row
+// goes out as doublewords, which the bus handles far better than one 16-bit store per pixel.
+void fillSpan(int x0, int x1, int y, short int colour){
+
+	if (y < clipRect.y0 || y > clipRect.y1) return;
+	if (x0 < clipRect.x0) x0 = clipRect.x0;
+	if (x1 > clipRect.x1) x1 = clipRect.x1;
+	if (x0 > x1) return;
+
+	volatile short int *p = fbRows[y] + x0;
+	volatile short int *end = fbRows[y] + x1 + 1;
+
+	unsigned int word = (unsigned short int) colour | ((unsigned int) (unsigned short int) colour << 16);
+	unsigned long long dword = word | ((unsigned long long) word << 32);
+
+	while (p < end && ((uintptr_t) p & 7)) *p++ = colour;
+
+	volatile unsigned long long *d = (volatile unsigned long long *) p;
+	volatile unsigned long long *dEnd = (volatile unsigned long long *) ((uintptr_t) end & ~(uintptr_t) 7);
+	while (d < dEnd) *d++ = dword;
+
+	p = (volatile short int *) d;
+	while (p < end) *p++ = colour;
+
+}
+
+// Fills a rectangle (inclusive corners) one row span at a time.
+void fillRect(Rect *r, short int colour){
+	int y0 = r->y0 < clipRect.y0 ? clipRect.y0 : r->y0;
+	int y1 = r->y1 > clipRect.y1 ? clipRect.y1 : r->y1;
+	for (int y = y0; y <= y1; y++) fillSpan(r->x0, r->x1, y, colour);
+}
+
+// Copies pixels x0..x1 of row y from s. When the source and destination share doubleword (or word)
+// alignment the copy goes a doubleword (or word) at a time.
+void blitSpan(const short int *s, int x0, int x1, int y){
+
+	volatile short int *p = fbRows[y] + x0;
+	volatile short int *end = fbRows[y] + x1 + 1;
+	uintptr_t skew = (uintptr_t) s ^ (uintptr_t) p;
+
+	if ((skew & 7) == 0) {
+		while (p < end && ((uintptr_t) p & 7)) *p++ = *s++;
+		for (; end - p >= 4; p += 4, s += 4) {
+			unsigned long long dword;
+			memcpy(&dword, s, sizeof dword);
+			*(volatile unsigned long long *) p = dword;
+		}
+	} else if ((skew & 3) == 0) {
+		if (p < end && ((uintptr_t) p & 2)) *p++ = *s++;
+		for (; end - p >= 2; p += 2, s += 2) {
+			unsigned int word;
+			memcpy(&word, s, sizeof word);
+			*(volatile unsigned int *) p = word;
+		}
+	}
+	while (p < end) *p++ = *s++;
+
+}
+
+// Copies a w x h block of pixels to (x, y), one row span at a time. srcStride is the source row length
+// in pixels.
+void blitRect(const short int *src, int srcStride, int x, int y, int w, int h){
+
+	int x0 = x < clipRect.x0 ? clipRect.x0 : x;
+	int y0 = y < clipRect.y0 ? clipRect.y0 : y;
+	int x1 = x + w - 1 > clipRect.x1 ? clipRect.x1 : x + w - 1;
+	int y1 = y + h - 1 > clipRect.y1 ? clipRect.y1 : y + h - 1;
+	if (x0 > x1) return;
+
+	for (int row = y0; row <= y1; row++) blitSpan(src + (row - y) * srcStride + (x0 - x), x0, x1, row);
+
+}
+
+// blitRect that leaves pixels of colour key untouched. Each row goes out as runs of opaque pixels.
+void blitRectKeyed(const short int *src, int srcStride, int x, int y, int w, int h, short int key){
+
+	int x0 = x < clipRect.x0 ? clipRect.x0 : x;
+	int y0 = y < clipRect.y0 ? clipRect.y0 : y;
+	int x1 = x + w - 1 > clipRect.x1 ? clipRect.x1 : x + w - 1;
+	int y1 = y + h - 1 > clipRect.y1 ? clipRect.y1 : y + h - 1;
+
+	for (int row = y0; row <= y1; row++) {
+		const short int *s = src + (row - y) * srcStride - x;
+		int col = x0;
+		while (col <= x1) {
+			while (col <= x1 && s[col] == key) col++;
+			int runStart = col;
+			while (col <= x1 && s[col] != key) col++;
+			if (runStart < col) blitSpan(s + runStart, runStart, col - 1, row);
 		}
 	}
 
 }
 
+// Writes black to every pixel in the pixel buffer
+void clearWholeScreen(){
+	Rect whole = screenRect();
+	fillRect(&whole, 0);
+}
+
 // Draws a nxn box centered at the pixel x,y
 void drawBox(int x, int y, short int colour){
 	int n = 3;
@@ -152,7 +532,9 @@ void drawBox(int x, int y, short int colour){
 		}
 	}
 }
-// Draws a line between the two points specified on screen. 
+// Draws a line between the two points specified on screen, clipped to clipRect. Steps before the clip
+// rectangle only advance the error term. Shallow lines go out as one span per row, and steep lines walk
+// a pixel pointer down the rows, so no pixel address is recomputed.
 void drawBresenhamLine(int x0, int y0, int x1, int y1, short int colour){
 	
 	bool isSteep = abs(x0-x1) < abs(y0-y1);
@@ -174,22 +556,202 @@ void drawBresenhamLine(int x0, int y0, int x1, int y1, short int colour){
 	
 	int y = y0;
 	int x = x0;
-	
-	while(x<=x1) {
-		
-		if (isSteep) drawIndividualPixel(y,x, colour);
-		else drawIndividualPixel(x,y,colour);
-		
+
+	// x runs along the major axis, which is the screen's y axis for steep lines
+	int majorMin = isSteep ? clipRect.y0 : clipRect.x0;
+	int majorMax = isSteep ? clipRect.y1 : clipRect.x1;
+	if (x1 > majorMax) x1 = majorMax;
+
+	for (; x < majorMin && x <= x1; x++) {
 		error = error + dy;
 		if (error > 0){
 			y = y + moveY;
 			error = error - dx;
 		}
-		
-		x++;
-		
 	}
+	if (x > x1) return;
+
+	if (isSteep) {
+
+		volatile short int *p = fbRows[x] + y;
+		for (; x <= x1; x++) {
+			if (y >= clipRect.x0 && y <= clipRect.x1) *p = colour;
+			p += screen.stride;
+			error = error + dy;
+			if (error > 0){
+				y = y + moveY;
+				p += moveY;
+				error = error - dx;
+			}
+		}
+
+	} else {
+
+		int runStart = x;
+		for (; x <= x1; x++) {
+			error = error + dy;
+			if (error > 0){
+				fillSpan(runStart, x, y, colour);
+				runStart = x + 1;
+				y = y + moveY;
+				error = error - dx;
+			}
+		}
+		fillSpan(runStart, x1, y, colour);
+
+	}
+
+}
+
+// Fills a convex polygon one clipped span per row. Each row runs between the outermost points where the
+// edges cross its centre line, so drawing the outline on top gives the same edge as an outline alone.
+void fillConvexPolygon(int * xs, int * ys, int n, short int colour){
+
+	int yMin = ys[0];
+	int yMax = ys[0];
+	for (int j = 1; j < n; j++) {
+		if (ys[j] < yMin) yMin = ys[j];
+		if (ys[j] > yMax) yMax = ys[j];
+	}
+	if (yMin < clipRect.y0) yMin = clipRect.y0;
+	if (yMax > clipRect.y1) yMax = clipRect.y1;
+
+	for (int y = yMin; y <= yMax; y++) {
+		float left = screen.width;
+		float right = -1;
+		for (int j = 0; j < n; j++) {
+			int k = j + 1 < n ? j + 1 : 0;
+			if ((y < ys[j] && y < ys[k]) || (y > ys[j] && y > ys[k])) continue;
+			// A flat edge on this row counts with both ends
+			float xa = ys[j] == ys[k] ? xs[j] : xs[j] + (float) (y - ys[j]) * (xs[k] - xs[j]) / (ys[k] - ys[j]);
+			float xb = ys[j] == ys[k] ? xs[k] : xa;
+			if (xa < left) left = xa;
+			if (xb < left) left = xb;
+			if (xa > right) right = xa;
+			if (xb > right) right = xb;
+		}
+		if (left <= right) fillSpan(left + 0.5, right + 0.5, y, colour);
+	}
+
+}
+
+// Filled midpoint circle. Each step of the octant walk fills the two rows at +-y, and the rows at +-x
+// once x is about to move on, so no row is written more than twice.
+void fillDisc(int cx, int cy, int r, short int colour){
+
+	int x = r;
+	int y = 0;
+	int error = 1 - r;
+
+	while (x >= y) {
+		fillSpan(cx - x, cx + x, cy + y, colour);
+		fillSpan(cx - x, cx + x, cy - y, colour);
+		int rowX = x;
+		int spanY = y;
+		y++;
+		if (error < 0) {
+			error += 2*y + 1;
+		} else {
+			x--;
+			error += 2*(y - x) + 1;
+		}
+		if (x != rowX || x < y) {
+			fillSpan(cx - spanY, cx + spanY, cy + rowX, colour);
+			fillSpan(cx - spanY, cx + spanY, cy - rowX, colour);
+		}
+	}
+
+}
+
+// ----- Render command queue -----
+// The simulation doesn't draw. Each frame it queues compact commands (clears, dots, polylines, arcs,
+// sprites) describing the scene, and the renderer rasterises them in an order that suits the pixel
+// buffer. Commands and the verticies they refer to live in preallocated rings. A frame's commands run
+// from renderQueueTail to renderQueueHead, and are consumed once the frame is drawn. The ring holds the
+// busiest frame the scene sizes allow, so nothing should be dropped. If something is, it is counted.
+
+#define RC_CLEAR                0 // Fill the bounds with colour
+#define RC_FIELD                1 // Fluid density field over the bounds
+#define RC_POINT                2 // 2x2 dot at (arg[0], arg[1])
+#define RC_POLYLINE             3 // arg[1] verticies from arg[0], closed if arg[2]
+#define RC_POLYGON_FILL         4 // Convex polygon of arg[1] verticies from arg[0]
+#define RC_ARC                  5 // Circle of radius arg[1] around vertex arg[0], the half facing away from (arg[2], arg[3])
+#define RC_DISC                 6 // Filled circle of radius arg[1] around vertex arg[0]
+#define RC_RECT                 7 // Fill the bounds with colour
+#define RC_SPRITE               8 // Blit sprite (row stride arg[0]) at the bounds, skipping colour as a key
+
+#define RENDER_LAYER_BACKGROUND 0
+#define RENDER_LAYER_FLUID      1
+#define RENDER_LAYER_BODIES     2
+#define RENDER_LAYER_UI         3
+#define RENDER_LAYER_CURSOR     4
+#define RENDER_LAYERS           5
+
+typedef struct RenderCommand {
+
+    unsigned char type;
+    unsigned char layer;
+    short int colour;
+    short int x0, y0, x1, y1; // Bounds of everything the command draws, inclusive
+    short int arg[4];
+    const short int * sprite;
+
+} RenderCommand;
+
+#define RENDER_COMMANDS_PER_BODY 7 // A filled capsule: its core, two discs, two sides and two arcs
+#define RENDER_QUEUE_FIXED      7 // The background, the UI sprite and up to five cursor bars
+#define RENDER_QUEUE_NEEDED     (NUM_PARTICLES + RENDER_COMMANDS_PER_BODY * MAX_BODIES + RENDER_QUEUE_FIXED)
+#ifndef RENDER_QUEUE_SIZE
+#define RENDER_QUEUE_SIZE       RENDER_QUEUE_NEEDED
+#endif
+#define RENDER_VERTEX_RING      1024
+
+_Static_assert(RENDER_QUEUE_SIZE >= RENDER_QUEUE_NEEDED, "RENDER_QUEUE_SIZE can't hold a dot per particle and every body");
+
+RenderCommand renderQueue[RENDER_QUEUE_SIZE];
+unsigned int renderQueueHead = 0; // Taken mod the ring size, and rewound by clearRenderQueue
+unsigned int renderQueueTail = 0;
+short int renderVerts[RENDER_VERTEX_RING][2];
+unsigned int renderVertsHead = 0;
+int renderCommandsDropped = 0;
+
+// Returns the new command, or NULL if the ring is full.
+RenderCommand * queueRenderCommand(int type, int layer, short int colour, int x0, int y0, int x1, int y1){
+
+    if (renderQueueHead - renderQueueTail >= RENDER_QUEUE_SIZE) {
+        renderCommandsDropped++;
+        return NULL;
+    }
+
+    RenderCommand *c = &renderQueue[renderQueueHead++ % RENDER_QUEUE_SIZE];
+    c->type = type;
+    c->layer = layer;
+    c->colour = colour;
+    c->x0 = x0;
+    c->y0 = y0;
+    c->x1 = x1;
+    c->y1 = y1;
+    c->arg[0] = c->arg[1] = c->arg[2] = c->arg[3] = 0;
+    c->sprite = NULL;
+    return c;
+
+}
 
+// Drops the frame's commands once they are drawn. Starting the counts again from 0 keeps the slots
+// contiguous for any ring size, since the size follows NUM_PARTICLES and needn't divide 2^32.
+void clearRenderQueue() {
+    renderQueueHead = renderQueueTail = 0;
+}
+
+// Copies n verticies into the vertex ring and returns where they start.
+int queueRenderVerts(int * xs, int * ys, int n){
+    int start = renderVertsHead % RENDER_VERTEX_RING;
+    for (int j = 0; j < n; j++) {
+        renderVerts[renderVertsHead % RENDER_VERTEX_RING][0] = xs[j];
+        renderVerts[renderVertsHead % RENDER_VERTEX_RING][1] = ys[j];
+        renderVertsHead++;
+    }
+    return start;
 }
 
 // =======================================================================================================
@@ -225,75 +787,234 @@ typedef struct mouseData {
 mouseData mData;
 mouseData prevmData;
 
-void updateMouse() {
-  volatile int *PS2_ptr = (int *)PS2_BASE;
-  int PS2_data, RVALID;
-  signed char inputData[3];
+// A mouse packet is three bytes: buttons and flags, then the x and y movement as 9 bit two's complement,
+// with the sign bits in the first byte. The interrupt only reads the bytes already in the FIFO, so a
+// packet can arrive split over several interrupts. PS2PacketParser picks up where the last one stopped.
+// Bytes of one packet come about 1 ms apart, packets at the 40 Hz sample rate 25 ms apart, so a byte
+// that comes PS2_PACKET_GAP_US after the one before starts a new packet whatever the parser expected.
+#define PS2_DATA_RVALID         0x8000
+#define PS2_FIFO_BYTES          256
+#define PS2_LEFT                0x01
+#define PS2_RIGHT               0x02
+#define PS2_MIDDLE              0x04
+#define PS2_ALWAYS_ONE          0x08 // Set in every first byte, which is how a lost byte is noticed
+#define PS2_X_SIGN              0x10
+#define PS2_Y_SIGN              0x20
+#define PS2_X_OVERFLOW          0x40
+#define PS2_Y_OVERFLOW          0x80
+#define PS2_PACKET_GAP_US       10000
+
+typedef struct PS2Packet {
+  int dx, dy; // Mouse convention, so +y is up
+  bool left, right, middle;
+} PS2Packet;
+
+typedef struct PS2PacketParser {
+  unsigned char bytes[3];
+  int count; // Bytes of the current packet so far
+  unsigned long long lastByte; // timeNow when the last byte came
+  int packets; // Complete packets
+  int resyncs; // Bytes thrown away while looking for a first byte
+} PS2PacketParser;
+
+PS2PacketParser ps2Parser;
+volatile unsigned int mouseIsrTicks = 0; // Longest interrupt since the HUD last showed it
+
+// Takes one byte, which came at now, and returns true once it completes a packet, which is then in
+// *packet. A byte that cannot start a packet is dropped, and the next one is tried instead. The always
+// one bit alone can't tell a first byte from movement that happens to have it set, so a gap also throws
+// away a part packet: a parser that locked on at the wrong byte is back in step one packet later.
+// Movement that overflowed is meaningless, so it reads as zero, but the buttons still count. Touches
+// nothing but its arguments.
+bool ps2FeedByte(PS2PacketParser * parser, unsigned char byte, unsigned long long now, PS2Packet * packet) {
+
+  if (parser->count != 0 && now - parser->lastByte >= PS2_PACKET_GAP_US * TIME_TICKS_PER_US) {
+    parser->resyncs += parser->count;
+    parser->count = 0;
+  }
+  parser->lastByte = now;
+  if (parser->count == 0 && !(byte & PS2_ALWAYS_ONE)) {
+    parser->resyncs++;
+    return false;
+  }
 
-  int i = 0;
-  while(!i){
-    PS2_data = *(PS2_ptr);
-    RVALID = PS2_data & 0x8000;
-    if(RVALID){
-      inputData[0] = PS2_data & 0xFF;
-      i++;
+  parser->bytes[parser->count++] = byte;
+  if (parser->count < 3) return false;
+  parser->count = 0;
+  parser->packets++;
+
+  unsigned char flags = parser->bytes[0];
+  packet->left = flags & PS2_LEFT;
+  packet->right = flags & PS2_RIGHT;
+  packet->middle = flags & PS2_MIDDLE;
+  packet->dx = (flags & PS2_X_OVERFLOW) ? 0 : parser->bytes[1] - ((flags & PS2_X_SIGN) ? 256 : 0);
+  packet->dy = (flags & PS2_Y_OVERFLOW) ? 0 : parser->bytes[2] - ((flags & PS2_Y_SIGN) ? 256 : 0);
+  return true;
+
+}
+
+#ifdef PS2_TEST
+// Host check of ps2FeedByte. Build with
+//   gcc -O2 -DHOST_BUILD -DPS2_TEST fluid_simulator.c -lm
+// Each stream is fed a byte at a time, as the interrupt would, and what comes out is checked against the
+// packets and resync count it should give. Prints each mismatch and returns how many streams failed.
+#ifndef HOST_BUILD
+#error "PS2_TEST needs HOST_BUILD"
+#endif
+
+typedef struct PS2TestStream {
+  const char * name;
+  int numBytes;
+  unsigned char bytes[12];
+  int ms[12]; // When the interrupt read each byte
+  int numPackets;
+  PS2Packet packets[4];
+  int resyncs;
+} PS2TestStream;
+
+PS2TestStream ps2TestStreams[] = {
+  {"valid", 6, {0x09, 0x05, 0x03, 0x38, 0xFB, 0xFE}, {0, 1, 2, 25, 26, 27},
+   2, {{5, 3, true, false, false}, {-5, -2, false, false, false}}, 0},
+  // One packet read by three interrupts, the next two by one
+  {"split", 9, {0x0A, 0x02, 0x01, 0x0C, 0xFF, 0x00, 0x08, 0x01, 0x01}, {0, 2, 4, 25, 25, 25, 25, 25, 25},
+   3, {{2, 1, false, true, false}, {255, 0, false, false, true}, {1, 1, false, false, false}}, 0},
+  // A packet that lost its first byte. Neither byte left has the always one bit, so both are dropped.
+  {"lost byte", 5, {0x05, 0x03, 0x09, 0x05, 0x03}, {0, 1, 25, 26, 27},
+   1, {{5, 3, true, false, false}}, 2},
+  // Starts at the movement bytes of a packet, which both have the always one bit set. Going by that bit
+  // alone, the parser would take them and the next first byte as a packet and be out of step after it.
+  {"misaligned", 8, {0x0C, 0x08, 0x09, 0x05, 0x03, 0x08, 0x01, 0x01}, {0, 1, 25, 26, 27, 50, 51, 52},
+   2, {{5, 3, true, false, false}, {1, 1, false, false, false}}, 2},
+  {"overflow", 6, {0x4A, 0xFF, 0x10, 0x88, 0x10, 0xFF}, {0, 1, 2, 25, 26, 27},
+   2, {{0, 16, false, true, false}, {16, 0, false, false, false}}, 0},
+};
+
+int runPS2Test() {
+
+  int numStreams = sizeof ps2TestStreams / sizeof ps2TestStreams[0];
+  int failed = 0;
+  for (int s = 0; s < numStreams; s++) {
+    PS2TestStream * stream = &ps2TestStreams[s];
+    PS2PacketParser parser = {0};
+    PS2Packet packet;
+    int numPackets = 0;
+    bool bad = false;
+    for (int k = 0; k < stream->numBytes; k++) {
+      unsigned long long now = stream->ms[k] * 1000ull * TIME_TICKS_PER_US;
+      if (!ps2FeedByte(&parser, stream->bytes[k], now, &packet)) continue;
+      PS2Packet * want = &stream->packets[numPackets++];
+      if (numPackets > stream->numPackets || packet.dx != want->dx || packet.dy != want->dy ||
+          packet.left != want->left || packet.right != want->right || packet.middle != want->middle) {
+        printf("%s: packet %d at byte %d is dx %d dy %d buttons %d%d%d\n", stream->name, numPackets - 1, k,
+               packet.dx, packet.dy, packet.left, packet.right, packet.middle);
+        bad = true;
+        break;
+      }
+    }
+    if (!bad && (numPackets != stream->numPackets || parser.resyncs != stream->resyncs)) {
+      printf("%s: %d packets and %d resyncs, wanted %d and %d\n", stream->name, numPackets, parser.resyncs,
+             stream->numPackets, stream->resyncs);
+      bad = true;
     }
+    failed += bad;
   }
+  printf("%d streams, %d failed\n", numStreams, failed);
+  return failed;
 
-  while(i < 3){
-    PS2_data = *(PS2_ptr);
-    RVALID = PS2_data & 0x8000;
-    if(RVALID){
-      inputData[i] = PS2_data & 0xFF;
-      i++;
-    }
+}
+#endif
+
+// Input events, from the mouse interrupt to the main loop. The interrupt is the only writer of
+// inputHead and the main loop the only writer of inputTail, so the ring needs no lock. Each side
+// publishes its slot before moving its index past it. If the main loop falls a whole ring behind, new
+// events are dropped and counted.
+#define INPUT_RING_SIZE         64 // Power of two
+
+typedef enum {
+  INPUT_MOTION, // dx, dy in mouse convention
+  INPUT_BUTTONS, // The new PS2_LEFT | PS2_RIGHT | PS2_MIDDLE state
+  INPUT_PLACE // Puts the cursor at (dx, dy). Only input traces use it
+} InputEventType;
+
+typedef struct InputEvent {
+  unsigned char type;
+  unsigned char buttons;
+  short int dx, dy;
+} InputEvent;
+
+InputEvent inputRing[INPUT_RING_SIZE];
+volatile unsigned int inputHead = 0;
+volatile unsigned int inputTail = 0;
+volatile int inputEventsDropped = 0;
+unsigned char ps2Buttons = 0; // As last pushed, so only changes become events
+
+void pushInputEvent(InputEventType type, int dx, int dy, unsigned char buttons) {
+
+  unsigned int head = inputHead;
+  if (head - inputTail >= INPUT_RING_SIZE) {
+    inputEventsDropped++;
+    return;
   }
+  inputRing[head % INPUT_RING_SIZE] = (InputEvent){type, buttons, dx, dy};
+  __sync_synchronize();
+  inputHead = head + 1;
+
+}
 
-  mData.left = inputData[0] & 1;
-  mData.middle = inputData[0] & 4;
-  mData.right = inputData[0] & 2;
+bool pollInputEvent(InputEvent * event) {
 
-  mData.x += inputData[1];
-  mData.y -= inputData[2];
+  unsigned int tail = inputTail;
+  if (tail == inputHead) return false;
+  __sync_synchronize();
+  *event = inputRing[tail % INPUT_RING_SIZE];
+  __sync_synchronize();
+  inputTail = tail + 1;
+  return true;
 
-  mData.vx = inputData[1];
-  mData.vy = -inputData[2];
+}
 
-  if (mData.x >= MAX_X) mData.x = MAX_X - 1;
-  if (mData.y >= MAX_Y) mData.y = MAX_Y - 1;
+// Empties the FIFO, turning each packet into events, and returns. The loop is bounded by the FIFO's
+// size, so a slow or noisy mouse can't hold the interrupt.
+void updateMouse() {
+  volatile int *PS2_ptr = (int *)PS2_BASE;
+  PS2Packet packet;
+  unsigned long long now = timeNow();
+
+  for (int k = 0; k < PS2_FIFO_BYTES; k++) {
+    int PS2_data = *(PS2_ptr);
+    if (!(PS2_data & PS2_DATA_RVALID)) break;
+    if (!ps2FeedByte(&ps2Parser, PS2_data & 0xFF, now, &packet)) continue;
+    unsigned char buttons = (packet.left ? PS2_LEFT : 0) | (packet.right ? PS2_RIGHT : 0) | (packet.middle ? PS2_MIDDLE : 0);
+    if (packet.dx || packet.dy) pushInputEvent(INPUT_MOTION, packet.dx, packet.dy, buttons);
+    if (buttons != ps2Buttons) pushInputEvent(INPUT_BUTTONS, 0, 0, buttons);
+    ps2Buttons = buttons;
+  }
 
-  if (mData.x < 0) mData.x = 0;
-  if (mData.y < 0) mData.y = 0;
-  
 }
 
-void drawMouse(mouseData *data, short int colour) {
+// Queues the cursor: a ring of four short bars, filled in while the left button is down.
+void queueCursorCommands(mouseData *data, short int colour) {
     
     int x = data -> x;
     int y = data -> y;
 
     if(x<MOUSE_RADIUS) x=MOUSE_RADIUS;
-    else if (x>MAX_X-1-MOUSE_RADIUS) x = MAX_X-1-MOUSE_RADIUS;
+    else if (x>screen.width-1-MOUSE_RADIUS) x = screen.width-1-MOUSE_RADIUS;
     if(y<MOUSE_RADIUS) y=MOUSE_RADIUS;
-    else if (y>MAX_Y-1-MOUSE_RADIUS) y = MAX_Y-1-MOUSE_RADIUS;
+    else if (y>screen.height-1-MOUSE_RADIUS) y = screen.height-1-MOUSE_RADIUS;
 
-    for(int i = -1; i<2; i++) {
-        drawIndividualPixel(x + i, y + MOUSE_RADIUS, colour);
-        drawIndividualPixel(x + i, y - MOUSE_RADIUS, colour);
-        drawIndividualPixel(x + MOUSE_RADIUS, y + i, colour);
-        drawIndividualPixel(x - MOUSE_RADIUS, y + i, colour);
-    }
+    queueRenderCommand(RC_RECT, RENDER_LAYER_CURSOR, colour, x - 1, y + MOUSE_RADIUS, x + 1, y + MOUSE_RADIUS);
+    queueRenderCommand(RC_RECT, RENDER_LAYER_CURSOR, colour, x - 1, y - MOUSE_RADIUS, x + 1, y - MOUSE_RADIUS);
+    queueRenderCommand(RC_RECT, RENDER_LAYER_CURSOR, colour, x + MOUSE_RADIUS, y - 1, x + MOUSE_RADIUS, y + 1);
+    queueRenderCommand(RC_RECT, RENDER_LAYER_CURSOR, colour, x - MOUSE_RADIUS, y - 1, x - MOUSE_RADIUS, y + 1);
     if(data -> left){
-      for(int i = -1; i < 2; i++) {
-        for(int j = -1; j < 2; j++){
-          drawIndividualPixel(x + i, y+j, colour);
-        }
-      }
+      queueRenderCommand(RC_RECT, RENDER_LAYER_CURSOR, colour, x - 1, y - 1, x + 1, y + 1);
     }
     
 }
 
 void setA9stack(){
+#ifndef HOST_BUILD
   int stack,mode;
   stack = 0xFFFFFFFF - 7;
   mode = 0b11010010;
@@ -302,16 +1023,21 @@ void setA9stack(){
 
   mode = 0b11010011;
   __asm__ volatile("msr cpsr, %0":: "r"(mode));
+#endif
 }
 
 void enableInterrupt(){
+#ifndef HOST_BUILD
   int status = 0b01010011;
   __asm__ volatile("msr cpsr, %0":: "r"(status));
+#endif
 }
 
 void configGIC(){
   *((volatile int*) 0xFFFED84C) = 0x01000000;
-  *((volatile int*) 0xFFFED108) = 0x00008000;
+#ifndef INPUT_REPLAY
+  *((volatile int*) 0xFFFED108) = 0x00008000; // IRQ 79, the mouse. Replay leaves it masked.
+#endif
 
 // all priority interupts enbaled
   *((volatile int*) 0xFFFEC104) = 0xFFFF;
@@ -321,54 +1047,201 @@ void configGIC(){
   *((volatile int*) 0xFFFED000) = 1;
 }
 
-void __attribute__ ((interrupt)) __cs3_isr_irq(void){
+void ARM_ISR __cs3_isr_irq(void){
   int interruptID = *((volatile int*) 0xFFFEC10C);
+  unsigned int start = timeNow();
+
+  if (interruptID == INTERVAL_TIMER_IRQ) {
+    timeTickInterrupt();
+  } else if (interruptID == 79) {
+    updateMouse();
+    unsigned int ticks = (unsigned int) timeNow() - start;
+    if (ticks > mouseIsrTicks) mouseIsrTicks = ticks;
+  } else {
+    while(1);
+  }
+
+  *((volatile int*) 0xFFFEC110) = interruptID;
+  return;
+}
 
-  if(interruptID != 79) while(1);
-    //   prevmData = mData;
-  updateMouse();
+// The UI buttons act when the left button goes down over them.
+void handleUIClick() {
   if((mData.x >= SWITCH_BUTTON_X) && (mData.x < (SWITCH_BUTTON_X + 15)) && (mData.y >= SWITCH_BUTTON_Y) && (mData.y < (SWITCH_BUTTON_Y + 12))){
-    if(!prevmData.left && mData.left){
-      switchSimHandler();
-    }
+    switchSimHandler();
   }
   else if((mData.x >= RESET_BUTTON_X) && (mData.x < (RESET_BUTTON_X + 15)) && (mData.y >= RESET_BUTTON_Y) && (mData.y < (RESET_BUTTON_Y + 12))){
-    if(!prevmData.left && mData.left){
-      resetSimHandler();
-    }
+    resetSimHandler();
   }
   else if((mData.x >= PLAY_BUTTON_X) && (mData.x < (PLAY_BUTTON_X + 15)) && (mData.y >= PLAY_BUTTON_Y) && (mData.y < (PLAY_BUTTON_Y + 12))){
-    if(!prevmData.left && mData.left){
-      play = !play;
-    }
+    play = !play;
   }
   else if((mData.x >= FF_BUTTON_X) && (mData.x < (FF_BUTTON_X + 15)) && (mData.y >= FF_BUTTON_Y) && (mData.y < (FF_BUTTON_Y + 12))){
-    if(!prevmData.left && mData.left){
-      fastFowardHandler();
+    fastFowardHandler();
+  }
+}
+
+// ----- Input traces -----
+// Building with INPUT_RECORD keeps every event the main loop applies, tagged with its frame. A middle
+// click, or a full trace, writes it out as text: over the JTAG UART on the board, or to stdout on the
+// host. Each line is a C initializer, {frame, type, buttons, dx, dy}, so a saved trace can be built back
+// in with INPUT_REPLAY="file". Replay pushes each event into the ring on its frame, and from there it
+// takes the mouse's path exactly. The benchmarks, and CPUlator, which has no mouse, can then rerun the
+// same session. A trace starts by placing the cursor where it was. While replaying, the mouse is never
+// set up and its interrupt stays masked, so replay is the ring's only writer, and each frame runs exactly
+// one step, so an event lands on the same step it did when recorded. A frame with more events than the
+// ring holds can't be replayed as it was recorded: replay reports it and stops there, and
+// inputReplayFailed is set.
+
+#define JTAG_UART_BASE          0xFF201000
+#define INPUT_TRACE_MAX         4096
+
+typedef struct InputTraceRecord {
+  unsigned int frame;
+  int type, buttons, dx, dy;
+} InputTraceRecord;
+
+unsigned int inputFrame = 0; // Calls to processInputEvents
+
+#ifndef HOST_BUILD
+// Text for the host computer, read with the JTAG UART terminal.
+void jtagUartWrite(const char * text) {
+  volatile int * uartPtr = (volatile int *) JTAG_UART_BASE;
+  for (; *text; text++) {
+    while (!(*(uartPtr + 1) & 0xFFFF0000)); // Wait for space in the write FIFO
+    *uartPtr = *text;
+  }
+}
+#endif
+
+#ifdef INPUT_RECORD
+InputTraceRecord inputTrace[INPUT_TRACE_MAX];
+int inputTraceLength = 0;
+
+void inputTraceWrite(const char * text) {
+#ifdef HOST_BUILD
+  fputs(text, stdout);
+#else
+  jtagUartWrite(text);
+#endif
+}
+
+// Writes the trace so far and starts a new one. Frames count from the trace's first event, so a trace
+// saved partway through a session replays from the start.
+void writeInputTrace() {
+  char line[64];
+
+  for (int k = 0; k < inputTraceLength; k++) {
+    InputTraceRecord * r = &inputTrace[k];
+    snprintf(line, sizeof line, "{%u, %d, %d, %d, %d},\n", r->frame - inputTrace[0].frame, r->type, r->buttons, r->dx, r->dy);
+    inputTraceWrite(line);
+  }
+  inputTraceLength = 0;
+}
+
+void recordInputEvent(InputEvent * event) {
+
+  if (inputTraceLength == 0 && event->type != INPUT_PLACE) inputTrace[inputTraceLength++] = (InputTraceRecord){inputFrame, INPUT_PLACE, 0, mData.x, mData.y};
+  inputTrace[inputTraceLength++] = (InputTraceRecord){inputFrame, event->type, event->buttons, event->dx, event->dy};
+
+  bool middleClick = event->type == INPUT_BUTTONS && (event->buttons & PS2_MIDDLE) && !mData.middle;
+  if (middleClick || inputTraceLength == INPUT_TRACE_MAX) writeInputTrace();
+
+}
+#endif
+
+#ifdef INPUT_REPLAY
+InputTraceRecord inputReplay[] = {
+#include INPUT_REPLAY
+};
+int inputReplayNext = 0;
+bool inputReplayFailed = false;
+
+// Pushes this frame's events, as the interrupt would have.
+void replayInputEvents() {
+  int n = sizeof inputReplay / sizeof inputReplay[0];
+  for (; inputReplayNext < n && inputReplay[inputReplayNext].frame <= inputFrame; inputReplayNext++) {
+    InputTraceRecord * r = &inputReplay[inputReplayNext];
+    if (inputHead - inputTail >= INPUT_RING_SIZE) {
+      char line[80];
+      snprintf(line, sizeof line, "input replay: frame %u has more than %d events, stopping\n", r->frame, INPUT_RING_SIZE);
+#ifdef HOST_BUILD
+      fputs(line, stderr);
+#else
+      jtagUartWrite(line);
+#endif
+      inputReplayFailed = true;
+      inputReplayNext = n;
+      return;
     }
+    pushInputEvent(r->type, r->dx, r->dy, r->buttons);
   }
+}
 
-  *((volatile int*) 0xFFFEC110) = interruptID;
-  return;
+void restartInputReplay() {
+  inputFrame = 0;
+  inputReplayNext = 0;
+  inputReplayFailed = false;
+  mData.left = mData.right = mData.middle = false;
+}
+#endif
+
+// Applies the events the interrupt has queued since the last call. The main loop calls it between
+// frames, so a reset or a switch never lands in the middle of a step or a draw.
+void processInputEvents() {
+  InputEvent event;
+
+#ifdef INPUT_REPLAY
+  replayInputEvents();
+#endif
+  while (pollInputEvent(&event)) {
+#ifdef INPUT_RECORD
+    recordInputEvent(&event);
+#endif
+    if (event.type == INPUT_PLACE) {
+      mData.x = event.dx;
+      mData.y = event.dy;
+    } else if (event.type == INPUT_MOTION) {
+      mData.x += event.dx;
+      mData.y -= event.dy;
+      mData.vx = event.dx;
+      mData.vy = -event.dy;
+      if (mData.x >= screen.width) mData.x = screen.width - 1;
+      if (mData.y >= screen.height) mData.y = screen.height - 1;
+      if (mData.x < 0) mData.x = 0;
+      if (mData.y < 0) mData.y = 0;
+    } else {
+      bool pressed = !mData.left && (event.buttons & PS2_LEFT);
+      mData.left = event.buttons & PS2_LEFT;
+      mData.right = event.buttons & PS2_RIGHT;
+      mData.middle = event.buttons & PS2_MIDDLE;
+      if (pressed) handleUIClick();
+    }
+  }
+  inputFrame++;
 }
 
-void __attribute__ ((interrupt)) __cs3_isr_undef(void){while(1);}
+void ARM_ISR __cs3_isr_undef(void){while(1);}
 
-void __attribute__ ((interrupt)) __cs3_isr_swi(void){while(1);}
+void ARM_ISR __cs3_isr_swi(void){while(1);}
 
-void __attribute__ ((interrupt)) __cs3_isr_pabort(void){while(1);}
+void ARM_ISR __cs3_isr_pabort(void){while(1);}
 
-void __attribute__ ((interrupt)) __cs3_isr_dabort(void){while(1);}
+void ARM_ISR __cs3_isr_dabort(void){while(1);}
 
-void __attribute__ ((interrupt)) __cs3_isr_fiq(void){while(1);}
+void ARM_ISR __cs3_isr_fiq(void){while(1);}
 
+// Under INPUT_REPLAY there may be no mouse at all (CPUlator has none), so the PS/2 handshake, which waits
+// for the mouse to answer, is left out along with its interrupt. The timer's interrupt still runs.
 void intializeMouse() {
+#ifndef INPUT_REPLAY
   volatile int * PS2_ptr = (volatile int *)0xFF200100;
   int PS2_data, RVALID;
   char byte1 = 0, byte2 = 0;
+#endif
 
-  mData.x = MAX_X / 2;
-  mData.y = MAX_Y / 2;
+  mData.x = screen.width / 2;
+  mData.y = screen.height / 2;
 
   mData.vx = 0.0;
   mData.vy = 0.0;
@@ -381,6 +1254,7 @@ void intializeMouse() {
 
   configGIC();
 
+#ifndef INPUT_REPLAY
   // PS/2 mouse needs to be reset (must be already plugged in)
   *(PS2_ptr) = 0xFF; // reset
   while((byte2 != (char) 0xAA) || (byte1 != (char)0x00)){
@@ -422,6 +1296,7 @@ void intializeMouse() {
   }
 
   *(PS2_ptr + 1) = 1;
+#endif
 
   enableInterrupt();
 }
@@ -538,56 +1413,78 @@ short int speedButton[5][180] = {{0xD6DA, 0xD6DA, 0xD6DA, 0xD6DA, 0xD6DA, 0xD6DA
                                   0xD6DA, 0xD6DA, 0xD6DA, 0xD6DA, 0xD6DA, 0x0000, 0xD6DA, 0xD6DA, 0xD6DA, 0xD6DA, 0xD6DA, 0xD6DA, 0xD6DA, 0xD6DA, 0xD6DA,
                                   0xD6DA, 0xD6DA, 0xD6DA, 0xD6DA, 0xD6DA, 0xD6DA, 0xD6DA, 0xD6DA, 0xD6DA, 0xD6DA, 0xD6DA, 0xD6DA, 0xD6DA, 0xD6DA, 0xD6DA}};
 
+// The buttons are composed once into a cached layer and queued as a sprite. The layer only changes
+// when a button's state does. The renderer decides when to redraw it, from damage and from uiState,
+// which it latches once a frame so a click mid-frame can't leave the two pixel buffers disagreeing.
+// The cache starts on an even column so its rows line up with the pixel buffer for word copies. The
+// gaps between buttons hold UI_COLOUR_KEY, which the blit skips.
+#define UI_X0                   (SWITCH_BUTTON_X & ~1)
+#define UI_Y0                   SWITCH_BUTTON_Y
+#define UI_WIDTH                16
+#define UI_HEIGHT               (FF_BUTTON_Y + 12 - SWITCH_BUTTON_Y)
+#define UI_X1                   (UI_X0 + UI_WIDTH - 1)
+#define UI_Y1                   (UI_Y0 + UI_HEIGHT - 1)
+#define UI_COLOUR_KEY           ((short int) 0xF81F) // Magenta, which no sprite uses
+#define UI_DIM_COLOUR           ((short int) 0x8410)
+#define PLAY_ICON_SPLIT         7 // Columns left of this hold the play triangle, the rest the pause bars
+
+typedef struct UIState {
+  bool fluidSim;
+  bool play;
+  int speedMult;
+} UIState;
+
+UIState uiState;
+UIState uiCachedState;
+bool uiCacheValid = false;
+short int uiLayer[UI_HEIGHT][UI_WIDTH];
+
+UIState currentUIState(){
+  UIState state = {isFluidSim, play, speedMult};
+  return state;
+}
 
-void drawResetButton(){
-  int x = RESET_BUTTON_X;
-  int y = RESET_BUTTON_Y;
-  
-  for(int i = 0; i < 12; i++){
-    for(int j = 0; j < 15; j++){
-      drawIndividualPixel(x+j,y+i,resetButton[15*i + j]);
-    }
-  }
+bool uiStatesDiffer(UIState *a, UIState *b){
+  return a->fluidSim != b->fluidSim || a->play != b->play || a->speedMult != b->speedMult;
 }
 
-void drawSwitchButton(){
-  int x = SWITCH_BUTTON_X;
-  int y = SWITCH_BUTTON_Y;
-  
+void cacheButtonSprite(short int *sprite, int buttonX, int buttonY){
   for(int i = 0; i < 12; i++){
-    for(int j = 0; j < 15; j++){
-      drawIndividualPixel(x+j,y+i,switchButton[isFluidSim][15*i + j]);
-    }
+    memcpy(&uiLayer[buttonY - UI_Y0 + i][buttonX - UI_X0], &sprite[15*i], 15 * sizeof(short int));
   }
 }
 
-void drawPlayPause(){
-  int x = PLAY_BUTTON_X;
-  int y = PLAY_BUTTON_Y;
-  
-  for(int i = 0; i < 12; i++){
-    for(int j = 0; j < 15; j++){
-      drawIndividualPixel(x+j,y+i,playButton[15*i + j]);
-    }
+// Recomposes the layer from uiState. The half of the play / pause icon that isn't the current state
+// is dimmed.
+void rebuildUILayer(){
+
+  for(int i = 0; i < UI_HEIGHT; i++){
+    for(int j = 0; j < UI_WIDTH; j++) uiLayer[i][j] = UI_COLOUR_KEY;
   }
-}
 
-void drawFFButton(){
-  int x = FF_BUTTON_X;
-  int y = FF_BUTTON_Y;
-  
+  cacheButtonSprite(switchButton[uiState.fluidSim], SWITCH_BUTTON_X, SWITCH_BUTTON_Y);
+  cacheButtonSprite(resetButton, RESET_BUTTON_X, RESET_BUTTON_Y);
+  cacheButtonSprite(playButton, PLAY_BUTTON_X, PLAY_BUTTON_Y);
+  cacheButtonSprite(speedButton[uiState.speedMult], FF_BUTTON_X, FF_BUTTON_Y);
+
   for(int i = 0; i < 12; i++){
+    short int *row = &uiLayer[PLAY_BUTTON_Y - UI_Y0 + i][PLAY_BUTTON_X - UI_X0];
     for(int j = 0; j < 15; j++){
-      drawIndividualPixel(x+j,y+i,speedButton[speedMult][15*i + j]);
+      if (row[j] == 0 && (j < PLAY_ICON_SPLIT) != uiState.play) row[j] = UI_DIM_COLOUR;
     }
   }
+
+  uiCachedState = uiState;
+  uiCacheValid = true;
+
 }
 
-void drawButtons(){
-    drawSwitchButton();
-    drawResetButton();
-    drawPlayPause();
-    drawFFButton();
+void queueUICommands(){
+  if (!uiCacheValid || uiStatesDiffer(&uiCachedState, &uiState)) rebuildUILayer();
+  RenderCommand *c = queueRenderCommand(RC_SPRITE, RENDER_LAYER_UI, UI_COLOUR_KEY, UI_X0, UI_Y0, UI_X1, UI_Y1);
+  if (!c) return;
+  c->sprite = &uiLayer[0][0];
+  c->arg[0] = UI_WIDTH;
 }
 
 // =======================================================================================================
@@ -596,7 +1493,6 @@ void drawButtons(){
 
 // -g -Wall -O1 -ffunction-sections -fverbose-asm -fno-inline -mno-cache-volatile -mhw-div -mcustom-fpu-cfg=60-2 -mhw-mul -mhw-mulx
 
-#define NUM_PARTICLES       200 // 192, 48, 12
 
 #define WATER_COLOUR        27743
 #define WATER_HUE           0.62
@@ -628,19 +1524,99 @@ void drawButtons(){
 
 #define DENSITY_RESTING     6500.0
 
-// use malloc to create all of these instread of static later
-#define NUM_BUCKETS 32
-#define BUCKET_WIDTH (MAX_X/NUM_BUCKETS)
-#define HALF_BUCKET_WIDTH (BUCKET_WIDTH>>1)
+// Shared uniform grid. Particles are counting-sorted into cells every step, and in the coupled world the
+// rigid bodies are binned into the same cells (see binBodiesToGrid), so one lookup serves both broad phases.
+#define GRID_CELL_PX        10 // At least the SPH support radius (ROOT_TWO_SCALE * H_H px)
+#define GRID_MAX_COLUMNS    ((MAX_X + GRID_CELL_PX - 1) / GRID_CELL_PX)
+#define GRID_MAX_ROWS       ((MAX_Y + GRID_CELL_PX - 1) / GRID_CELL_PX)
+#define GRID_MAX_CELLS      (GRID_MAX_COLUMNS * GRID_MAX_ROWS)
+
+// The box the particles and bodies are kept in, px from the top left of the screen. Like the screen it
+// starts out MAX_X by MAX_Y, and setSimDomain picks another size, bigger or smaller than the screen
+// (a large headless scene, say). Whatever lies off screen is simply not drawn.
+typedef struct SimDomain {
+
+    int width, height;
+
+} SimDomain;
+
+SimDomain domain = {MAX_X, MAX_Y};
+int gridColumns = GRID_MAX_COLUMNS; // The grid covers the domain
+int gridRows = GRID_MAX_ROWS;
+int gridCells = GRID_MAX_CELLS;
+
+int gridParticleStart[GRID_MAX_CELLS + 1]; // Particles of cell c are gridParticles[start[c] .. start[c+1])
+int gridParticles[NUM_PARTICLES];
+int gridCursor[GRID_MAX_CELLS];
+int particleCell[NUM_PARTICLES];
 
-// for iteration almost exclusively.
-int numElementsInBucket_even[NUM_BUCKETS] = {0};
-int neighbourBucketIndexes[3] = {0};
+// Call it before initParticles and initRigidBodies. Returns false if the size is beyond MAX_X by MAX_Y.
+bool setSimDomain(int width, int height) {
 
-int buckets_even[NUM_BUCKETS][NUM_PARTICLES];
-int lastSeen[NUM_PARTICLES][NUM_PARTICLES];
-int lastSeen2[NUM_PARTICLES][NUM_PARTICLES];
-int timeStep = 0;
+    if (width < 1 || height < 1 || width > MAX_X || height > MAX_Y) return false;
+    domain.width = width;
+    domain.height = height;
+    gridColumns = (width + GRID_CELL_PX - 1) / GRID_CELL_PX;
+    gridRows = (height + GRID_CELL_PX - 1) / GRID_CELL_PX;
+    gridCells = gridColumns * gridRows;
+    return true;
+
+}
+
+// Coupled world hooks, defined after the rigid bodies.
+void collideParticleWithBodies(int);
+void applyFluidImpulse(int);
+
+// Per-phase timing (see PERFORMANCE HUD)
+#define HUD_PHASE_NEIGHBOURS    0
+#define HUD_PHASE_DENSITY       1
+#define HUD_PHASE_FORCES        2
+#define HUD_PHASE_INTEGRATE     3
+#define HUD_PHASE_COLLISION     4
+#define HUD_PHASE_DAMAGE        5
+#define HUD_PHASE_DRAW          6
+#define HUD_PHASE_WAIT          7
+#define HUD_NUM_PHASES          8
+void hudBeginPhase(int);
+void hudEndPhase(int);
+void hudSetup();
+void hudEndFrame();
+void hudEndRun(int);
+
+// Profiling scopes (see PROFILER). Without PROFILE the macros compile to nothing.
+#define PROFILE_FLUID_NEIGHBOURS    0
+#define PROFILE_FLUID_DENSITY       1
+#define PROFILE_FLUID_FORCES        2
+#define PROFILE_FLUID_INTEGRATE     3
+#define PROFILE_FLUID_BODIES        4
+#define PROFILE_RB_NARROW_PHASE     5
+#define PROFILE_RB_RESOLVE          6
+#define PROFILE_DAMAGE              7
+#define PROFILE_DRAW                8
+#define PROFILE_VSYNC_WAIT          9
+#define PROFILE_NUM_SCOPES          10
+#ifdef PROFILE
+void profileBegin(int);
+void profileEnd(int);
+void profileEndFrame();
+#define PROFILE_BEGIN(scope)        profileBegin(scope)
+#define PROFILE_END(scope)          profileEnd(scope)
+#define PROFILE_END_FRAME()         profileEndFrame()
+#else
+#define PROFILE_BEGIN(scope)
+#define PROFILE_END(scope)
+#define PROFILE_END_FRAME()
+#endif
+
+// Frame capture (see FRAME CAPTURE)
+#ifdef CAPTURE_FILE
+void captureFrame(Rect *, int);
+#endif
+
+// Spatial queries (see SPATIAL QUERIES)
+int queryParticlesInRadius(float, float, float, int *, int);
+int queryBodyAtPoint(int, int);
+int mouseQueryResults[NUM_PARTICLES];
 	
 float h; // Spacing parameter between fluids in the simulation
 int hpx; // h but in px
@@ -661,27 +1637,20 @@ typedef struct Particle {
     float vx, vy;
     float ax, ay;
     float pressure, density;
-    bool neighbours[NUM_PARTICLES];
-    float gradQ[NUM_PARTICLES];
-    float neighbourDXs[NUM_PARTICLES];
-    float neighbourDYs[NUM_PARTICLES];
-    float neighbourDistances[NUM_PARTICLES];
     short int colour;
-    int bucketIndexes[3];
 
 } Particle;
 
 Particle allParticles[NUM_PARTICLES];
-drawParticle allEraseParticles[NUM_PARTICLES];
 
 void initParticles() {
 
-    double x = (double)NUM_PARTICLES*(double)MAX_Y/(double)MAX_X;
+    double x = (double)NUM_PARTICLES*(double)domain.height/(double)domain.width;
     int amtRows = ceil(sqrt(ceil(x)));
-    int amtColumns = ceil((double)amtRows*(double)MAX_X/(double)MAX_Y);
+    int amtColumns = ceil((double)amtRows*(double)domain.width/(double)domain.height);
 
-    int stepX = MAX_X/amtColumns;
-    int stepY = MAX_Y/amtRows;
+    int stepX = domain.width/amtColumns;
+    int stepY = domain.height/amtRows;
     int initX = stepX/2;
     int initY = stepY/2;
 
@@ -703,10 +1672,6 @@ void initParticles() {
 	
     for (int i = 0; i < NUM_PARTICLES; i++) {
 		
-        for(int j = 0; j < NUM_PARTICLES; j++){
-            lastSeen[i][j] = -1;
-            lastSeen2[i][j] = -1;
-        }
 		srand(i);
         if(xStepCount >= amtColumns) {
             xStepCount = 0;
@@ -719,42 +1684,43 @@ void initParticles() {
         allParticles[i].y = initY + yStepCount*stepY + (rand() % INIT_VAR) - (INIT_VAR>>1);
         allParticles[i].vx = 0;
         allParticles[i].vy = 0;
+        allParticles[i].ax = 0;
+        allParticles[i].ay = 0;
+        allParticles[i].density = 0; // Only ever accumulates, so a reset has to start it again
+        allParticles[i].pressure = 0;
         allParticles[i].colour = WATER_COLOUR;
 
         xStepCount++;
 
         allParticles[i].pX = M_PER_PX * allParticles[i].x;
         allParticles[i].pY = M_PER_PX * allParticles[i].y;
-        allEraseParticles[i].x = allParticles[i].x;
-        allEraseParticles[i].y = allParticles[i].y;
     }
 }
 
 void draw2b2(int x, int y, short int colour) {
     drawIndividualPixel(x, y, colour);
-    if (x < (MAX_X-2) && y > 1) {
+    if (x < (screen.width-2) && y > 1) {
         drawIndividualPixel(x + 1, y, colour);
         drawIndividualPixel(x + 1, y - 1, colour);
         drawIndividualPixel(x, y - 1, colour);
-    } else if (x < (MAX_X-2)) {
+    } else if (x < (screen.width-2)) {
         drawIndividualPixel(x + 1, y, colour);
     } else if (y > 1) {
         drawIndividualPixel(x, y - 1, colour);
     }
 }
-void eraseParticles() {
-    for (int i = 0; i < NUM_PARTICLES; i++) {
-        //drawIndividualPixel(allParticles[i].x, allParticles[i].y, BLACK);
-        draw2b2(allEraseParticles[i].x, allEraseParticles[i].y, BLACK);
-    }
-}
-void drawParticles() {
+
+// Queues one 2x2 dot per particle for the renderer.
+void queueParticleCommands() {
     for (int i = 0; i < NUM_PARTICLES; i++) {
-        //drawIndividualPixel(allParticles[i].x, allParticles[i].y, allParticles[i].colour);
-        draw2b2(allParticles[i].x, allParticles[i].y, allParticles[i].colour);
+        int x = allParticles[i].x;
+        int y = allParticles[i].y;
+        RenderCommand * c = queueRenderCommand(RC_POINT, RENDER_LAYER_FLUID, allParticles[i].colour, x, y - 1, x + 1, y);
+        if (!c) return;
+        c->arg[0] = x;
+        c->arg[1] = y;
     }
 }
-
 // Reference:
 // https://cg.informatik.uni-freiburg.de/course_notes/sim_10_sph.pdf
 
@@ -770,16 +1736,16 @@ void stepSPHPositions(int i) {
 		allParticles[i].x = 0;
         // allParticles[i].pX = EPSILON;
         
-	} else if (allParticles[i].x > (MAX_X - 1)) {
-		allParticles[i].x = MAX_X-1;
+	} else if (allParticles[i].x > (domain.width - 1)) {
+		allParticles[i].x = domain.width-1;
         // allParticles[i].pX = M_PER_PX * allParticles[i].x;
 	}
 	if (allParticles[i].y <= 0){
 		allParticles[i].y = 0;
         // allParticles[i].pY = EPSILON;
 
-	} else if (allParticles[i].y > (MAX_Y -1)){
-		allParticles[i].y = MAX_Y-1;
+	} else if (allParticles[i].y > (domain.height -1)){
+		allParticles[i].y = domain.height-1;
         allParticles[i].pY = M_PER_PX * allParticles[i].y;
 	}
     
@@ -787,23 +1753,23 @@ void stepSPHPositions(int i) {
 
 void doVelocityStepCheck(int i) {
     // Container collision handling and application of TUG Accelerations.
-    if((allParticles[i].x >= (MAX_X-1) && allParticles[i].vx > 0) || (allParticles[i].x <= 0 && allParticles[i].vx < 0)) {
+    if((allParticles[i].x >= (domain.width-1) && allParticles[i].vx > 0) || (allParticles[i].x <= 0 && allParticles[i].vx < 0)) {
         allParticles[i].vx = -allParticles[i].vx*ELASTICITY;
     }
     else if(allParticles[i].x <= hpx && allParticles[i].vx < EPSILON) {
         allParticles[i].ax += TUG_ACCELERATION;
     }
-    else if(allParticles[i].x >= (MAX_X-1-hpx) && allParticles[i].vx > -EPSILON) {
+    else if(allParticles[i].x >= (domain.width-1-hpx) && allParticles[i].vx > -EPSILON) {
         allParticles[i].ax -= TUG_ACCELERATION;
     }
 
-    if((allParticles[i].y >= (MAX_Y-1) && allParticles[i].vy > 0) || (allParticles[i].y <= 0 && allParticles[i].vy < 0)) {
+    if((allParticles[i].y >= (domain.height-1) && allParticles[i].vy > 0) || (allParticles[i].y <= 0 && allParticles[i].vy < 0)) {
         allParticles[i].vy = -allParticles[i].vy*ELASTICITY;
     }
     else if(allParticles[i].y <= hpx && allParticles[i].vy < EPSILON) {
         allParticles[i].ay += TUG_ACCELERATION;
     }
-    else if(allParticles[i].y >= (MAX_Y-1-hpx) && allParticles[i].vy > -EPSILON) {
+    else if(allParticles[i].y >= (domain.height-1-hpx) && allParticles[i].vy > -EPSILON) {
         allParticles[i].ay -= TUG_ACCELERATION;
     }
 }
@@ -833,6 +1799,34 @@ void stepSPHVelocities(int i) {
 
 }
 
+// Cubic spline kernel (without alpha) for q = x_ij / h.
+float sphKernel(float q) {
+    float fp, sp;
+    if (q < 1) {
+        fp = pow((2-q), 2);
+        sp = pow((1-q), 2);
+        return fp*(2-q) - 4 * sp*(1-q);
+    } else if (q < 2) {
+        fp = pow((2-q), 2);
+        return fp*(2-q);
+    }
+    return 0;
+}
+
+// Derivative of the kernel above (without alpha / h).
+float sphGradQ(float q) {
+    float fp, sp;
+    if (q < 1) {
+        fp = pow((2-q), 2);
+        sp = pow((1-q), 2);
+        return -3 * fp + 12 * sp;
+    } else if (q < 2) {
+        fp = pow((2-q), 2);
+        return -3 * fp;
+    }
+    return 0;
+}
+
 void calculateSPHAccelerations(int i) {
 
 	allParticles[i].ax = 0;
@@ -850,55 +1844,52 @@ void calculateSPHAccelerations(int i) {
     float pressureRatio_i = allParticles[i].pressure / (allParticles[i].density * allParticles[i].density);
     float inv_rho_j, pressureRatio_j;
 
-    for(int nbIdx = 0; nbIdx < 3; nbIdx++){
+    int cellX = particleCell[i] % gridColumns;
+    int cellY = particleCell[i] / gridColumns;
 
-        int buck = allParticles[i].bucketIndexes[nbIdx];
-        if (buck<0 || buck>=NUM_BUCKETS) break;
-
-        for (int pos_j = 0; pos_j < numElementsInBucket_even[buck]; pos_j++) {
-        
-            int j = buckets_even[buck][pos_j];
-            if (i==j) continue;
+    for (int gy = cellY - 1; gy <= cellY + 1; gy++) {
+        if (gy < 0 || gy >= gridRows) continue;
+        for (int gx = cellX - 1; gx <= cellX + 1; gx++) {
+            if (gx < 0 || gx >= gridColumns) continue;
+            int cell = gy * gridColumns + gx;
 
-            if (lastSeen[i][j] == timeStep || lastSeen[j][i] == timeStep) continue;
-            lastSeen[i][j] = timeStep;
-            lastSeen[j][i] = timeStep;
+            for (int pos_j = gridParticleStart[cell]; pos_j < gridParticleStart[cell + 1]; pos_j++) {
 
-            if (!allParticles[i].neighbours[j]) continue; // Dont check non-neighbours
-            if (allParticles[i].neighbourDistances[j] == 0) continue; // Everything goes to zero if no distance
+                int j = gridParticles[pos_j];
+                if (i==j) continue;
 
-            q = allParticles[i].gradQ[j];
-            if(!q) continue;
+                dx = allParticles[i].pX - allParticles[j].pX;
+                dy = allParticles[i].pY - allParticles[j].pY;
+                x_ij = sqrt(dx*dx+dy*dy);
+                if (x_ij >= ROOT_TWO_SCALE*h) continue; // Dont check non-neighbours
+                if (x_ij == 0) continue; // Everything goes to zero if no distance
 
-            dx = allParticles[i].neighbourDXs[j];
-            dy = allParticles[i].neighbourDYs[j];
+                q = sphGradQ(x_ij/h);
+                if(!q) continue;
 
-            x_ij = allParticles[i].neighbourDistances[j];
-            // if(-EPSILON < x_ij < EPSILON) {
-            //     x_ij = EPSILON;
-            // }
-            x_ij2 = x_ij*x_ij;
+                x_ij2 = x_ij*x_ij;
 
-            GRADW_ijx = alpha * dx * q / (x_ij * h);
-            GRADW_ijy = alpha * dy * q / (x_ij * h);
+                GRADW_ijx = alpha * dx * q / (x_ij * h);
+                GRADW_ijy = alpha * dy * q / (x_ij * h);
 
-            // Pressure Acceleration
+                // Pressure Acceleration
 
-            // if (-EPSILON < allParticles[j].density < EPSILON) continue;
-            inv_rho_j = 1/allParticles[j].density;
-            pressureRatio_j = allParticles[j].pressure * inv_rho_j * inv_rho_j;
-            allParticles[i].ax -= (pressureRatio_i + pressureRatio_j) * GRADW_ijx;
-            allParticles[i].ay -= (pressureRatio_i + pressureRatio_j) * GRADW_ijy;
+                // if (-EPSILON < allParticles[j].density < EPSILON) continue;
+                inv_rho_j = 1/allParticles[j].density;
+                pressureRatio_j = allParticles[j].pressure * inv_rho_j * inv_rho_j;
+                allParticles[i].ax -= (pressureRatio_i + pressureRatio_j) * GRADW_ijx;
+                allParticles[i].ay -= (pressureRatio_i + pressureRatio_j) * GRADW_ijy;
 
-            // Viscosity Acceleration
+                // Viscosity Acceleration
 
-            dvx = allParticles[i].vx - allParticles[j].vx;
-            dvy = allParticles[i].vy - allParticles[j].vy;
+                dvx = allParticles[i].vx - allParticles[j].vx;
+                dvy = allParticles[i].vy - allParticles[j].vy;
 
-            viscosScale = VISCOSITY * inv_rho_j * (dx*GRADW_ijx + dy*GRADW_ijy) / (x_ij2+nu);
-            allParticles[i].ax += viscosScale * dvx;
-            allParticles[i].ay += viscosScale * dvy;
+                viscosScale = VISCOSITY * inv_rho_j * (dx*GRADW_ijx + dy*GRADW_ijy) / (x_ij2+nu);
+                allParticles[i].ax += viscosScale * dvx;
+                allParticles[i].ay += viscosScale * dvy;
 
+            }
         }
     }
 
@@ -907,89 +1898,80 @@ void calculateSPHAccelerations(int i) {
         allParticles[i].ax = 0;
         allParticles[i].ay = G;
     }
-    // Mouse Acceleration
-    if(!mData.left) return;
-    // printf("HERE");
-    dx = (float)allParticles[i].x - (float)mData.x;
-    dy = (float)allParticles[i].y - (float)mData.y;
-    float mag = sqrt(dx*dx+dy*dy);
-    if (mag < MOUSE_ROE) {
-        allParticles[i].ax += MOUSE_A_MAG * dx/(mag);
-        allParticles[i].ay += MOUSE_A_MAG * dy/(mag);
-    }
 
 } 
 
-void timeStepSPHApproximation(int i, int j) {
-    
-    if (i==j) return;
-    // 1. Find nearest neighbours j for particle i
-    // 2. Calculate Density and Pressure at every particle i
+// Mouse Acceleration. Only the particles the grid finds inside MOUSE_ROE are touched.
+void applyMouseAccelerations() {
 
-    float dx, dy;
-    float x_ij, q, rho;
-    float fp, sp, gradQ;
+    if(!mData.left) return;
 
-    dx = allParticles[i].pX - allParticles[j].pX;
-    dy = allParticles[i].pY - allParticles[j].pY;
-    x_ij = sqrt(dx*dx+dy*dy);
-    
-    if (x_ij<ROOT_TWO_SCALE*h) {
+    int count = queryParticlesInRadius(mData.x, mData.y, MOUSE_ROE, mouseQueryResults, NUM_PARTICLES);
+    for (int k = 0; k < count; k++) {
+        int i = mouseQueryResults[k];
+        float dx = (float)allParticles[i].x - (float)mData.x;
+        float dy = (float)allParticles[i].y - (float)mData.y;
+        float mag = sqrt(dx*dx+dy*dy);
+        if (mag == 0) continue;
+        allParticles[i].ax += MOUSE_A_MAG * dx/(mag);
+        allParticles[i].ay += MOUSE_A_MAG * dy/(mag);
+    }
 
-        allParticles[i].neighbourDXs[j] = dx;
-        allParticles[i].neighbourDYs[j] = dy;
-        allParticles[i].neighbourDistances[j] = x_ij;
+}
 
-        allParticles[j].neighbourDXs[i] = -dx;
-        allParticles[j].neighbourDYs[i] = -dy;
-        allParticles[j].neighbourDistances[i] = x_ij;
+// Counting sort of the particles into grid cells. Particles keep index order within a cell.
+void binParticlesToGrid() {
 
-        allParticles[i].neighbours[j] = true;
-        allParticles[j].neighbours[i] = true;
+    for (int cell = 0; cell <= gridCells; cell++) gridParticleStart[cell] = 0;
 
-        q = x_ij/h;
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        int gx = allParticles[i].x / GRID_CELL_PX;
+        int gy = allParticles[i].y / GRID_CELL_PX;
+        gx = gx < 0 ? 0 : (gx >= gridColumns ? gridColumns - 1 : gx);
+        gy = gy < 0 ? 0 : (gy >= gridRows ? gridRows - 1 : gy);
+        particleCell[i] = gy * gridColumns + gx;
+        gridParticleStart[particleCell[i] + 1]++;
+    }
+    for (int cell = 0; cell < gridCells; cell++) {
+        gridParticleStart[cell + 1] += gridParticleStart[cell];
+        gridCursor[cell] = gridParticleStart[cell];
+    }
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        gridParticles[gridCursor[particleCell[i]]++] = i;
+    }
 
-        if(q < 1){
-            fp = pow((2-q), 2);
-            sp = pow((1-q), 2);
+}
 
-            gradQ = -3 * fp + 12 * sp;
-            allParticles[i].gradQ[j] = gradQ;
-            allParticles[j].gradQ[i] = gradQ;
+// 1. Find nearest neighbours j for particle i (the 3x3 cells around it)
+// 2. Add their kernel contributions to the density of i
+void accumulateSPHDensity(int i) {
 
-            q = fp*(2-q) - 4 * sp*(1-q);
-        } else if (q < 2) {
-            fp = pow((2-q), 2);
+    int cellX = particleCell[i] % gridColumns;
+    int cellY = particleCell[i] / gridColumns;
 
-            gradQ = -3 * fp;
-            allParticles[i].gradQ[j] = gradQ;
-            allParticles[j].gradQ[i] = gradQ;
+    for (int gy = cellY - 1; gy <= cellY + 1; gy++) {
+        if (gy < 0 || gy >= gridRows) continue;
+        for (int gx = cellX - 1; gx <= cellX + 1; gx++) {
+            if (gx < 0 || gx >= gridColumns) continue;
+            int cell = gy * gridColumns + gx;
 
-            q = fp*(2-q);
-        } else {
-            allParticles[i].gradQ[j] = 0;
-            allParticles[j].gradQ[i] = 0;
-            return; // q is zero so save calcs by continuing
-        }
+            for (int pos_j = gridParticleStart[cell]; pos_j < gridParticleStart[cell + 1]; pos_j++) {
+                int j = gridParticles[pos_j];
+                if (i==j) continue;
 
-        
-        rho = alpha*q;
-        allParticles[i].density += rho;
-        allParticles[j].density += rho;
+                float dx = allParticles[i].pX - allParticles[j].pX;
+                float dy = allParticles[i].pY - allParticles[j].pY;
+                float x_ij = sqrt(dx*dx+dy*dy);
+                if (x_ij >= ROOT_TWO_SCALE*h) continue;
 
-    } else {
-        allParticles[i].neighbours[j] = false;
-        allParticles[j].neighbours[i] = false;
+                allParticles[i].density += alpha*sphKernel(x_ij/h);
+            }
+        }
     }
 
 }
 
 void generalParticleUpdate(int i) {
-    
-    allParticles[i].pressure = K * pow((allParticles[i].density*inv_rho_naught), 7) - K;
-
-    // 3. Calculate Accelearations (Approx)
-    calculateSPHAccelerations(i);
 
     // 4. Step Velocities and then positions.
     doVelocityStepCheck(i);
@@ -998,76 +1980,69 @@ void generalParticleUpdate(int i) {
 
 }
 
-void timeStepBucketwiseParticleUpdate() {
-    
-    // clean buckets
-    for (int bucket = 0; bucket < NUM_BUCKETS; bucket++) {
-        numElementsInBucket_even[bucket] = 0;
-    }
+// The fluid step, one pass per function so the frame scheduler can run them as separate jobs. Every pass
+// reads the state the previous one left, so neighbours agree on what they see of each other.
+void stepFluidNeighbours() {
+    hudBeginPhase(HUD_PHASE_NEIGHBOURS);
+    PROFILE_BEGIN(PROFILE_FLUID_NEIGHBOURS);
+    binParticlesToGrid();
+    PROFILE_END(PROFILE_FLUID_NEIGHBOURS);
+    hudEndPhase(HUD_PHASE_NEIGHBOURS);
+}
 
-    // Populate all buckets with particle indicies appropriately
+void stepFluidDensities() {
+    hudBeginPhase(HUD_PHASE_DENSITY);
+    PROFILE_BEGIN(PROFILE_FLUID_DENSITY);
     for (int i = 0; i < NUM_PARTICLES; i++) {
-
-        allEraseParticles[i].x = allParticles[i].x;
-        allEraseParticles[i].y = allParticles[i].y;
-
-        int evenBucket = (allParticles[i].x/BUCKET_WIDTH);
-        // assert(evenBucket >= 0 && evenBucket < NUM_BUCKETS);
-        buckets_even[evenBucket][numElementsInBucket_even[evenBucket]] = i;
-        numElementsInBucket_even[evenBucket]++;
-
+        accumulateSPHDensity(i);
+        allParticles[i].pressure = K * pow((allParticles[i].density*inv_rho_naught), 7) - K;
     }
+    PROFILE_END(PROFILE_FLUID_DENSITY);
+    hudEndPhase(HUD_PHASE_DENSITY);
+}
 
-    for (int bucket = 0; bucket < NUM_BUCKETS; bucket++) {
-
-        if(bucket == 0){
-            neighbourBucketIndexes[0] = bucket;
-            neighbourBucketIndexes[1] = bucket+1;
-            neighbourBucketIndexes[2] = -1;
-        } else if(bucket == (NUM_BUCKETS - 1)) {
-            neighbourBucketIndexes[0] = bucket-1;
-            neighbourBucketIndexes[1] = bucket;
-            neighbourBucketIndexes[2] = -1;
-        } else {
-            neighbourBucketIndexes[0] = bucket-1;
-            neighbourBucketIndexes[1] = bucket;
-            neighbourBucketIndexes[2] = bucket+1;
-        }
-
-        for (int pos_i = 0; pos_i < numElementsInBucket_even[bucket]; pos_i++) {
-            int i = buckets_even[bucket][pos_i];
-
-            for(int nbIdx = 0; nbIdx < 3; nbIdx++){
-                
-                int buck = neighbourBucketIndexes[nbIdx];
-                allParticles[i].bucketIndexes[nbIdx] = buck;
-
-                if (buck<0 || buck>=NUM_BUCKETS) break;
-
-                for (int pos_j = 0; pos_j < numElementsInBucket_even[buck]; pos_j++) {
-
-                    int j = buckets_even[buck][pos_j];
-                    // if(j<(i+1)) continue;
+// 3. Calculate Accelearations (Approx)
+void stepFluidAccelerations() {
+    hudBeginPhase(HUD_PHASE_FORCES);
+    PROFILE_BEGIN(PROFILE_FLUID_FORCES);
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        calculateSPHAccelerations(i);
+    }
+    applyMouseAccelerations();
+    PROFILE_END(PROFILE_FLUID_FORCES);
+    hudEndPhase(HUD_PHASE_FORCES);
+}
 
-                    if (lastSeen[i][j] == timeStep || lastSeen[j][i] == timeStep) continue;
-                    lastSeen[i][j] = timeStep; 
-                    lastSeen[j][i] = timeStep; 
+void stepFluidParticles() {
+    hudBeginPhase(HUD_PHASE_INTEGRATE);
+    PROFILE_BEGIN(PROFILE_FLUID_INTEGRATE);
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        generalParticleUpdate(i);
+    }
+    PROFILE_END(PROFILE_FLUID_INTEGRATE);
+    hudEndPhase(HUD_PHASE_INTEGRATE);
+}
 
-                    // Call helper function to actually process i/j collision
-                    timeStepSPHApproximation(i,j);
+// Each particle only reads the bodies (which don't move during the fluid step) and adds to their
+// impulse, so this can run as its own pass after integration.
+void stepFluidBodyCollisions() {
+    hudBeginPhase(HUD_PHASE_COLLISION);
+    PROFILE_BEGIN(PROFILE_FLUID_BODIES);
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        collideParticleWithBodies(i);
+    }
+    PROFILE_END(PROFILE_FLUID_BODIES);
+    hudEndPhase(HUD_PHASE_COLLISION);
+}
 
-                }
+void timeStepGridParticleUpdate() {
 
-            }
-            
-            timeStep++;
-            generalParticleUpdate(i);
-            timeStep--;
-        }
+    stepFluidNeighbours();
+    stepFluidDensities();
+    stepFluidAccelerations();
+    stepFluidParticles();
+    if (isCoupledSim) stepFluidBodyCollisions();
 
-        
-    }
-    timeStep++;
 }
 
 
@@ -1081,7 +2056,8 @@ void timeStepBucketwiseParticleUpdate() {
 
 #define ELASTICITY_RB       0.4
 #define DEFAULT_SPH_RB      0.2
-#define NUM_BODIES          12
+#define NUM_BODIES          12 // Bodies spawned by a reset
+#define RB_SPAWN_SIZE       14
 
 #define G_RB                9.0
 #define EPSILON_RB          0.00001
@@ -1095,13 +2071,45 @@ void timeStepBucketwiseParticleUpdate() {
 #define INT_MAX_C           2147483647
 #define INT_MIN_C           -2147483648
 
-#define VERTICIES_PER_BODY  4
-#define MAX_EXTERNAL_FORCES (VERTICIES_PER_BODY + NUM_BODIES)
+#define VERTICIES_PER_BODY  8 // Max verticies per body. Each body uses numVerts of them.
+#define QUAD_VERTICIES      4
 #define VERT_VARIANCE       21
 #define VELOCITY_COLOUR_SENSITIVITY_RB 100.0
 
 #define BODY_DENSITY        2
 
+// Body shapes. Every body is a convex core (its verticies) grown by a radius, so circles are one vertex
+// and capsules two, and the narrow phase only needs the core's support function.
+#define RB_SHAPE_POLYGON    0
+#define RB_SHAPE_CIRCLE     1
+#define RB_SHAPE_CAPSULE    2
+
+// GJK / EPA tuning
+#define GJK_MAX_ITERATIONS  20
+#define EPA_MAX_ITERATIONS  20
+#define EPA_MAX_VERTICIES   (EPA_MAX_ITERATIONS + 4)
+#define GJK_TOLERANCE       0.0001
+#define RB_CONTACT_SLOP     0.05
+
+// Continuous collision. Bodies moving more than a fraction of their extent in one step are sub-stepped.
+#define CCD_MOTION_FRACTION     0.25
+#define CCD_MAX_SUBSTEPS        16
+#define CCD_TOI_ITERATIONS      4 // Bisection steps to tighten the time of impact inside the hit sub-step
+
+// Sleep tuning. Velocities are smoothed over a few frames since resting bodies jitter by ~1px each step.
+#define SLEEP_LINEAR_THRESH     1.5
+#define SLEEP_ANGULAR_THRESH    0.05
+#define SLEEP_TIME              6.0 // Sim time an island must stay still before sleeping
+#define SLEEP_SMOOTHING         0.1
+#define SLEEP_WAKE_MARGIN       1
+
+// Narrow phase. Contact generation only reads body state, so candidate pairs are dealt out to workers that
+// each fill their own buffer. The board runs the workers one after another. Define RB_NARROW_PHASE_THREADS
+// on a host with pthreads to run them in parallel on a pool of threads started once. Pairs past
+// MAX_RB_CANDIDATE_PAIRS in a step are dropped and counted in rbCandidatePairsDropped, which the HUD shows.
+#define NARROW_PHASE_WORKERS    4
+#define MAX_RB_CANDIDATE_PAIRS  (MAX_BODIES*8) // Stacked bodies touch a handful of neighbours at most
+
 typedef struct Vector2D {
 
     float x;
@@ -1109,14 +2117,6 @@ typedef struct Vector2D {
 
 } Vector2D;
 
-typedef struct ExternalForce {
-    
-    Vector2D r;
-    Vector2D force;
-    bool isActive;
-
-} ExternalForce;
-
 typedef struct DrawBody {
 
     int xs [VERTICIES_PER_BODY];
@@ -1126,6 +2126,9 @@ typedef struct DrawBody {
 
 typedef struct RigidBody {
 
+    int shape;
+    int numVerts;
+    float radius;
     int xs [VERTICIES_PER_BODY];
     int ys [VERTICIES_PER_BODY]; 
     float pxs [VERTICIES_PER_BODY];
@@ -1149,16 +2152,95 @@ typedef struct RigidBody {
     float lastPositionDelta;
     bool cLast;
 
-    ExternalForce extForces [MAX_EXTERNAL_FORCES];
+    // Sleep state. A sleeping body is skipped by the solver until something wakes its island.
+    bool isAsleep;
+    float sleepTimer;
+    Vector2D sleepV;
+    float sleepOmega;
+    Vector2D lastC;
+    float lastTheta;
+    int islandIdx;
+
+    // Contact and wall forces gathered over a step, applied at the start of the next one.
+    Vector2D force;
+    float torque;
+
+    // Impulse from fluid particles pushed off the body during a coupled step.
+    Vector2D fluidImpulse;
+    float fluidAngImpulse;
 
     short int colour;
 
 } RigidBody;
 
-short int collisionMap [MAX_X][MAX_Y];
-bool bookMarkedCollisions[NUM_BODIES][NUM_BODIES];
-DrawBody eraseRBs [NUM_BODIES];
-RigidBody allBodies [NUM_BODIES];
+// A vertex of the GJK / EPA simplex: w = a - b where a and b are support points on the two cores.
+typedef struct GJKVertex {
+
+    Vector2D a;
+    Vector2D b;
+    Vector2D w;
+    float u; // Barycentric weight in the current closest point
+
+} GJKVertex;
+
+typedef struct GJKResult {
+
+    GJKVertex simplex[3];
+    int count;
+    bool overlap;   // Cores overlap (or touch). simplex is the starting point for EPA.
+    bool separated; // Cores are further apart than the distance asked about. Nothing else is valid.
+    Vector2D pointA;
+    Vector2D pointB;
+    float distance;
+
+} GJKResult;
+
+typedef struct RBContact {
+
+    int bodyA;
+    int bodyB;
+    Vector2D normal; // Unit normal pointing from A to B
+    Vector2D point;
+    float depth;
+
+} RBContact;
+
+// Rasterised body-ID map. Every pixel holds the index of the body covering it, so point queries against
+// the bodies are a single read. Only bodies that moved since they were last drawn in are re-filled.
+// Where bodies overlap, the one filled last wins.
+#define RB_MAP_EMPTY        -1
+short int collisionMap [MAX_Y][MAX_X];
+short int rbMapSpans [MAX_BODIES][MAX_Y][2]; // First and last x filled on each row
+short int rbMapRowMin [MAX_BODIES];
+short int rbMapRowMax [MAX_BODIES];
+bool rbMapped [MAX_BODIES];
+float rbMapPose [MAX_BODIES][3]; // cx, cy, theta the spans were rasterised at
+RigidBody allBodies [MAX_BODIES];
+
+// Body pool. Live bodies are packed into rbActive (in no particular order) so loops only touch those.
+// Despawned bodies wait in rbPendingErase until the renderer has erased them, then return to the free list.
+int rbActive [MAX_BODIES];
+int numRBActive = 0;
+int rbActiveSlot [MAX_BODIES]; // Index into rbActive, -1 when the body is not live
+int rbFreeList [MAX_BODIES];
+int numRBFree = 0;
+int rbPendingErase [MAX_BODIES];
+int numRBPendingErase = 0;
+bool lastRightClick = false;
+
+// Body pairs found touching this frame. These are the edges of the contact graph used for islands.
+int rbContactPairs[MAX_RB_CANDIDATE_PAIRS][2];
+int rbSweepOrder[MAX_BODIES];
+int rbCandidatePairs[MAX_RB_CANDIDATE_PAIRS][2];
+int numRBCandidatePairs = 0;
+int rbCandidatePairsDropped = 0; // Since startup. Each one is a contact that went unsolved.
+RBContact rbWorkerContacts[NARROW_PHASE_WORKERS][MAX_RB_CANDIDATE_PAIRS];
+int rbWorkerContactCount[NARROW_PHASE_WORKERS];
+RBContact rbContacts[MAX_RB_CANDIDATE_PAIRS];
+int numRBContacts = 0;
+int numRBContactPairs = 0;
+int rbIslandParent[MAX_BODIES];
+float rbIslandMinSleep[MAX_BODIES];
 
 int currentMouseInteractionObj;
 
@@ -1203,7 +2285,7 @@ Vector2D constrVec (float x, float y) {
 }
 
 void resetBodyFromCenter(int i) {
-    for(int k = 0; (k < VERTICIES_PER_BODY); k++) {
+    for(int k = 0; (k < allBodies[i].numVerts); k++) {
         float nt = allBodies[i].constThetas[k] + allBodies[i].theta;
         float ndx = allBodies[i].vDistances[k] * cos(nt);
         float ndy = allBodies[i].vDistances[k] * sin(nt);
@@ -1216,509 +2298,1392 @@ void resetBodyFromCenter(int i) {
     }
 }
 
-bool pointIsInsideRB(float x, float y, int rbIdx){
-    
-    int counter = 0;
-    for (int i =0; i < VERTICIES_PER_BODY; i++) {
-        int nextIdx = (i+1) % VERTICIES_PER_BODY;
-        if ((allBodies[rbIdx].pys[i] <= y && y < allBodies[rbIdx].pys[nextIdx]) ||
-            (allBodies[rbIdx].pys[nextIdx] <= y && y < allBodies[rbIdx].pys[i])) {
-            float m = (allBodies[rbIdx].pxs[nextIdx] - allBodies[rbIdx].pxs[i])/(allBodies[rbIdx].pys[nextIdx] - allBodies[rbIdx].pys[i]);
-            if (isnan(m)) m = 1.0e38;
-            float root = allBodies[rbIdx].pxs[i] + (y - allBodies[rbIdx].pys[i]) * m;
-            if (x < root) counter++;
-        }
-    }
-    return ((counter % 2 ) == 1); // If we crossed an odd amt. of times. we must be inside.
+void wakeBody(int i) {
+    allBodies[i].isAsleep = false;
+    allBodies[i].islandIdx = -1;
+    allBodies[i].sleepTimer = 0;
+    allBodies[i].sleepV = constrVec(0.0, 0.0);
+    allBodies[i].sleepOmega = 0;
+}
 
-    // bool diffsInX = false;
-    // bool diffsInY = false;
+// Works out which pixels of each row body i covers: its core polygon grown by its radius.
+void rasteriseRBSpans(int i) {
+
+    int n = allBodies[i].numVerts;
+    float r = allBodies[i].radius;
+    int rowMin = allBodies[i].minPY < 0 ? 0 : allBodies[i].minPY;
+    int rowMax = allBodies[i].maxPY + 1 >= domain.height ? domain.height - 1 : allBodies[i].maxPY + 1;
+    rbMapRowMin[i] = rowMin;
+    rbMapRowMax[i] = rowMax;
+
+    for (int row = rowMin; row <= rowMax; row++) {
+        float y = M_PER_PX_RB * row;
+        float lo = 1.0e38;
+        float hi = -1.0e38;
+
+        for (int k = 0; k < n; k++) {
+            float ax = allBodies[i].pxs[k];
+            float ay = allBodies[i].pys[k];
+            float bx = allBodies[i].pxs[(k+1) % n];
+            float by = allBodies[i].pys[(k+1) % n];
+
+            // Core edge crossing
+            if (n >= 3 && ((ay <= y && y < by) || (by <= y && y < ay))) {
+                float x = ax + (y - ay) * (bx - ax) / (by - ay);
+                lo = floatMin(lo, x);
+                hi = floatMax(hi, x);
+            }
+            if (r <= 0) continue;
+
+            // Rounded corner
+            float d = y - ay;
+            if (floatAbs(d) <= r) {
+                float w = sqrt(r*r - d*d);
+                lo = floatMin(lo, ax - w);
+                hi = floatMax(hi, ax + w);
+            }
 
-    // float lastX = allBodies[rbIdx].pxs[0];
-    // float lastY = allBodies[rbIdx].pys[0];
+            // Edge pushed out by the radius, on both sides since the winding is not fixed
+            float ex = bx - ax;
+            float ey = by - ay;
+            float len = sqrt(ex*ex + ey*ey);
+            if (len <= EPSILON_RB) continue;
+            for (int side = -1; side <= 1; side += 2) {
+                float ox = -ey / len * r * side;
+                float oy = ex / len * r * side;
+                if ((ay + oy <= y && y < by + oy) || (by + oy <= y && y < ay + oy)) {
+                    float x = ax + ox + (y - ay - oy) * ex / ey;
+                    lo = floatMin(lo, x);
+                    hi = floatMax(hi, x);
+                }
+            }
+        }
 
-    // for(int i = 1; i< VERTICIES_PER_BODY; i++) {
-    //     if ((x - lastX >= 0) != (x - allBodies[rbIdx].pxs[i] >= 0)) diffsInX = true;
-    //     if ((y - lastY >= 0) != (y - allBodies[rbIdx].pys[i] >= 0)) diffsInY = true;
-    //     lastX = allBodies[rbIdx].pxs[i];
-    //     lastY = allBodies[rbIdx].pys[i];
-    // }
+        // Empty rows keep x1 < x0 so the fill loops skip them.
+        int x0 = 1;
+        int x1 = 0;
+        if (lo <= hi) {
+            x0 = ceil(floatMax(PX_PER_M_RB * lo, 0.0));
+            x1 = floor(floatMin(PX_PER_M_RB * hi, domain.width - 1));
+        }
+        rbMapSpans[i][row][0] = x0;
+        rbMapSpans[i][row][1] = x1;
+    }
 
-    // return (diffsInX && diffsInY);
+    rbMapPose[i][0] = allBodies[i].cx;
+    rbMapPose[i][1] = allBodies[i].cy;
+    rbMapPose[i][2] = allBodies[i].theta;
 
-} 
+}
 
-// Returns true if bodies I 
-bool isColliding(int i, int j){
-    bool hasCollided = true;
-    float dx, dy, miniDot, minjDot, maxiDot, maxjDot;
-    // Loop over edge normals of both shapes.
-    for(int vertIdx = 0; vertIdx < (VERTICIES_PER_BODY<<1); vertIdx++) {
-        
-        int startIdxi = (vertIdx % 4)? (vertIdx % 4)-1 : VERTICIES_PER_BODY - 1;
-        int endIdxi = (vertIdx % 4);
-        
-        // dx and dy here define our current edge on either i or j (and the vector parallel to it).
-        if(vertIdx < VERTICIES_PER_BODY){
-            dx = allBodies[i].pxs[endIdxi] - allBodies[i].pxs[startIdxi];
-            dy = allBodies[i].pys[endIdxi] - allBodies[i].pys[startIdxi];
-        } else {
-            dx = allBodies[j].pxs[endIdxi] - allBodies[j].pxs[startIdxi];
-            dy = allBodies[j].pys[endIdxi] - allBodies[j].pys[startIdxi];
+void fillRBSpans(int i) {
+    for (int row = rbMapRowMin[i]; row <= rbMapRowMax[i]; row++) {
+        short int *cell = &collisionMap[row][rbMapSpans[i][row][0]];
+        for (int x = rbMapSpans[i][row][0]; x <= rbMapSpans[i][row][1]; x++) *cell++ = i;
+    }
+}
+
+// Clears the pixels body i still owns.
+void clearRBSpans(int i) {
+    for (int row = rbMapRowMin[i]; row <= rbMapRowMax[i]; row++) {
+        short int *cell = &collisionMap[row][rbMapSpans[i][row][0]];
+        for (int x = rbMapSpans[i][row][0]; x <= rbMapSpans[i][row][1]; x++, cell++) {
+            if (*cell == i) *cell = RB_MAP_EMPTY;
         }
+    }
+}
 
-        Vector2D normalVec, cVec;
-        float testDot, testiIdxMin, testjIdxMin, testiIdxMax, testjIdxMax;
-        normalVec.x = -dy;
-        normalVec.y = dx;
+bool rbMapSpansOverlap(int i, int j) {
+    if (rbMapRowMax[i] < rbMapRowMin[j] || rbMapRowMax[j] < rbMapRowMin[i]) return false;
+    int row0 = rbMapRowMin[i] > rbMapRowMin[j] ? rbMapRowMin[i] : rbMapRowMin[j];
+    int row1 = rbMapRowMax[i] < rbMapRowMax[j] ? rbMapRowMax[i] : rbMapRowMax[j];
+    for (int row = row0; row <= row1; row++) {
+        if (rbMapSpans[i][row][0] <= rbMapSpans[j][row][1] && rbMapSpans[j][row][0] <= rbMapSpans[i][row][1]) return true;
+    }
+    return false;
+}
 
-        miniDot = 1.0e38;
-        minjDot = 1.0e38;
-        maxiDot = -1.0e38;
-        maxjDot = -1.0e38;
+// Brings collisionMap up to date. Bodies that moved or were despawned are lifted out, any resting body
+// they uncovered is filled back in, then the moved and newly spawned bodies are filled at their new pose.
+void updateCollisionMap() {
 
-        for(int vertIdxi = 0; vertIdxi < VERTICIES_PER_BODY; vertIdxi++) {
-            cVec.x = allBodies[i].pxs[vertIdxi];
-            cVec.y = allBodies[i].pys[vertIdxi];
-            testDot = dotProd2D(&normalVec, &cVec);
-            if(testDot < miniDot){miniDot = testDot; testiIdxMin = vertIdxi;}
-            if(testDot > maxiDot){maxiDot = testDot; testiIdxMax = vertIdxi;}
-        }
-        for(int vertIdxj = 0; vertIdxj < VERTICIES_PER_BODY; vertIdxj++) {
-            cVec.x = allBodies[j].pxs[vertIdxj];
-            cVec.y = allBodies[j].pys[vertIdxj];
-            testDot = dotProd2D(&normalVec, &cVec);
-            if(testDot < minjDot){minjDot = testDot; testjIdxMin = vertIdxj;}
-            if(testDot > maxjDot){maxjDot = testDot; testjIdxMax = vertIdxj;}
+    int lifted[MAX_BODIES];
+    int numLifted = 0;
+
+    for (int i = 0; i < MAX_BODIES; i++) {
+        if (!rbMapped[i]) continue;
+        if (rbActiveSlot[i] >= 0 && rbMapPose[i][0] == allBodies[i].cx && rbMapPose[i][1] == allBodies[i].cy &&
+            rbMapPose[i][2] == allBodies[i].theta) continue;
+        clearRBSpans(i);
+        rbMapped[i] = false;
+        lifted[numLifted++] = i;
+    }
+    for (int a = 0; a < numRBActive; a++) {
+        int i = rbActive[a];
+        if (!rbMapped[i]) continue;
+        for (int l = 0; l < numLifted; l++) {
+            if (rbMapSpansOverlap(i, lifted[l])) {
+                fillRBSpans(i);
+                break;
+            }
         }
+    }
 
-        // Test to see if we have found a seperating axis
-        if(miniDot>=maxjDot || maxiDot<=minjDot) {hasCollided = false; break;}
-        
+    for (int a = 0; a < numRBActive; a++) {
+        int i = rbActive[a];
+        if (rbMapped[i]) continue;
+        rasteriseRBSpans(i);
+        fillRBSpans(i);
+        rbMapped[i] = true;
     }
-    return hasCollided;
+
 }
-// Check if rigid body I has coillided with any rigid body j
-// Credit to the SAT. (Seperating Axis Theorem).
-// https://dyn4j.org/2010/01/sat/ For details
-// https://www.chrishecker.com/images/e/e7/Gdmphys3.pdf for impulse physics formulas
-void checkSATInterBodyCollision(int i){
-    
-    // if (i==currentMouseInteractionObj) return;
-    float dy, dx;
-    float maxiDot, miniDot;
-    float maxjDot, minjDot;
 
-    int forceIndex = VERTICIES_PER_BODY - 1;
-    bool neverCollided = true;
+void clearCollisionMap() {
+    for (int y = 0; y < domain.height; y++) {
+        for (int x = 0; x < domain.width; x++) collisionMap[y][x] = RB_MAP_EMPTY;
+    }
+    for (int i = 0; i < MAX_BODIES; i++) rbMapped[i] = false;
+}
 
-    for(int j = 0; j < NUM_BODIES; j++){
+// Body covering pixel (x, y), or RB_MAP_EMPTY.
+int rbAtPixel(int x, int y) {
+    if (x < 0 || x >= domain.width || y < 0 || y >= domain.height) return RB_MAP_EMPTY;
+    int i = collisionMap[y][x];
+    return (i != RB_MAP_EMPTY && rbActiveSlot[i] >= 0) ? i : RB_MAP_EMPTY;
+}
 
-        forceIndex += 1;
-        if (j==i) continue;
-        // if (j==currentMouseInteractionObj) continue;
+// Bodies are also binned into the fluid's grid after every step, so one structure answers area queries
+// for both, and the coupled world finds the bodies near a particle from its own cell.
+#define MAX_GRID_BODY_ENTRIES   (GRID_MAX_CELLS*4)
+#define RB_GRID_MARGIN_PX       2.0 // Bodies are binned this far past their bounds
+
+int gridBodyStart[GRID_MAX_CELLS + 1]; // Bodies overlapping cell c are gridBodies[start[c] .. start[c+1])
+int gridBodies[MAX_GRID_BODY_ENTRIES];
+bool bodyIsBinned[MAX_BODIES];
+
+// Cell range covered by body i's bounds grown by the margin.
+void gridCellRangeOfRB(int i, int * gx0, int * gy0, int * gx1, int * gy1) {
+    int margin = ceil(RB_GRID_MARGIN_PX);
+    *gx0 = (allBodies[i].minPX - margin) / GRID_CELL_PX;
+    *gy0 = (allBodies[i].minPY - margin) / GRID_CELL_PX;
+    *gx1 = (allBodies[i].maxPX + margin) / GRID_CELL_PX;
+    *gy1 = (allBodies[i].maxPY + margin) / GRID_CELL_PX;
+    *gx0 = *gx0 < 0 ? 0 : *gx0;
+    *gy0 = *gy0 < 0 ? 0 : *gy0;
+    *gx1 = *gx1 >= gridColumns ? gridColumns - 1 : *gx1;
+    *gy1 = *gy1 >= gridRows ? gridRows - 1 : *gy1;
+}
 
-        // if (bookMarkedCollisions[i][j]) continue;
-        // Hold the minimum found sep value between bodies i and j.
-        float minSep = 1.0e38;
-        int testiIdxMin, testjIdxMin, testiIdxMax, testjIdxMax;
-        int minSepEdgeBodyIdx = 0;
-        int minSepVertBodyIdx = 0;
-        int minSepBodyVertIdx = 0;
-        Vector2D minEdgeResponsible, normMinEdgeResponsible;
+// Counting sort of the bodies into the grid. A body that would overflow the entry table is left out.
+void binBodiesToGrid() {
 
-        bool hasCollided = true;
+    int gx0, gy0, gx1, gy1;
+    int total = 0;
 
-        // Loop over edge normals of both shapes.
-        for(int vertIdx = 0; vertIdx < (VERTICIES_PER_BODY<<1); vertIdx++) {
-            
-            int startIdxi = (vertIdx % 4)? (vertIdx % 4)-1 : VERTICIES_PER_BODY - 1;
-            int endIdxi = (vertIdx % 4);
-            
-            // dx and dy here define our current edge on either i or j (and the vector parallel to it).
-            if(vertIdx < VERTICIES_PER_BODY){
-                dx = allBodies[i].pxs[endIdxi] - allBodies[i].pxs[startIdxi];
-                dy = allBodies[i].pys[endIdxi] - allBodies[i].pys[startIdxi];
-            } else {
-                dx = allBodies[j].pxs[endIdxi] - allBodies[j].pxs[startIdxi];
-                dy = allBodies[j].pys[endIdxi] - allBodies[j].pys[startIdxi];
-            }
+    for (int cell = 0; cell <= gridCells; cell++) gridBodyStart[cell] = 0;
 
-            Vector2D normalVec, cVec;
-            float testDot;
-            normalVec.x = -dy;
-            normalVec.y = dx;
-
-            miniDot = 1.0e38;
-            minjDot = 1.0e38;
-            maxiDot = -1.0e38;
-            maxjDot = -1.0e38;
-
-            for(int vertIdxi = 0; vertIdxi < VERTICIES_PER_BODY; vertIdxi++) {
-                cVec.x = allBodies[i].pxs[vertIdxi];
-                cVec.y = allBodies[i].pys[vertIdxi];
-                testDot = dotProd2D(&normalVec, &cVec);
-                if(testDot < miniDot){miniDot = testDot; testiIdxMin = vertIdxi;}
-                if(testDot > maxiDot){maxiDot = testDot; testiIdxMax = vertIdxi;}
-            }
-            for(int vertIdxj = 0; vertIdxj < VERTICIES_PER_BODY; vertIdxj++) {
-                cVec.x = allBodies[j].pxs[vertIdxj];
-                cVec.y = allBodies[j].pys[vertIdxj];
-                testDot = dotProd2D(&normalVec, &cVec);
-                if(testDot < minjDot){minjDot = testDot; testjIdxMin = vertIdxj;}
-                if(testDot > maxjDot){maxjDot = testDot; testjIdxMax = vertIdxj;}
-            }
+    for (int a = 0; a < numRBActive; a++) {
+        int i = rbActive[a];
+        gridCellRangeOfRB(i, &gx0, &gy0, &gx1, &gy1);
+        int cells = (gx1 - gx0 + 1) * (gy1 - gy0 + 1);
+        bodyIsBinned[i] = total + cells <= MAX_GRID_BODY_ENTRIES;
+        if (!bodyIsBinned[i]) continue;
+        total += cells;
+        for (int gy = gy0; gy <= gy1; gy++) {
+            for (int gx = gx0; gx <= gx1; gx++) gridBodyStart[gy * gridColumns + gx + 1]++;
+        }
+    }
+    for (int cell = 0; cell < gridCells; cell++) {
+        gridBodyStart[cell + 1] += gridBodyStart[cell];
+        gridCursor[cell] = gridBodyStart[cell];
+    }
+    for (int a = 0; a < numRBActive; a++) {
+        int i = rbActive[a];
+        if (!bodyIsBinned[i]) continue;
+        gridCellRangeOfRB(i, &gx0, &gy0, &gx1, &gy1);
+        for (int gy = gy0; gy <= gy1; gy++) {
+            for (int gx = gx0; gx <= gx1; gx++) gridBodies[gridCursor[gy * gridColumns + gx]++] = i;
+        }
+    }
 
-            // Test to see if we have found a seperating axis
-            if(miniDot>=maxjDot || maxiDot<=minjDot) {hasCollided = false; break;}
-
-            // If we are still here then we have not found the seperating axis and can still collide.
-            float seperation = -floatMin(maxiDot-minjDot, maxjDot-miniDot);
-            // printf("SEP: %f\n\n", seperation);
-            if (seperation <= minSep) {
-                // printf("we haere\n");
-                minSep = seperation;
-                minEdgeResponsible.x = dx;
-                minEdgeResponsible.y = dy;
-                float magPos = sqrt(dx*dx+dy*dy);
-                normMinEdgeResponsible.x = -dx;
-                normMinEdgeResponsible.y = -dy;
-
-                minSepEdgeBodyIdx = vertIdx < VERTICIES_PER_BODY ? i : j;
-                minSepVertBodyIdx = minSepEdgeBodyIdx == i ? j : i;
-                
-                // Which vert of the vert body is responsible:
-                if(maxiDot-minjDot < maxjDot-miniDot) {
-                    if (minSepVertBodyIdx==i){
-                        minSepBodyVertIdx = testiIdxMax;
-                    } else {
-                        minSepBodyVertIdx = testjIdxMin;
-                    }
-                } else {
-                    if (minSepVertBodyIdx==i){
-                        minSepBodyVertIdx = testiIdxMin;
-                    } else {
-                        minSepBodyVertIdx = testjIdxMax;
-                    }
-                }
+}
 
-            }
-        }
+void resetRBPool() {
+    clearCollisionMap();
+    numRBActive = 0;
+    numRBFree = 0;
+    numRBPendingErase = 0;
+    for (int i = MAX_BODIES - 1; i >= 0; i--) {
+        rbActiveSlot[i] = -1;
+        rbFreeList[numRBFree++] = i; // Reversed so that bodies come out as 0, 1, 2...
+    }
+    currentMouseInteractionObj = -1;
+}
 
-        if (hasCollided /*&& !bookMarkedCollisions[i][j]*/) {
+// Takes a slot off the free list and appends it to the active and sweep lists. Returns -1 if the pool is full.
+int allocRigidBody() {
+    if (numRBFree == 0) return -1;
+    int i = rbFreeList[--numRBFree];
+    rbActiveSlot[i] = numRBActive;
+    rbActive[numRBActive] = i;
+    rbSweepOrder[numRBActive] = i;
+    numRBActive++;
+    allBodies[i].force = constrVec(0.0, 0.0);
+    allBodies[i].torque = 0;
+    allBodies[i].cLast = false;
+    allBodies[i].lastPositionDelta = 0;
+    return i;
+}
 
-            neverCollided = false;
-            // Find the vert of the so-called vert body that was responsible for the collision.
-            int vertInsideCount = 0;
-            minSepBodyVertIdx = -1;
-            for(int k = 0; k<VERTICIES_PER_BODY; k++){
-                if(pointIsInsideRB(allBodies[minSepVertBodyIdx].pxs[k], allBodies[minSepVertBodyIdx].pys[k], minSepEdgeBodyIdx)) {
-                    minSepBodyVertIdx = k;
-                    vertInsideCount++;
-                    //draw2b2(allBodies[minSepVertBodyIdx].xs[k], allBodies[minSepVertBodyIdx].ys[k], WATER_COLOUR);
-                    //break;
-                } 
-            }
-            if (minSepBodyVertIdx == -1) {
-                vertInsideCount = 0;
-                swap(&minSepEdgeBodyIdx, &minSepVertBodyIdx);
-                for(int k = 0; k<VERTICIES_PER_BODY; k++){
-                    if(pointIsInsideRB(allBodies[minSepVertBodyIdx].pxs[k], allBodies[minSepVertBodyIdx].pys[k], minSepEdgeBodyIdx)) {
-                        minSepBodyVertIdx = k;
-                        vertInsideCount++;
-                        //draw2b2(allBodies[minSepVertBodyIdx].xs[k], allBodies[minSepVertBodyIdx].ys[k], WATER_COLOUR);
-                        //break;
-                    } 
-                }
-                if (minSepBodyVertIdx == -1) minSepBodyVertIdx = 0;
-            }
-            
-            Vector2D normedA;
-            if(!bookMarkedCollisions[minSepVertBodyIdx][minSepEdgeBodyIdx] && !bookMarkedCollisions[minSepEdgeBodyIdx][minSepVertBodyIdx]) {
-                normedA = constrVec(allBodies[minSepVertBodyIdx].pxs[minSepBodyVertIdx], allBodies[minSepVertBodyIdx].pys[minSepBodyVertIdx]);
-                Vector2D normedB;
+bool rbBoundsTouch(int i, int j) {
+    return !(allBodies[i].maxPX < allBodies[j].minPX - SLEEP_WAKE_MARGIN || allBodies[i].minPX > allBodies[j].maxPX + SLEEP_WAKE_MARGIN ||
+             allBodies[i].maxPY < allBodies[j].minPY - SLEEP_WAKE_MARGIN || allBodies[i].minPY > allBodies[j].maxPY + SLEEP_WAKE_MARGIN);
+}
 
-                normedB = subVec2(&normedA, &allBodies[minSepVertBodyIdx].lastPointofCollision);
-                allBodies[minSepVertBodyIdx].lastPositionDelta = getMag(&normedB);
-                allBodies[minSepVertBodyIdx].lastPointofCollision = normedA;
+// Wakes every sleeping body that went to sleep in the same island as body i, along with any sleeping
+// island resting against it (contacts between sleepers are not tracked, so bounds stand in for them).
+void wakeRBIsland(int i) {
+    if (!allBodies[i].isAsleep) return;
+    int island = allBodies[i].islandIdx;
+    for (int a = 0; a < numRBActive; a++) {
+        int k = rbActive[a];
+        if (!allBodies[k].isAsleep || allBodies[k].islandIdx != island) continue;
+        wakeBody(k);
+        for (int b = 0; b < numRBActive; b++) {
+            int j = rbActive[b];
+            if (allBodies[j].isAsleep && rbBoundsTouch(k, j)) wakeRBIsland(j);
+        }
+    }
+}
 
-                normedB = subVec2(&normedA, &allBodies[minSepEdgeBodyIdx].lastPointofCollision);
-                allBodies[minSepEdgeBodyIdx].lastPositionDelta = getMag(&normedB);
-                allBodies[minSepEdgeBodyIdx].lastPointofCollision = normedA;
+// Removes body i from the simulation. The slot is handed out again once the renderer has erased the body.
+void despawnRigidBody(int i) {
 
-            }
+    int slot = rbActiveSlot[i];
+    if (slot < 0) return;
 
-            // Manual Positional Adjustment
-            float signX = allBodies[minSepVertBodyIdx].pxs[minSepBodyVertIdx] > allBodies[minSepEdgeBodyIdx].cx ? 1 : -1;
-            float signY = allBodies[minSepVertBodyIdx].pys[minSepBodyVertIdx] > allBodies[minSepEdgeBodyIdx].cy ? 1 : -1;
+    // Swap the last live body into the hole.
+    numRBActive--;
+    rbActive[slot] = rbActive[numRBActive];
+    rbActiveSlot[rbActive[slot]] = slot;
+    rbActiveSlot[i] = -1;
 
-            Vector2D unitNorm = multVec2(&normMinEdgeResponsible, (1/getMag(&normMinEdgeResponsible)));
-            dx = unitNorm.x > 0 ? unitNorm.x : -unitNorm.x;
-            dy = unitNorm.y > 0 ? unitNorm.y : -unitNorm.y;
-            dx *= signX;
-            dy *= signY;
-            
-            // while(pointIsInsideRB(
-            //     allBodies[minSepVertBodyIdx].pxs[minSepBodyVertIdx],
-            //     allBodies[minSepVertBodyIdx].pys[minSepBodyVertIdx],
-            //     minSepEdgeBodyIdx
-            // ) || pointIsInsideRB(
-            //     allBodies[minSepVertBodyIdx].cx,
-            //     allBodies[minSepVertBodyIdx].cy,
-            //     minSepEdgeBodyIdx)) {
-            while (isColliding(minSepVertBodyIdx, minSepEdgeBodyIdx)){
-                // draw2b2(allBodies[minSepVertBodyIdx].xs[minSepBodyVertIdx], allBodies[minSepVertBodyIdx].ys[minSepBodyVertIdx], WATER_COLOUR);
-                
-                allBodies[minSepVertBodyIdx].cx += dx;
-                allBodies[minSepVertBodyIdx].cy += dy;
-
-                allBodies[minSepEdgeBodyIdx].cx -= dx;
-                allBodies[minSepEdgeBodyIdx].cy -= dy;
-
-                resetBodyFromCenter(minSepVertBodyIdx);
-                resetBodyFromCenter(minSepEdgeBodyIdx);
+    int k = 0;
+    while (rbSweepOrder[k] != i) k++;
+    for (; k < numRBActive; k++) rbSweepOrder[k] = rbSweepOrder[k+1];
 
-            }
+    rbPendingErase[numRBPendingErase++] = i;
 
-            // Torque handling
-            unitNorm.x = dx;
-            unitNorm.y = dy;
-
-            allBodies[minSepVertBodyIdx].extForces[forceIndex].isActive = true;
-            float magB = allBodies[minSepEdgeBodyIdx].mass * getMag(&allBodies[minSepEdgeBodyIdx].a);
-            normedA = multVec2(&unitNorm, magB);
-            allBodies[minSepVertBodyIdx].extForces[forceIndex].force = normedA;
-            allBodies[minSepVertBodyIdx].extForces[forceIndex].r.x = allBodies[minSepVertBodyIdx].pxs[minSepBodyVertIdx] - allBodies[minSepVertBodyIdx].cx;
-            allBodies[minSepVertBodyIdx].extForces[forceIndex].r.y = allBodies[minSepVertBodyIdx].pys[minSepBodyVertIdx] - allBodies[minSepVertBodyIdx].cy;
-
-            allBodies[minSepEdgeBodyIdx].extForces[forceIndex].isActive = true;
-            float magA = allBodies[minSepVertBodyIdx].mass * getMag(&allBodies[minSepVertBodyIdx].a);
-            normedA = multVec2(&unitNorm, -magA);
-            allBodies[minSepEdgeBodyIdx].extForces[forceIndex].force = normedA;
-            allBodies[minSepEdgeBodyIdx].extForces[forceIndex].r.x = allBodies[minSepVertBodyIdx].pxs[minSepBodyVertIdx] - allBodies[minSepEdgeBodyIdx].cx;
-            allBodies[minSepEdgeBodyIdx].extForces[forceIndex].r.y = allBodies[minSepVertBodyIdx].pys[minSepBodyVertIdx] - allBodies[minSepEdgeBodyIdx].cy;
-
-            if(!allBodies[minSepVertBodyIdx].cLast && !allBodies[minSepEdgeBodyIdx].cLast) {
-                allBodies[minSepVertBodyIdx].v.x *= -ELASTICITY_RB;
-                allBodies[minSepVertBodyIdx].v.y *= -ELASTICITY_RB;
-                allBodies[minSepEdgeBodyIdx].v.x *= -ELASTICITY_RB;
-                allBodies[minSepEdgeBodyIdx].v.y *= -ELASTICITY_RB;
-
-                allBodies[minSepVertBodyIdx].omega *= -ELASTICITY_RB;
-                allBodies[minSepEdgeBodyIdx].omega *= -ELASTICITY_RB;
-            } else {
-                allBodies[minSepVertBodyIdx].v.x *= ELASTICITY_RB;
-                allBodies[minSepVertBodyIdx].v.y *= ELASTICITY_RB;
-                allBodies[minSepEdgeBodyIdx].v.x *= ELASTICITY_RB;
-                allBodies[minSepEdgeBodyIdx].v.y *= ELASTICITY_RB;
-
-                allBodies[minSepVertBodyIdx].omega *= ELASTICITY_RB;
-                allBodies[minSepEdgeBodyIdx].omega *= ELASTICITY_RB;
-            }
-            bookMarkedCollisions[minSepVertBodyIdx][minSepEdgeBodyIdx] = true;
-            bookMarkedCollisions[minSepEdgeBodyIdx][minSepVertBodyIdx] = true;
-            allBodies[minSepVertBodyIdx].cLast = true;
-            allBodies[minSepEdgeBodyIdx].cLast = true;
-            // continue;
-
-            // Collision Resolution (Impulse-Based):
-            normMinEdgeResponsible = unitNorm;
-            Vector2D c1 = subVec2(&allBodies[minSepVertBodyIdx].v, &allBodies[minSepEdgeBodyIdx].v);
-            Vector2D rAP = constrVec(
-                allBodies[minSepVertBodyIdx].pxs[minSepBodyVertIdx] - allBodies[minSepVertBodyIdx].cx,
-                allBodies[minSepVertBodyIdx].pys[minSepBodyVertIdx] - allBodies[minSepVertBodyIdx].cy
-            );
-            Vector2D rBP = constrVec(
-                allBodies[minSepVertBodyIdx].pxs[minSepBodyVertIdx] - allBodies[minSepEdgeBodyIdx].cx,
-                allBodies[minSepVertBodyIdx].pys[minSepBodyVertIdx] - allBodies[minSepEdgeBodyIdx].cy
-            );
-            c1 = multVec2(&c1, (-1-ELASTICITY_RB));
-            float jCoeffNum = dotProd2D(&c1, &normMinEdgeResponsible); 
-            c1 = multVec2(&normMinEdgeResponsible, ((1/allBodies[minSepVertBodyIdx].mass) + (1/allBodies[minSepEdgeBodyIdx].mass)));
-            float jCoeffDenom = dotProd2D(&c1, &normMinEdgeResponsible);
-            jCoeffDenom += pow(dotProd2D(&rAP, &normMinEdgeResponsible),2)/allBodies[minSepVertBodyIdx].I;
-            jCoeffDenom += pow(dotProd2D(&rBP, &normMinEdgeResponsible),2)/allBodies[minSepEdgeBodyIdx].I;
-
-            float jCoeff = jCoeffNum/jCoeffDenom;
-
-            // Linear Velocity response
-            c1 = multVec2(&normMinEdgeResponsible, (jCoeff/allBodies[minSepVertBodyIdx].mass));
-            allBodies[minSepVertBodyIdx].v = addVec2(&allBodies[minSepVertBodyIdx].v, &c1);
-            // allBodies[minSepVertBodyIdx].v = c1;
-            c1 = multVec2(&normMinEdgeResponsible, (jCoeff/allBodies[minSepEdgeBodyIdx].mass));
-            allBodies[minSepEdgeBodyIdx].v = subVec2(&allBodies[minSepEdgeBodyIdx].v, &c1);
-            // allBodies[minSepEdgeBodyIdx].v = multVec2(&c1, -1.0);
-            
-            // Angular Velocity response
-            c1 = multVec2(&normMinEdgeResponsible, jCoeff);
-            allBodies[minSepVertBodyIdx].omega += dotProd2D(&rAP, &c1)/allBodies[minSepVertBodyIdx].I;
-            allBodies[minSepEdgeBodyIdx].omega -= dotProd2D(&rBP, &c1)/allBodies[minSepEdgeBodyIdx].I;
+    if (currentMouseInteractionObj == i) currentMouseInteractionObj = -1;
 
-        }
+    // Whatever was resting on it has lost its support.
+    for (int a = 0; a < numRBActive; a++) {
+        int j = rbActive[a];
+        if (allBodies[j].isAsleep && rbBoundsTouch(i, j)) wakeRBIsland(j);
     }
-    if (neverCollided) {
-        allBodies[i].cLast = false;
+
+}
+
+void putBodyToSleep(int i, int island) {
+    allBodies[i].isAsleep = true;
+    allBodies[i].islandIdx = island;
+    allBodies[i].v = constrVec(0.0, 0.0);
+    allBodies[i].a = constrVec(0.0, 0.0);
+    allBodies[i].omega = 0;
+    allBodies[i].alpha = 0;
+    allBodies[i].cLast = false;
+    allBodies[i].force = constrVec(0.0, 0.0);
+    allBodies[i].torque = 0;
+}
+
+int findRBIsland(int i) {
+    while (rbIslandParent[i] != i) {
+        rbIslandParent[i] = rbIslandParent[rbIslandParent[i]];
+        i = rbIslandParent[i];
     }
-    
+    return i;
 }
 
-void initRigidBodies() {
+void recordRBContact(int i, int j) {
+    if (numRBContactPairs >= MAX_RB_CANDIDATE_PAIRS) return;
+    rbContactPairs[numRBContactPairs][0] = i;
+    rbContactPairs[numRBContactPairs][1] = j;
+    numRBContactPairs++;
+}
 
-    float x = (float)NUM_BODIES*(float)MAX_Y/(float)MAX_X;
-    int amtRows = ceil(sqrt(ceil(x)));
-    int amtColumns = ceil((double)amtRows*(double)MAX_X/(double)MAX_Y);
+// Groups bodies that touched this frame into islands (union-find over the contact pairs) and puts an island
+// to sleep once every body in it has stayed under the velocity thresholds for SLEEP_TIME.
+void updateRBIslands() {
+
+    for (int a = 0; a < numRBActive; a++) {
+        int i = rbActive[a];
+        rbIslandParent[i] = i;
+        rbIslandMinSleep[i] = SLEEP_TIME;
+        if (allBodies[i].isAsleep) continue;
+
+        // Smooth the velocity actually achieved this step so that resting jitter averages out.
+        float vx = (allBodies[i].cx - allBodies[i].lastC.x) / SPH_RB;
+        float vy = (allBodies[i].cy - allBodies[i].lastC.y) / SPH_RB;
+        float w = (allBodies[i].theta - allBodies[i].lastTheta) / SPH_RB;
+        allBodies[i].sleepV.x += SLEEP_SMOOTHING * (vx - allBodies[i].sleepV.x);
+        allBodies[i].sleepV.y += SLEEP_SMOOTHING * (vy - allBodies[i].sleepV.y);
+        allBodies[i].sleepOmega += SLEEP_SMOOTHING * (w - allBodies[i].sleepOmega);
+
+        if (i != currentMouseInteractionObj && getMag(&allBodies[i].sleepV) < SLEEP_LINEAR_THRESH &&
+            floatAbs(allBodies[i].sleepOmega) < SLEEP_ANGULAR_THRESH) {
+            allBodies[i].sleepTimer += SPH_RB;
+        } else {
+            allBodies[i].sleepTimer = 0;
+        }
+    }
 
-    int stepX = MAX_X/amtColumns;
-    int stepY = MAX_Y/amtRows;
+    for (int p = 0; p < numRBContactPairs; p++) {
+        int a = findRBIsland(rbContactPairs[p][0]);
+        int b = findRBIsland(rbContactPairs[p][1]);
+        if (a != b) rbIslandParent[a] = b;
+    }
+    numRBContactPairs = 0;
+
+    // Resting contacts flicker on and off with the jitter, so awake bodies whose bounds touch are joined too.
+    for (int a = 0; a < numRBActive; a++) {
+        int i = rbActive[a];
+        if (allBodies[i].isAsleep) continue;
+        for (int b = a+1; b < numRBActive; b++) {
+            int j = rbActive[b];
+            if (allBodies[j].isAsleep || !rbBoundsTouch(i, j)) continue;
+            int rootI = findRBIsland(i);
+            int rootJ = findRBIsland(j);
+            if (rootI != rootJ) rbIslandParent[rootI] = rootJ;
+        }
+    }
 
-    int avgStepParam =  (stepX + stepY) >> 3;
+    for (int a = 0; a < numRBActive; a++) {
+        int i = rbActive[a];
+        if (allBodies[i].isAsleep) continue;
+        int root = findRBIsland(i);
+        rbIslandMinSleep[root] = floatMin(rbIslandMinSleep[root], allBodies[i].sleepTimer);
+    }
+    for (int a = 0; a < numRBActive; a++) {
+        int i = rbActive[a];
+        if (allBodies[i].isAsleep) continue;
+        int root = findRBIsland(i);
+        if (rbIslandMinSleep[root] >= SLEEP_TIME) putBodyToSleep(i, root);
+    }
 
-    int initX = stepX/2;
-    int initY = stepY/2;
+}
 
-    int xStepCount = 0;
-    int yStepCount = 0;
+// Closest point to (x, y) on the core of body rbIdx (its verticies and the edges between them).
+// Returns the distance to it.
+float closestPointOnRBCore(float x, float y, int rbIdx, Vector2D * closest){
+    
+    int n = allBodies[rbIdx].numVerts;
+    float best = 1.0e38;
+    *closest = constrVec(allBodies[rbIdx].pxs[0], allBodies[rbIdx].pys[0]);
+    for (int i = 0; i < n; i++) {
+        int nextIdx = (i+1) % n;
+        float ax = allBodies[rbIdx].pxs[i];
+        float ay = allBodies[rbIdx].pys[i];
+        float ex = allBodies[rbIdx].pxs[nextIdx] - ax;
+        float ey = allBodies[rbIdx].pys[nextIdx] - ay;
+        float ee = ex*ex + ey*ey;
+        float t = ee > 0 ? ((x - ax)*ex + (y - ay)*ey) / ee : 0;
+        t = floatMin(floatMax(t, 0.0), 1.0);
+        float dx = x - (ax + t*ex);
+        float dy = y - (ay + t*ey);
+        if (dx*dx + dy*dy < best) {
+            best = dx*dx + dy*dy;
+            *closest = constrVec(ax + t*ex, ay + t*ey);
+        }
+    }
+    return sqrt(best);
 
-    for (int i = 0; i < NUM_BODIES; i++) {
+}
 
-        allBodies[i].colour = RB_COLOUR;
+float distanceToRBCore(float x, float y, int rbIdx){
+    Vector2D closest;
+    return closestPointOnRBCore(x, y, rbIdx, &closest);
+}
 
-        if(xStepCount >= amtColumns) {
-            xStepCount = 0;
-            yStepCount++;
-        }
-        if(yStepCount >= amtRows) {
-            yStepCount = 0;
+// Crossing test against the polygon core only.
+bool pointIsInsideRBCore(float x, float y, int rbIdx){
+    
+    if (allBodies[rbIdx].numVerts < 3) return false;
+
+    int counter = 0;
+    for (int i =0; i < allBodies[rbIdx].numVerts; i++) {
+        int nextIdx = (i+1) % allBodies[rbIdx].numVerts;
+        if ((allBodies[rbIdx].pys[i] <= y && y < allBodies[rbIdx].pys[nextIdx]) ||
+            (allBodies[rbIdx].pys[nextIdx] <= y && y < allBodies[rbIdx].pys[i])) {
+            float m = (allBodies[rbIdx].pxs[nextIdx] - allBodies[rbIdx].pxs[i])/(allBodies[rbIdx].pys[nextIdx] - allBodies[rbIdx].pys[i]);
+            if (isnan(m)) m = 1.0e38;
+            float root = allBodies[rbIdx].pxs[i] + (y - allBodies[rbIdx].pys[i]) * m;
+            if (x < root) counter++;
         }
+    }
+    return ((counter % 2 ) == 1); // If we crossed an odd amt. of times. we must be inside.
 
-        int centX = initX + xStepCount * stepX;
-        int centY = initY + yStepCount * stepY;
+}
 
-        int signX = -1;
-        int signY = -1;
-        bool changeFlag = false;
+bool pointIsInsideRB(float x, float y, int rbIdx){
+    
+    // Rounded shapes: anything within the radius of the core is inside.
+    if (allBodies[rbIdx].radius > 0 && distanceToRBCore(x, y, rbIdx) <= allBodies[rbIdx].radius) return true;
+    return pointIsInsideRBCore(x, y, rbIdx);
 
-        float sumX = 0;
-        float sumY = 0;
+    // bool diffsInX = false;
+    // bool diffsInY = false;
 
-        float runningAreaCount = 0;
+    // float lastX = allBodies[rbIdx].pxs[0];
+    // float lastY = allBodies[rbIdx].pys[0];
 
-        allBodies[i].v.x = 0;
-        allBodies[i].v.y = rand() % VERT_VARIANCE - (VERT_VARIANCE >> 1);
-        allBodies[i].theta = 0;
-        allBodies[i].omega = 0;
+    // for(int i = 1; i< VERTICIES_PER_BODY; i++) {
+    //     if ((x - lastX >= 0) != (x - allBodies[rbIdx].pxs[i] >= 0)) diffsInX = true;
+    //     if ((y - lastY >= 0) != (y - allBodies[rbIdx].pys[i] >= 0)) diffsInY = true;
+    //     lastX = allBodies[rbIdx].pxs[i];
+    //     lastY = allBodies[rbIdx].pys[i];
+    // }
 
-        allBodies[i].lastPointofCollision = constrVec(0.0, 0.0);
-        for (int j = 0; j < VERTICIES_PER_BODY; j++) {
+    // return (diffsInX && diffsInY);
 
-            // srand(i+j);
-            allBodies[i].xs[j] = centX + signX*avgStepParam + rand() % VERT_VARIANCE - (VERT_VARIANCE >> 1);
-            allBodies[i].ys[j] = centY + signY*avgStepParam + rand() % VERT_VARIANCE - (VERT_VARIANCE >> 1);
-            
-            eraseRBs[i].xs[j] = allBodies[i].xs[j];
-            eraseRBs[i].ys[j] = allBodies[i].ys[j];
+} 
 
-            allBodies[i].pxs[j] = M_PER_PX_RB * allBodies[i].xs[j];
-            allBodies[i].pys[j] = M_PER_PX_RB * allBodies[i].ys[j];
+// Support point of body i's core in direction d. The radius is added by the callers.
+Vector2D supportRB(int i, Vector2D * d) {
+    int best = 0;
+    float bestDot = allBodies[i].pxs[0] * d->x + allBodies[i].pys[0] * d->y;
+    for (int k = 1; k < allBodies[i].numVerts; k++) {
+        float testDot = allBodies[i].pxs[k] * d->x + allBodies[i].pys[k] * d->y;
+        if (testDot > bestDot) {
+            bestDot = testDot;
+            best = k;
+        }
+    }
+    return constrVec(allBodies[i].pxs[best], allBodies[i].pys[best]);
+}
 
-            sumX += allBodies[i].pxs[j];
-            sumY += allBodies[i].pys[j];
+// Support point of the Minkowski difference (core i - core j) in direction d.
+GJKVertex supportMinkowskiRB(int i, int j, Vector2D * d) {
+    GJKVertex v;
+    Vector2D negD = multVec2(d, -1.0);
+    v.a = supportRB(i, d);
+    v.b = supportRB(j, &negD);
+    v.w = subVec2(&v.a, &v.b);
+    v.u = 1.0;
+    return v;
+}
 
-            // printf("\nsX:%d", signX);
-            // printf("\nsY:%d\n\n", signY);
+// Reduces the simplex to the feature closest to the origin and sets its barycentric weights.
+// Returns the number of verticies left. 3 means the origin is inside the triangle.
+int solveGJKSimplex(GJKVertex * simplex, int count) {
 
-            if(signX == -1) {
-                signX = 1;
-            } else {
-                if(changeFlag) {
-                    signX = -1;
-                    changeFlag = false;
-                }
-                changeFlag = true;
-                signY = 1;
-            }
+    if (count == 1) {
+        simplex[0].u = 1.0;
+        return 1;
+    }
 
-            if(j!=0) runningAreaCount += (allBodies[i].pxs[j-1] + allBodies[i].pxs[j]) * (allBodies[i].pys[j-1] - allBodies[i].pys[j]) / 2.0;
+    Vector2D w1 = simplex[0].w;
+    Vector2D w2 = simplex[1].w;
+    Vector2D e12 = subVec2(&w2, &w1);
+    float d12_1 = dotProd2D(&w2, &e12);
+    float d12_2 = -dotProd2D(&w1, &e12);
 
+    if (count == 2) {
+        if (d12_2 <= 0) {
+            simplex[0].u = 1.0;
+            return 1;
+        }
+        if (d12_1 <= 0) {
+            simplex[0] = simplex[1];
+            simplex[0].u = 1.0;
+            return 1;
         }
+        float inv = 1.0 / (d12_1 + d12_2);
+        simplex[0].u = d12_1 * inv;
+        simplex[1].u = d12_2 * inv;
+        return 2;
+    }
+
+    Vector2D w3 = simplex[2].w;
+    Vector2D e13 = subVec2(&w3, &w1);
+    float d13_1 = dotProd2D(&w3, &e13);
+    float d13_2 = -dotProd2D(&w1, &e13);
+    Vector2D e23 = subVec2(&w3, &w2);
+    float d23_1 = dotProd2D(&w3, &e23);
+    float d23_2 = -dotProd2D(&w2, &e23);
+
+    float n123 = magnitudeCrossProd2D(&e12, &e13);
+    float d123_1 = n123 * magnitudeCrossProd2D(&w2, &w3);
+    float d123_2 = n123 * magnitudeCrossProd2D(&w3, &w1);
+    float d123_3 = n123 * magnitudeCrossProd2D(&w1, &w2);
+
+    // Vertex regions
+    if (d12_2 <= 0 && d13_2 <= 0) {
+        simplex[0].u = 1.0;
+        return 1;
+    }
+    if (d12_1 <= 0 && d23_2 <= 0) {
+        simplex[0] = simplex[1];
+        simplex[0].u = 1.0;
+        return 1;
+    }
+    if (d13_1 <= 0 && d23_1 <= 0) {
+        simplex[0] = simplex[2];
+        simplex[0].u = 1.0;
+        return 1;
+    }
+
+    // Edge regions
+    if (d12_1 > 0 && d12_2 > 0 && d123_3 <= 0) {
+        float inv = 1.0 / (d12_1 + d12_2);
+        simplex[0].u = d12_1 * inv;
+        simplex[1].u = d12_2 * inv;
+        return 2;
+    }
+    if (d13_1 > 0 && d13_2 > 0 && d123_2 <= 0) {
+        float inv = 1.0 / (d13_1 + d13_2);
+        simplex[0].u = d13_1 * inv;
+        simplex[1] = simplex[2];
+        simplex[1].u = d13_2 * inv;
+        return 2;
+    }
+    if (d23_1 > 0 && d23_2 > 0 && d123_1 <= 0) {
+        float inv = 1.0 / (d23_1 + d23_2);
+        simplex[0] = simplex[2];
+        simplex[0].u = d23_2 * inv;
+        simplex[1].u = d23_1 * inv;
+        return 2;
+    }
 
-        runningAreaCount += (allBodies[i].pxs[VERTICIES_PER_BODY-1] + allBodies[i].pxs[0]) * (allBodies[i].pys[VERTICIES_PER_BODY-1] - allBodies[i].pys[0]) / 2.0;
+    // Inside the triangle
+    float inv = 1.0 / (d123_1 + d123_2 + d123_3);
+    simplex[0].u = d123_1 * inv;
+    simplex[1].u = d123_2 * inv;
+    simplex[2].u = d123_3 * inv;
+    return 3;
 
-        allBodies[i].cx = sumX / (float)VERTICIES_PER_BODY;
-        allBodies[i].cy = sumY / (float)VERTICIES_PER_BODY;
+}
 
-        float maxX = -1;
-        float maxY = -1;
-        float minX = M_PER_PX_RB * MAX_X;
-        float minY = M_PER_PX_RB * MAX_Y;
+// GJK distance between the cores of bodies i and j. Gives up early once the cores are known to be more
+// than maxDist apart, which is the common case for pairs that are near each other but not touching.
+// Reference: https://box2d.org/files/ErinCatto_GJK_GDC2010.pdf
+void runGJK(int i, int j, float maxDist, GJKResult * res) {
 
-        for (int j = 0; j < VERTICIES_PER_BODY; j++) {
+    res->overlap = false;
+    res->separated = false;
 
-            maxX = allBodies[i].pxs[j] > maxX ? allBodies[i].pxs[j] : maxX;
-            maxY = allBodies[i].pys[j] > maxY ? allBodies[i].pys[j] : maxY;
-            minX = allBodies[i].pxs[j] < minX ? allBodies[i].pxs[j] : minX;
-            minY = allBodies[i].pys[j] < minY ? allBodies[i].pys[j] : minY;
+    Vector2D d = constrVec(allBodies[i].cx - allBodies[j].cx, allBodies[i].cy - allBodies[j].cy);
+    if (d.x == 0 && d.y == 0) d.x = 1.0;
+    res->simplex[0] = supportMinkowskiRB(i, j, &d);
+    res->count = 1;
 
-            float dx = allBodies[i].pxs[j] - allBodies[i].cx;
-            float dy = allBodies[i].pys[j] - allBodies[i].cy;
+    for (int iter = 0; iter < GJK_MAX_ITERATIONS; iter++) {
 
-            allBodies[i].vDistances[j] = sqrt(dx*dx+dy*dy);
-            allBodies[i].constThetas[j] = atan2(dy, dx);
+        res->count = solveGJKSimplex(res->simplex, res->count);
+        if (res->count == 3) {
+            res->overlap = true;
+            return;
+        }
 
+        Vector2D p = constrVec(0.0, 0.0);
+        for (int k = 0; k < res->count; k++) {
+            p.x += res->simplex[k].u * res->simplex[k].w.x;
+            p.y += res->simplex[k].u * res->simplex[k].w.y;
+        }
+        float pp = dotProd2D(&p, &p);
+        if (pp < GJK_TOLERANCE * GJK_TOLERANCE) {
+            res->overlap = true; // Touching cores. EPA sorts out the normal.
+            return;
         }
 
-        allBodies[i].maxPX = maxX * PX_PER_M_RB;
-        allBodies[i].maxPY = maxY * PX_PER_M_RB;
-        allBodies[i].minPX = minX * PX_PER_M_RB;
-        allBodies[i].minPY = minY * PX_PER_M_RB;
+        d = multVec2(&p, -1.0);
+        GJKVertex v = supportMinkowskiRB(i, j, &d);
 
-        allBodies[i].mass = BODY_DENSITY * abs(runningAreaCount);
-        allBodies[i].I = allBodies[i].mass * (pow(maxX-minX, 2) + pow(maxY-minY, 2)) / 12.0;
+        // Every point of the difference lies at least -proj/|p| from the origin along d.
+        float proj = dotProd2D(&v.w, &d);
+        if (proj < 0 && proj * proj > maxDist * maxDist * pp) {
+            res->separated = true;
+            return;
+        }
 
-        xStepCount++;
+        // No progress towards the origin means p is the closest point.
+        if (pp + proj <= GJK_TOLERANCE * pp) break;
 
+        bool duplicate = false;
+        for (int k = 0; k < res->count; k++) {
+            if (res->simplex[k].w.x == v.w.x && res->simplex[k].w.y == v.w.y) duplicate = true;
+        }
+        if (duplicate) break;
+
+        res->simplex[res->count] = v;
+        res->count++;
+    }
+
+    res->pointA = constrVec(0.0, 0.0);
+    res->pointB = constrVec(0.0, 0.0);
+    for (int k = 0; k < res->count; k++) {
+        res->pointA.x += res->simplex[k].u * res->simplex[k].a.x;
+        res->pointA.y += res->simplex[k].u * res->simplex[k].a.y;
+        res->pointB.x += res->simplex[k].u * res->simplex[k].b.x;
+        res->pointB.y += res->simplex[k].u * res->simplex[k].b.y;
     }
+    Vector2D gap = subVec2(&res->pointB, &res->pointA);
+    res->distance = getMag(&gap);
 
 }
 
-void eraseBodies() {
+// Grows a degenerate GJK simplex (cores touching at a point or along a line) into a triangle for EPA.
+bool blowUpGJKSimplex(int i, int j, GJKResult * g) {
 
-    for (int i = 0; i<NUM_BODIES; i++) {
-        for (int j = 1; j<VERTICIES_PER_BODY; j++) {
-            drawBresenhamLine(eraseRBs[i].xs[j-1], eraseRBs[i].ys[j-1], eraseRBs[i].xs[j], eraseRBs[i].ys[j], BLACK);
+    Vector2D dirs[4] = {{1.0, 0.0}, {0.0, 1.0}, {-1.0, 0.0}, {0.0, -1.0}};
+
+    for (int k = 0; k < 4 && g->count == 1; k++) {
+        GJKVertex v = supportMinkowskiRB(i, j, &dirs[k]);
+        Vector2D diff = subVec2(&v.w, &g->simplex[0].w);
+        if (dotProd2D(&diff, &diff) > GJK_TOLERANCE) g->simplex[g->count++] = v;
+    }
+    if (g->count == 1) return false;
+
+    if (g->count == 2) {
+        Vector2D e = subVec2(&g->simplex[1].w, &g->simplex[0].w);
+        Vector2D n = constrVec(-e.y, e.x);
+        for (int k = 0; k < 2 && g->count == 2; k++) {
+            GJKVertex v = supportMinkowskiRB(i, j, &n);
+            Vector2D diff = subVec2(&v.w, &g->simplex[0].w);
+            if (floatAbs(magnitudeCrossProd2D(&e, &diff)) > GJK_TOLERANCE) g->simplex[g->count++] = v;
+            n = multVec2(&n, -1.0);
         }
-        drawBresenhamLine(eraseRBs[i].xs[VERTICIES_PER_BODY-1], eraseRBs[i].ys[VERTICIES_PER_BODY-1], eraseRBs[i].xs[0], eraseRBs[i].ys[0], BLACK);
-    }   
+    }
+    return g->count == 3;
 
 }
 
-void drawBodies() {
+// EPA on overlapping cores. Expands the GJK triangle towards the edge of the Minkowski difference closest
+// to the origin, which gives the unit normal (from i to j) and depth of the core penetration along with
+// the matching points on each core.
+bool runEPA(int i, int j, GJKResult * g, Vector2D * normal, float * depth, Vector2D * pointA, Vector2D * pointB) {
+
+    if (g->count < 3 && !blowUpGJKSimplex(i, j, g)) return false;
 
-    for (int i = 0; i<NUM_BODIES; i++) {
-        for (int j = 1; j<VERTICIES_PER_BODY; j++) {
-            drawBresenhamLine(allBodies[i].xs[j-1], allBodies[i].ys[j-1], allBodies[i].xs[j], allBodies[i].ys[j], allBodies[i].colour);
+    GJKVertex poly[EPA_MAX_VERTICIES];
+    int n = 3;
+    for (int k = 0; k < 3; k++) poly[k] = g->simplex[k];
+
+    // Keep the polytope counter-clockwise so the edge normals (e.y, -e.x) point outwards.
+    Vector2D e1 = subVec2(&poly[1].w, &poly[0].w);
+    Vector2D e2 = subVec2(&poly[2].w, &poly[0].w);
+    if (magnitudeCrossProd2D(&e1, &e2) < 0) {
+        GJKVertex temp = poly[1];
+        poly[1] = poly[2];
+        poly[2] = temp;
+    }
+
+    int bestEdge = 0;
+    float bestDist = 1.0e38;
+    Vector2D bestNormal = constrVec(0.0, 1.0);
+
+    for (int iter = 0; iter < EPA_MAX_ITERATIONS; iter++) {
+
+        bestDist = 1.0e38;
+        for (int k = 0; k < n; k++) {
+            int next = (k+1) % n;
+            Vector2D e = subVec2(&poly[next].w, &poly[k].w);
+            Vector2D en = constrVec(e.y, -e.x);
+            float mag = getMag(&en);
+            if (mag < GJK_TOLERANCE) continue;
+            en = multVec2(&en, 1.0 / mag);
+            float dist = dotProd2D(&en, &poly[k].w);
+            if (dist < bestDist) {
+                bestDist = dist;
+                bestEdge = k;
+                bestNormal = en;
+            }
         }
-        drawBresenhamLine(allBodies[i].xs[VERTICIES_PER_BODY-1], allBodies[i].ys[VERTICIES_PER_BODY-1], allBodies[i].xs[0], allBodies[i].ys[0], allBodies[i].colour);
-    }   
 
-}
+        GJKVertex v = supportMinkowskiRB(i, j, &bestNormal);
+        if (dotProd2D(&v.w, &bestNormal) - bestDist < GJK_TOLERANCE || n >= EPA_MAX_VERTICIES) break;
 
-void updateRBMinsAndMaxes(int i){
+        for (int k = n; k > bestEdge + 1; k--) poly[k] = poly[k-1];
+        poly[bestEdge + 1] = v;
+        n++;
+    }
 
-    int cMaxX = INT_MIN_C;
+    // Closest point on the best edge to the origin, mapped back onto both cores.
+    GJKVertex * va = &poly[bestEdge];
+    GJKVertex * vb = &poly[(bestEdge + 1) % n];
+    Vector2D e = subVec2(&vb->w, &va->w);
+    float ee = dotProd2D(&e, &e);
+    float t = ee > 0 ? -dotProd2D(&va->w, &e) / ee : 0;
+    t = floatMin(floatMax(t, 0.0), 1.0);
+
+    *normal = bestNormal;
+    *depth = bestDist;
+    *pointA = constrVec(va->a.x + (vb->a.x - va->a.x) * t, va->a.y + (vb->a.y - va->a.y) * t);
+    *pointB = constrVec(va->b.x + (vb->b.x - va->b.x) * t, va->b.y + (vb->b.y - va->b.y) * t);
+    return true;
+
+}
+
+// Narrow phase for bodies i and j: GJK on the cores, then the radii, then EPA if the cores overlap.
+// Returns true if the shapes overlap and fills the contact (normal from i to j, depth, and a point
+// half way between the two surfaces).
+bool computeRBContact(int i, int j, RBContact * contact) {
+
+    float rA = allBodies[i].radius;
+    float rB = allBodies[j].radius;
+    GJKResult g;
+    runGJK(i, j, rA + rB, &g);
+    if (g.separated) return false;
+
+    Vector2D pointA, pointB;
+    contact->bodyA = i;
+    contact->bodyB = j;
+
+    if (!g.overlap) {
+        if (g.distance > rA + rB || g.distance < GJK_TOLERANCE) {
+            if (g.distance > rA + rB) return false;
+            g.overlap = true;
+            g.count = g.count < 1 ? 1 : g.count;
+        } else {
+            contact->normal = subVec2(&g.pointB, &g.pointA);
+            contact->normal = multVec2(&contact->normal, 1.0 / g.distance);
+            contact->depth = rA + rB - g.distance;
+            pointA = g.pointA;
+            pointB = g.pointB;
+        }
+    }
+
+    if (g.overlap) {
+        if (!runEPA(i, j, &g, &contact->normal, &contact->depth, &pointA, &pointB)) {
+            // Cores are points or lie along one line. Fall back to the line between the centres.
+            Vector2D ci = constrVec(allBodies[i].cx, allBodies[i].cy);
+            Vector2D cj = constrVec(allBodies[j].cx, allBodies[j].cy);
+            Vector2D cd = subVec2(&cj, &ci);
+            float mag = getMag(&cd);
+            contact->normal = mag > GJK_TOLERANCE ? multVec2(&cd, 1.0 / mag) : constrVec(0.0, 1.0);
+            contact->depth = 0;
+            pointA = ci;
+            pointB = cj;
+        }
+        contact->depth += rA + rB;
+    }
+
+    // Surface points: push each core point out along the normal by its body's radius.
+    pointA.x += contact->normal.x * rA;
+    pointA.y += contact->normal.y * rA;
+    pointB.x -= contact->normal.x * rB;
+    pointB.y -= contact->normal.y * rB;
+    contact->point = constrVec(0.5 * (pointA.x + pointB.x), 0.5 * (pointA.y + pointB.y));
+    return true;
+
+}
+
+// Returns true if bodies i and j overlap. This is the cheap form of computeRBContact with no EPA.
+bool isColliding(int i, int j){
+    float rSum = allBodies[i].radius + allBodies[j].radius;
+    GJKResult g;
+    runGJK(i, j, rSum, &g);
+    if (g.separated) return false;
+    if (g.overlap) return true;
+    return g.distance <= rSum;
+}
+
+// Candidate pairs for the narrow phase from a sweep along x. rbSweepOrder keeps the live bodies sorted by minPX
+// between frames, so the insertion sort only has to fix up the few bodies that passed each other.
+void buildRBCandidatePairs() {
+
+    for (int k = 1; k < numRBActive; k++) {
+        int idx = rbSweepOrder[k];
+        int m = k - 1;
+        while (m >= 0 && allBodies[rbSweepOrder[m]].minPX > allBodies[idx].minPX) {
+            rbSweepOrder[m+1] = rbSweepOrder[m];
+            m--;
+        }
+        rbSweepOrder[m+1] = idx;
+    }
+
+    numRBCandidatePairs = 0;
+    for (int k = 0; k < numRBActive; k++) {
+        int i = rbSweepOrder[k];
+        for (int m = k + 1; m < numRBActive; m++) {
+            int j = rbSweepOrder[m];
+            if (allBodies[j].minPX > allBodies[i].maxPX + SLEEP_WAKE_MARGIN) break;
+            // Sleeping pairs have not moved since they last rested against each other.
+            if (allBodies[i].isAsleep && allBodies[j].isAsleep) continue;
+            if (!rbBoundsTouch(i, j)) continue;
+            if (numRBCandidatePairs >= MAX_RB_CANDIDATE_PAIRS) {
+                rbCandidatePairsDropped++;
+                continue;
+            }
+            rbCandidatePairs[numRBCandidatePairs][0] = i < j ? i : j;
+            rbCandidatePairs[numRBCandidatePairs][1] = i < j ? j : i;
+            numRBCandidatePairs++;
+        }
+    }
+
+}
+
+// Read-only half of the narrow phase. Worker w takes every NARROW_PHASE_WORKERS'th candidate pair and writes
+// the contacts it finds to its own buffer, so workers never touch shared state.
+void generateRBContacts(int w) {
+
+    rbWorkerContactCount[w] = 0;
+    for (int p = w; p < numRBCandidatePairs; p += NARROW_PHASE_WORKERS) {
+        RBContact * contact = &rbWorkerContacts[w][rbWorkerContactCount[w]];
+        if (computeRBContact(rbCandidatePairs[p][0], rbCandidatePairs[p][1], contact)) rbWorkerContactCount[w]++;
+    }
+
+}
+
+#ifdef RB_NARROW_PHASE_THREADS
+// Workers 1 and up each run in a thread of their own for the life of the program. narrowPhaseGeneration
+// goes up once per step to wake them, and the last to finish signals narrowPhaseDone. Worker 0 is the
+// caller.
+pthread_mutex_t narrowPhaseLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t narrowPhaseStart = PTHREAD_COND_INITIALIZER;
+pthread_cond_t narrowPhaseDone = PTHREAD_COND_INITIALIZER;
+pthread_t narrowPhaseThreads[NARROW_PHASE_WORKERS];
+bool narrowPhaseThreadStarted[NARROW_PHASE_WORKERS];
+bool narrowPhasePoolStarted = false;
+unsigned int narrowPhaseGeneration = 0;
+int narrowPhaseBusy = 0; // Threads still working on this generation
+
+void * narrowPhaseWorker(void * arg) {
+
+    int w = (int)(long)arg;
+    unsigned int done = 0; // The generation this worker last ran
+
+    pthread_mutex_lock(&narrowPhaseLock);
+    while (true) {
+        while (narrowPhaseGeneration == done) pthread_cond_wait(&narrowPhaseStart, &narrowPhaseLock);
+        done = narrowPhaseGeneration;
+        pthread_mutex_unlock(&narrowPhaseLock);
+        generateRBContacts(w);
+        pthread_mutex_lock(&narrowPhaseLock);
+        if (--narrowPhaseBusy == 0) pthread_cond_signal(&narrowPhaseDone);
+    }
+    return NULL;
+
+}
+
+// Runs every worker's share and returns once all of them are done. The threads are started on the first
+// call. A worker whose thread could not be started has its share run here instead.
+void runNarrowPhaseWorkers() {
+
+    if (!narrowPhasePoolStarted) {
+        for (int w = 1; w < NARROW_PHASE_WORKERS; w++) {
+            narrowPhaseThreadStarted[w] = pthread_create(&narrowPhaseThreads[w], NULL, narrowPhaseWorker, (void *)(long)w) == 0;
+        }
+        narrowPhasePoolStarted = true;
+    }
+
+    pthread_mutex_lock(&narrowPhaseLock);
+    narrowPhaseBusy = 0;
+    for (int w = 1; w < NARROW_PHASE_WORKERS; w++) narrowPhaseBusy += narrowPhaseThreadStarted[w];
+    narrowPhaseGeneration++;
+    pthread_cond_broadcast(&narrowPhaseStart);
+    pthread_mutex_unlock(&narrowPhaseLock);
+
+    generateRBContacts(0);
+    for (int w = 1; w < NARROW_PHASE_WORKERS; w++) {
+        if (!narrowPhaseThreadStarted[w]) generateRBContacts(w);
+    }
+
+    pthread_mutex_lock(&narrowPhaseLock);
+    while (narrowPhaseBusy > 0) pthread_cond_wait(&narrowPhaseDone, &narrowPhaseLock);
+    pthread_mutex_unlock(&narrowPhaseLock);
+
+}
+#endif
+
+int compareRBContacts(const void * a, const void * b) {
+    const RBContact * ca = (const RBContact *)a;
+    const RBContact * cb = (const RBContact *)b;
+    if (ca->bodyA != cb->bodyA) return ca->bodyA - cb->bodyA;
+    return ca->bodyB - cb->bodyB;
+}
+
+// Gathers the worker buffers and sorts by body pair, so the solve order does not depend on how the pairs
+// were split between workers (or on which thread finished first).
+void mergeRBContacts() {
+
+    numRBContacts = 0;
+    for (int w = 0; w < NARROW_PHASE_WORKERS; w++) {
+        for (int k = 0; k < rbWorkerContactCount[w]; k++) {
+            rbContacts[numRBContacts++] = rbWorkerContacts[w][k];
+        }
+    }
+    qsort(rbContacts, numRBContacts, sizeof(RBContact), compareRBContacts);
+
+}
+
+// Adds force f acting at r (relative to the centre) to body i's accumulators for the next step.
+void addRBForce(int i, Vector2D * r, Vector2D * f) {
+    allBodies[i].force = addVec2(&allBodies[i].force, f);
+    allBodies[i].torque += magnitudeCrossProd2D(r, f);
+}
+
+// Resolves one contact: positional correction, contact torques and the collision impulse.
+// https://www.chrishecker.com/images/e/e7/Gdmphys3.pdf for impulse physics formulas
+void resolveRBContact(RBContact * contact){
+    
+    float dy, dx;
+
+    // The contact normal points from A to B, so B plays the body being pushed out along it.
+    int minSepEdgeBodyIdx = contact->bodyA;
+    int minSepVertBodyIdx = contact->bodyB;
+    Vector2D unitNorm = contact->normal;
+    Vector2D contactPt = contact->point;
+
+    // Each pair appears once in the merged contacts, so this is always the pair's first hit this step.
+    Vector2D normedA = contactPt;
+    Vector2D normedB;
+
+    normedB = subVec2(&normedA, &allBodies[minSepVertBodyIdx].lastPointofCollision);
+    allBodies[minSepVertBodyIdx].lastPositionDelta = getMag(&normedB);
+    allBodies[minSepVertBodyIdx].lastPointofCollision = normedA;
+
+    normedB = subVec2(&normedA, &allBodies[minSepEdgeBodyIdx].lastPointofCollision);
+    allBodies[minSepEdgeBodyIdx].lastPositionDelta = getMag(&normedB);
+    allBodies[minSepEdgeBodyIdx].lastPointofCollision = normedA;
+
+    // Manual Positional Adjustment. EPA gives the depth so split it between both bodies in one go.
+    float push = 0.5 * contact->depth + RB_CONTACT_SLOP;
+    dx = unitNorm.x * push;
+    dy = unitNorm.y * push;
+
+    allBodies[minSepVertBodyIdx].cx += dx;
+    allBodies[minSepVertBodyIdx].cy += dy;
+
+    allBodies[minSepEdgeBodyIdx].cx -= dx;
+    allBodies[minSepEdgeBodyIdx].cy -= dy;
+
+    resetBodyFromCenter(minSepVertBodyIdx);
+    resetBodyFromCenter(minSepEdgeBodyIdx);
+    contactPt.x += dx;
+    contactPt.y += dy;
+
+    // Torque handling
+    float magB = allBodies[minSepEdgeBodyIdx].mass * getMag(&allBodies[minSepEdgeBodyIdx].a);
+    normedA = multVec2(&unitNorm, magB);
+    normedB = constrVec(contactPt.x - allBodies[minSepVertBodyIdx].cx, contactPt.y - allBodies[minSepVertBodyIdx].cy);
+    addRBForce(minSepVertBodyIdx, &normedB, &normedA);
+
+    float magA = allBodies[minSepVertBodyIdx].mass * getMag(&allBodies[minSepVertBodyIdx].a);
+    normedA = multVec2(&unitNorm, -magA);
+    normedB = constrVec(contactPt.x - allBodies[minSepEdgeBodyIdx].cx, contactPt.y - allBodies[minSepEdgeBodyIdx].cy);
+    addRBForce(minSepEdgeBodyIdx, &normedB, &normedA);
+
+    if(!allBodies[minSepVertBodyIdx].cLast && !allBodies[minSepEdgeBodyIdx].cLast) {
+        allBodies[minSepVertBodyIdx].v.x *= -ELASTICITY_RB;
+        allBodies[minSepVertBodyIdx].v.y *= -ELASTICITY_RB;
+        allBodies[minSepEdgeBodyIdx].v.x *= -ELASTICITY_RB;
+        allBodies[minSepEdgeBodyIdx].v.y *= -ELASTICITY_RB;
+
+        allBodies[minSepVertBodyIdx].omega *= -ELASTICITY_RB;
+        allBodies[minSepEdgeBodyIdx].omega *= -ELASTICITY_RB;
+    } else {
+        allBodies[minSepVertBodyIdx].v.x *= ELASTICITY_RB;
+        allBodies[minSepVertBodyIdx].v.y *= ELASTICITY_RB;
+        allBodies[minSepEdgeBodyIdx].v.x *= ELASTICITY_RB;
+        allBodies[minSepEdgeBodyIdx].v.y *= ELASTICITY_RB;
+
+        allBodies[minSepVertBodyIdx].omega *= ELASTICITY_RB;
+        allBodies[minSepEdgeBodyIdx].omega *= ELASTICITY_RB;
+    }
+    allBodies[minSepVertBodyIdx].cLast = true;
+    allBodies[minSepEdgeBodyIdx].cLast = true;
+    // continue;
+
+    // Collision Resolution (Impulse-Based):
+    Vector2D c1 = subVec2(&allBodies[minSepVertBodyIdx].v, &allBodies[minSepEdgeBodyIdx].v);
+    Vector2D rAP = constrVec(
+        contactPt.x - allBodies[minSepVertBodyIdx].cx,
+        contactPt.y - allBodies[minSepVertBodyIdx].cy
+    );
+    Vector2D rBP = constrVec(
+        contactPt.x - allBodies[minSepEdgeBodyIdx].cx,
+        contactPt.y - allBodies[minSepEdgeBodyIdx].cy
+    );
+    c1 = multVec2(&c1, (-1-ELASTICITY_RB));
+    float jCoeffNum = dotProd2D(&c1, &unitNorm); 
+    c1 = multVec2(&unitNorm, ((1/allBodies[minSepVertBodyIdx].mass) + (1/allBodies[minSepEdgeBodyIdx].mass)));
+    float jCoeffDenom = dotProd2D(&c1, &unitNorm);
+    jCoeffDenom += pow(dotProd2D(&rAP, &unitNorm),2)/allBodies[minSepVertBodyIdx].I;
+    jCoeffDenom += pow(dotProd2D(&rBP, &unitNorm),2)/allBodies[minSepEdgeBodyIdx].I;
+
+    float jCoeff = jCoeffNum/jCoeffDenom;
+
+    // Linear Velocity response
+    c1 = multVec2(&unitNorm, (jCoeff/allBodies[minSepVertBodyIdx].mass));
+    allBodies[minSepVertBodyIdx].v = addVec2(&allBodies[minSepVertBodyIdx].v, &c1);
+    // allBodies[minSepVertBodyIdx].v = c1;
+    c1 = multVec2(&unitNorm, (jCoeff/allBodies[minSepEdgeBodyIdx].mass));
+    allBodies[minSepEdgeBodyIdx].v = subVec2(&allBodies[minSepEdgeBodyIdx].v, &c1);
+    // allBodies[minSepEdgeBodyIdx].v = multVec2(&c1, -1.0);
+    
+    // Angular Velocity response
+    c1 = multVec2(&unitNorm, jCoeff);
+    allBodies[minSepVertBodyIdx].omega += dotProd2D(&rAP, &c1)/allBodies[minSepVertBodyIdx].I;
+    allBodies[minSepEdgeBodyIdx].omega -= dotProd2D(&rBP, &c1)/allBodies[minSepEdgeBodyIdx].I;
+
+}
+
+// Rigid body narrow phase. Contacts are generated from one snapshot of the bodies (in parallel when
+// RB_NARROW_PHASE_THREADS is defined), merged in a fixed order, and only then solved one at a time.
+void narrowPhaseRB() {
+
+    buildRBCandidatePairs();
+
+#ifdef RB_NARROW_PHASE_THREADS
+    runNarrowPhaseWorkers();
+#else
+    for (int w = 0; w < NARROW_PHASE_WORKERS; w++) generateRBContacts(w);
+#endif
+
+    mergeRBContacts();
+
+    bool hadContact [MAX_BODIES];
+    for (int a = 0; a < numRBActive; a++) hadContact[rbActive[a]] = false;
+
+    for (int k = 0; k < numRBContacts; k++) {
+        int i = rbContacts[k].bodyA;
+        int j = rbContacts[k].bodyB;
+        wakeRBIsland(i);
+        wakeRBIsland(j);
+        recordRBContact(i, j);
+        resolveRBContact(&rbContacts[k]);
+        hadContact[i] = true;
+        hadContact[j] = true;
+    }
+
+    for (int a = 0; a < numRBActive; a++) {
+        int i = rbActive[a];
+        if (!hadContact[i] && !allBodies[i].isAsleep) allBodies[i].cLast = false;
+    }
+
+}
+
+// Builds a body of the given shape around (centX, centY) in a free pool slot and makes it active.
+// avgStepParam sets the size (half width of a quad, radius of a circle). Returns -1 if the pool is full.
+int spawnRigidBody(int shape, int numVerts, int centX, int centY, int avgStepParam) {
+
+    int i = allocRigidBody();
+    if (i < 0) return -1;
+
+    allBodies[i].colour = RB_COLOUR;
+
+    int signX = -1;
+    int signY = -1;
+    bool changeFlag = false;
+
+    float sumX = 0;
+    float sumY = 0;
+
+    float runningAreaCount = 0;
+
+    allBodies[i].v.x = 0;
+    allBodies[i].v.y = rand() % VERT_VARIANCE - (VERT_VARIANCE >> 1);
+    allBodies[i].theta = 0;
+    allBodies[i].omega = 0;
+    wakeBody(i);
+
+    allBodies[i].lastPointofCollision = constrVec(0.0, 0.0);
+
+    allBodies[i].shape = shape;
+    allBodies[i].numVerts = numVerts;
+    allBodies[i].radius = 0;
+    if (shape == RB_SHAPE_CIRCLE) allBodies[i].radius = M_PER_PX_RB * avgStepParam;
+    if (shape == RB_SHAPE_CAPSULE) allBodies[i].radius = M_PER_PX_RB * (avgStepParam >> 1);
+
+    for (int j = 0; j < allBodies[i].numVerts; j++) {
+
+        // srand(i+j);
+        if (allBodies[i].shape == RB_SHAPE_CIRCLE) {
+            allBodies[i].xs[j] = centX;
+            allBodies[i].ys[j] = centY;
+        } else if (allBodies[i].shape == RB_SHAPE_CAPSULE) {
+            allBodies[i].xs[j] = centX + (j ? avgStepParam : -avgStepParam);
+            allBodies[i].ys[j] = centY;
+        } else if (allBodies[i].numVerts != QUAD_VERTICIES) {
+            float vertTheta = 2.0 * M_PI * j / allBodies[i].numVerts;
+            allBodies[i].xs[j] = centX + (int)(1.3 * avgStepParam * cos(vertTheta));
+            allBodies[i].ys[j] = centY + (int)(1.3 * avgStepParam * sin(vertTheta));
+        } else {
+            allBodies[i].xs[j] = centX + signX*avgStepParam + rand() % VERT_VARIANCE - (VERT_VARIANCE >> 1);
+            allBodies[i].ys[j] = centY + signY*avgStepParam + rand() % VERT_VARIANCE - (VERT_VARIANCE >> 1);
+        }
+
+        allBodies[i].pxs[j] = M_PER_PX_RB * allBodies[i].xs[j];
+        allBodies[i].pys[j] = M_PER_PX_RB * allBodies[i].ys[j];
+
+        sumX += allBodies[i].pxs[j];
+        sumY += allBodies[i].pys[j];
+
+        // printf("\nsX:%d", signX);
+        // printf("\nsY:%d\n\n", signY);
+
+        if(signX == -1) {
+            signX = 1;
+        } else {
+            if(changeFlag) {
+                signX = -1;
+                changeFlag = false;
+            }
+            changeFlag = true;
+            signY = 1;
+        }
+
+        if(j!=0) runningAreaCount += (allBodies[i].pxs[j-1] + allBodies[i].pxs[j]) * (allBodies[i].pys[j-1] - allBodies[i].pys[j]) / 2.0;
+
+    }
+
+    int lastVert = allBodies[i].numVerts - 1;
+    runningAreaCount += (allBodies[i].pxs[lastVert] + allBodies[i].pxs[0]) * (allBodies[i].pys[lastVert] - allBodies[i].pys[0]) / 2.0;
+    runningAreaCount = fabsf(runningAreaCount);
+
+    // Rounded bodies also get a strip of width radius along every core edge and a full disc at the corners.
+    float perimeter = 0;
+    for (int j = 0; j < allBodies[i].numVerts; j++) {
+        int nextIdx = (j+1) % allBodies[i].numVerts;
+        float ex = allBodies[i].pxs[nextIdx] - allBodies[i].pxs[j];
+        float ey = allBodies[i].pys[nextIdx] - allBodies[i].pys[j];
+        perimeter += sqrt(ex*ex + ey*ey);
+    }
+    runningAreaCount += perimeter * allBodies[i].radius + M_PI * allBodies[i].radius * allBodies[i].radius;
+
+    allBodies[i].cx = sumX / (float)allBodies[i].numVerts;
+    allBodies[i].cy = sumY / (float)allBodies[i].numVerts;
+
+    float maxX = -1;
+    float maxY = -1;
+    float minX = M_PER_PX_RB * domain.width;
+    float minY = M_PER_PX_RB * domain.height;
+
+    for (int j = 0; j < allBodies[i].numVerts; j++) {
+
+        maxX = allBodies[i].pxs[j] > maxX ? allBodies[i].pxs[j] : maxX;
+        maxY = allBodies[i].pys[j] > maxY ? allBodies[i].pys[j] : maxY;
+        minX = allBodies[i].pxs[j] < minX ? allBodies[i].pxs[j] : minX;
+        minY = allBodies[i].pys[j] < minY ? allBodies[i].pys[j] : minY;
+
+        float dx = allBodies[i].pxs[j] - allBodies[i].cx;
+        float dy = allBodies[i].pys[j] - allBodies[i].cy;
+
+        allBodies[i].vDistances[j] = sqrt(dx*dx+dy*dy);
+        allBodies[i].constThetas[j] = atan2(dy, dx);
+
+    }
+
+    maxX += allBodies[i].radius;
+    maxY += allBodies[i].radius;
+    minX -= allBodies[i].radius;
+    minY -= allBodies[i].radius;
+
+    allBodies[i].maxPX = maxX * PX_PER_M_RB;
+    allBodies[i].maxPY = maxY * PX_PER_M_RB;
+    allBodies[i].minPX = minX * PX_PER_M_RB;
+    allBodies[i].minPY = minY * PX_PER_M_RB;
+
+    allBodies[i].mass = BODY_DENSITY * runningAreaCount;
+    allBodies[i].I = allBodies[i].mass * (pow(maxX-minX, 2) + pow(maxY-minY, 2)) / 12.0;
+
+    return i;
+
+}
+
+void initRigidBodies() {
+
+    resetRBPool();
+
+    float x = (float)NUM_BODIES*(float)domain.height/(float)domain.width;
+    int amtRows = ceil(sqrt(ceil(x)));
+    int amtColumns = ceil((double)amtRows*(double)domain.width/(double)domain.height);
+
+    int stepX = domain.width/amtColumns;
+    int stepY = domain.height/amtRows;
+
+    int avgStepParam =  (stepX + stepY) >> 3;
+
+    int initX = stepX/2;
+    int initY = stepY/2;
+
+    int xStepCount = 0;
+    int yStepCount = 0;
+
+    for (int i = 0; i < NUM_BODIES; i++) {
+
+        if(xStepCount >= amtColumns) {
+            xStepCount = 0;
+            yStepCount++;
+        }
+        if(yStepCount >= amtRows) {
+            yStepCount = 0;
+        }
+
+        int centX = initX + xStepCount * stepX;
+        int centY = initY + yStepCount * stepY;
+
+        // Mostly jittered quads, with a pentagon / hexagon, a circle and a capsule in every six bodies.
+        int shape = RB_SHAPE_POLYGON;
+        int numVerts = QUAD_VERTICIES;
+        if (i % 6 == 2) {
+            numVerts = 5 + (i / 6) % 2;
+        } else if (i % 6 == 4) {
+            shape = RB_SHAPE_CIRCLE;
+            numVerts = 1;
+        } else if (i % 6 == 5) {
+            shape = RB_SHAPE_CAPSULE;
+            numVerts = 2;
+        }
+        spawnRigidBody(shape, numVerts, centX, centY, avgStepParam);
+
+        xStepCount++;
+
+    }
+    updateCollisionMap();
+    binBodiesToGrid();
+
+}
+
+// Midpoint circle around (cx, cy), keeping only the points on the far side of (ax, ay) from the centre.
+// An axis of (0, 0) draws the whole circle, which is how capsule caps and circles share it.
+void drawRBArc(int cx, int cy, int r, int ax, int ay, short int colour) {
+
+    int x = r;
+    int y = 0;
+    int error = 1 - r;
+
+    while (x >= y) {
+        int octX[8] = {x, y, -y, -x, -x, -y, y, x};
+        int octY[8] = {y, x, x, y, -y, -x, -x, -y};
+        for (int k = 0; k < 8; k++) {
+            if (octX[k]*ax + octY[k]*ay > 0) continue;
+            drawIndividualPixel(cx + octX[k], cy + octY[k], colour);
+        }
+        y++;
+        if (error < 0) {
+            error += 2*y + 1;
+        } else {
+            x--;
+            error += 2*(y - x) + 1;
+        }
+    }
+
+}
+
+// Pixel offset from a capsule's core segment to its sides.
+void capsuleSideOffset(int * xs, int * ys, int r, int * ox, int * oy) {
+    float ex = xs[1] - xs[0];
+    float ey = ys[1] - ys[0];
+    float len = sqrt(ex*ex + ey*ey);
+    *ox = len > 0 ? -ey * r / len : 0;
+    *oy = len > 0 ? ex * r / len : r;
+}
+
+// Outline bounds of body i as drawn now. The arcs can land a pixel past the rounded bounds.
+Rect rbOutlineBounds(int i) {
+    Rect r = {allBodies[i].minPX - 1, allBodies[i].minPY - 1, allBodies[i].maxPX + 1, allBodies[i].maxPY + 1};
+    return r;
+}
+
+RenderCommand * queueBodyCommand(int i, int type, Rect * bounds) {
+    return queueRenderCommand(type, RENDER_LAYER_BODIES, allBodies[i].colour, bounds->x0, bounds->y0, bounds->x1, bounds->y1);
+}
+
+// Queues body i for the renderer: its outline, and first its interior if filled. The filled shape is
+// drawn under the same outline, so the edge is the same either way.
+void queueBodyCommands(int i, bool filled) {
+
+    int * xs = allBodies[i].xs;
+    int * ys = allBodies[i].ys;
+    int n = allBodies[i].numVerts;
+    int r = PX_PER_M_RB * allBodies[i].radius;
+    Rect bounds = rbOutlineBounds(i);
+    RenderCommand * c;
+
+    int verts = queueRenderVerts(xs, ys, n);
+
+    // Polygon
+    if (r == 0) {
+        if (filled && (c = queueBodyCommand(i, RC_POLYGON_FILL, &bounds))) {
+            c->arg[0] = verts;
+            c->arg[1] = n;
+        }
+        if ((c = queueBodyCommand(i, RC_POLYLINE, &bounds))) {
+            c->arg[0] = verts;
+            c->arg[1] = n;
+            c->arg[2] = true;
+        }
+        return;
+    }
+
+    // Circle
+    if (n == 1) {
+        if (filled && (c = queueBodyCommand(i, RC_DISC, &bounds))) {
+            c->arg[0] = verts;
+            c->arg[1] = r;
+        }
+        if ((c = queueBodyCommand(i, RC_ARC, &bounds))) {
+            c->arg[0] = verts;
+            c->arg[1] = r;
+            c->arg[2] = 0;
+            c->arg[3] = 0;
+        }
+        return;
+    }
+
+    // Capsule: the core segment pushed out both ways by the radius, capped by half circles.
+    int ox, oy;
+    capsuleSideOffset(xs, ys, r, &ox, &oy);
+    int sideXs[4] = {xs[0] + ox, xs[1] + ox, xs[1] - ox, xs[0] - ox};
+    int sideYs[4] = {ys[0] + oy, ys[1] + oy, ys[1] - oy, ys[0] - oy};
+    int sides = queueRenderVerts(sideXs, sideYs, 4);
+
+    if (filled) {
+        if ((c = queueBodyCommand(i, RC_POLYGON_FILL, &bounds))) {
+            c->arg[0] = sides;
+            c->arg[1] = 4;
+        }
+        for (int k = 0; k < 2; k++) {
+            if (!(c = queueBodyCommand(i, RC_DISC, &bounds))) break;
+            c->arg[0] = (verts + k) % RENDER_VERTEX_RING;
+            c->arg[1] = r;
+        }
+    }
+    for (int k = 0; k < 2; k++) {
+        if (!(c = queueBodyCommand(i, RC_POLYLINE, &bounds))) break;
+        c->arg[0] = (sides + 2*k) % RENDER_VERTEX_RING; // Verticies 0-1 and 2-3 are the two sides
+        c->arg[1] = 2;
+        c->arg[2] = false;
+    }
+    for (int k = 0; k < 2; k++) {
+        if (!(c = queueBodyCommand(i, RC_ARC, &bounds))) break;
+        c->arg[0] = (verts + k) % RENDER_VERTEX_RING;
+        c->arg[1] = r;
+        c->arg[2] = k == 0 ? xs[1] - xs[0] : xs[0] - xs[1];
+        c->arg[3] = k == 0 ? ys[1] - ys[0] : ys[0] - ys[1];
+    }
+
+}
+
+void updateRBMinsAndMaxes(int i){
+
+    int cMaxX = INT_MIN_C;
     int cMaxY = INT_MIN_C;
     int cMinX = INT_MAX_C;
     int cMinY = INT_MAX_C;
-    for (int vertIdx = 0; vertIdx < VERTICIES_PER_BODY; vertIdx++) {
+    for (int vertIdx = 0; vertIdx < allBodies[i].numVerts; vertIdx++) {
         if (allBodies[i].xs[vertIdx] > cMaxX) cMaxX = allBodies[i].xs[vertIdx];
         if (allBodies[i].xs[vertIdx] < cMinX) cMinX = allBodies[i].xs[vertIdx];
         if (allBodies[i].ys[vertIdx] > cMaxY) cMaxY = allBodies[i].ys[vertIdx];
         if (allBodies[i].ys[vertIdx] < cMinY) cMinY = allBodies[i].ys[vertIdx];
     }
-    allBodies[i].maxPX = cMaxX;
-    allBodies[i].minPX = cMinX;
-    allBodies[i].maxPY = cMaxY;
-    allBodies[i].minPY = cMinY;
+    int r = ceil(PX_PER_M_RB * allBodies[i].radius);
+    allBodies[i].maxPX = cMaxX + r;
+    allBodies[i].minPX = cMinX - r;
+    allBodies[i].maxPY = cMaxY + r;
+    allBodies[i].minPY = cMinY - r;
     // if (i == 0) {
     //     printf("maxX:%d\n", cMaxX);
     //     printf("minX:%d\n", cMinX);
@@ -1728,11 +3693,82 @@ void updateRBMinsAndMaxes(int i){
 
 }
 
+void placeBodyAlongMotion(int i, float pcx, float pcy, float pt, float dcx, float dcy, float dTheta, float t) {
+    allBodies[i].cx = pcx + dcx * t;
+    allBodies[i].cy = pcy + dcy * t;
+    allBodies[i].theta = pt + dTheta * t;
+    resetBodyFromCenter(i);
+}
+
+// Conservative advancement for fast bodies. If body i moved further than CCD_MOTION_FRACTION of its extent
+// since (pcx, pcy, pt), walk it along that motion in sub-steps against the bodies its swept bounds touch.
+// At the first sub-step that overlaps, bisect back towards the time of impact and leave the body there,
+// just touching, so the next narrow phase pass resolves the hit instead of the body tunnelling through.
+void sweepBodyMotion(int i, float pcx, float pcy, float pt) {
+
+    float dcx = allBodies[i].cx - pcx;
+    float dcy = allBodies[i].cy - pcy;
+    float dTheta = allBodies[i].theta - pt;
+
+    float maxR = 0;
+    for (int k = 0; k < allBodies[i].numVerts; k++) maxR = floatMax(maxR, allBodies[i].vDistances[k] + allBodies[i].radius);
+
+    float motion = sqrt(dcx*dcx + dcy*dcy) + floatAbs(dTheta) * maxR;
+    float extent = 0.5 * floatMin(allBodies[i].maxPX - allBodies[i].minPX, allBodies[i].maxPY - allBodies[i].minPY);
+    if (extent < 1.0) extent = 1.0;
+    if (motion <= CCD_MOTION_FRACTION * extent) return;
+
+    int numSubsteps = ceil(motion / (CCD_MOTION_FRACTION * extent));
+    if (numSubsteps > CCD_MAX_SUBSTEPS) numSubsteps = CCD_MAX_SUBSTEPS;
+
+    // Bounds swept over the whole step (start bounds grown by the motion).
+    float reach = floatAbs(dTheta) * maxR;
+    float sweepMinX = allBodies[i].minPX + floatMin(dcx, 0) - reach;
+    float sweepMaxX = allBodies[i].maxPX + floatMax(dcx, 0) + reach;
+    float sweepMinY = allBodies[i].minPY + floatMin(dcy, 0) - reach;
+    float sweepMaxY = allBodies[i].maxPY + floatMax(dcy, 0) + reach;
+
+    int candidates[MAX_BODIES];
+    int numCandidates = 0;
+    for (int a = 0; a < numRBActive; a++) {
+        int j = rbActive[a];
+        if (j == i) continue;
+        if (sweepMaxX < allBodies[j].minPX || sweepMinX > allBodies[j].maxPX ||
+            sweepMaxY < allBodies[j].minPY || sweepMinY > allBodies[j].maxPY) continue;
+        candidates[numCandidates++] = j;
+    }
+    if (numCandidates == 0) return;
+
+    for (int s = 1; s <= numSubsteps; s++) {
+        float t = (float)s / (float)numSubsteps;
+        placeBodyAlongMotion(i, pcx, pcy, pt, dcx, dcy, dTheta, t);
+        for (int c = 0; c < numCandidates; c++) {
+            int j = candidates[c];
+            if (!isColliding(i, j)) continue;
+
+            float tFree = (float)(s-1) / (float)numSubsteps;
+            float tHit = t;
+            for (int k = 0; k < CCD_TOI_ITERATIONS; k++) {
+                float tMid = 0.5 * (tFree + tHit);
+                placeBodyAlongMotion(i, pcx, pcy, pt, dcx, dcy, dTheta, tMid);
+                if (isColliding(i, j)) tHit = tMid;
+                else tFree = tMid;
+            }
+            placeBodyAlongMotion(i, pcx, pcy, pt, dcx, dcy, dTheta, tHit);
+            wakeRBIsland(j);
+            return;
+        }
+    }
+
+}
+
 void stepBodyPositions(int i) {
 
     // Must also update positions of all verticies
 
     float pt = allBodies[i].theta;
+    float pcx = allBodies[i].cx;
+    float pcy = allBodies[i].cy;
     if(allBodies[i].cLast){
         allBodies[i].omega *= ELASTICITY_RB * EPSILON_RB;
         allBodies[i].omega *= ELASTICITY_RB * EPSILON_RB;
@@ -1753,11 +3789,8 @@ void stepBodyPositions(int i) {
     } else if (!goStep) {
 
         //Kill everything.
-        for(int k = 0; k < NUM_BODIES; k++){
-            allBodies[i].extForces[k].force.x = 0;
-            allBodies[i].extForces[k].force.y = 0;
-            allBodies[i].extForces[k].isActive = false;
-        }
+        allBodies[i].force = constrVec(0.0, 0.0);
+        allBodies[i].torque = 0;
         allBodies[i].alpha = 0;
         // allBodies[i].v.x *= ELASTICITY_RB;
         // allBodies[i].v.y *= ELASTICITY_RB;
@@ -1775,16 +3808,15 @@ void stepBodyPositions(int i) {
     //     allBodies[i].v.x = 0.0;
     //     allBodies[i].v.y = 0.0;
     // }
+    if (i!=currentMouseInteractionObj) sweepBodyMotion(i, pcx, pcy, pt);
     
     // Revert last position application if any vert out of bounds.
     bool mustAdjust = false;
 
     float ndx, ndy, nt;
+    int r = ceil(PX_PER_M_RB * allBodies[i].radius);
 
-    for (int j = 0; j < VERTICIES_PER_BODY; j++) {    
-
-        // eraseRBs[i].xs[j] = allBodies[i].xs[j];
-        // eraseRBs[i].ys[j] = allBodies[i].ys[j];
+    for (int j = 0; j < allBodies[i].numVerts; j++) {    
 
         nt = allBodies[i].constThetas[j] + allBodies[i].theta;
         ndx = allBodies[i].vDistances[j] * cos(nt);
@@ -1797,18 +3829,18 @@ void stepBodyPositions(int i) {
         allBodies[i].ys[j] = PX_PER_M_RB * allBodies[i].pys[j];
         
         // Logic for necessary aadjustment if any
-        if (allBodies[i].xs[j] < 0 ){
-            allBodies[i].cx += 0 - M_PER_PX_RB * allBodies[i].xs[j];
+        if (allBodies[i].xs[j] - r < 0 ){
+            allBodies[i].cx += M_PER_PX_RB * (r - allBodies[i].xs[j]);
             mustAdjust = true;
-        } else if (allBodies[i].xs[j] > (MAX_X-1)){
-            allBodies[i].cx -=  M_PER_PX_RB * (allBodies[i].xs[j] - MAX_X + 1);
+        } else if (allBodies[i].xs[j] + r > (domain.width-1)){
+            allBodies[i].cx -=  M_PER_PX_RB * (allBodies[i].xs[j] + r - domain.width + 1);
             mustAdjust = true;
         }
-        if (allBodies[i].ys[j] < 0 ){
-            allBodies[i].cy += 0 - M_PER_PX_RB * allBodies[i].ys[j];
+        if (allBodies[i].ys[j] - r < 0 ){
+            allBodies[i].cy += M_PER_PX_RB * (r - allBodies[i].ys[j]);
             mustAdjust = true;
-        } else if (allBodies[i].ys[j] > (MAX_Y-1)){
-            allBodies[i].cy -= M_PER_PX_RB * (allBodies[i].ys[j] - MAX_Y + 1);
+        } else if (allBodies[i].ys[j] + r > (domain.height-1)){
+            allBodies[i].cy -= M_PER_PX_RB * (allBodies[i].ys[j] + r - domain.height + 1);
             mustAdjust = true;
         }
 
@@ -1831,41 +3863,51 @@ void stepBodyVelocities(int i) {
 void checkCollisions(int i) {
 
     int collisionCount = 0;
-    checkSATInterBodyCollision(i);
+
+    // Rounded bodies touch the walls a radius out from their verticies.
+    int r = ceil(PX_PER_M_RB * allBodies[i].radius);
+
+    // Wall forces only reach the accumulators if the body is not resting flat on the floor.
+    Vector2D wallForce = constrVec(0.0, 0.0);
+    float wallTorque = 0;
     
-    for (int j = 0; j < VERTICIES_PER_BODY; j++) {
+    for (int j = 0; j < allBodies[i].numVerts; j++) {
 
         bool setActive = false;
+        Vector2D vertForce = constrVec(0.0, 0.0);
+        float wallOffsetX = 0;
+        float wallOffsetY = 0;
 
         // Container collision handling
-        if(allBodies[i].xs[j] >= (MAX_X-1) || allBodies[i].xs[j] <= 0) {
+        if(allBodies[i].xs[j] + r >= (domain.width-1) || allBodies[i].xs[j] - r <= 0) {
             
-            if((allBodies[i].v.x > 0) == (allBodies[i].xs[j] > 0)) {
+            bool rightWall = allBodies[i].xs[j] + r >= (domain.width-1);
+            if((allBodies[i].v.x > 0) == rightWall) {
                 allBodies[i].v.x = -allBodies[i].v.x * ELASTICITY_RB;
             }
 
-            allBodies[i].extForces[j].force.x = -allBodies[i].mass * allBodies[i].a.x;
+            vertForce.x = -allBodies[i].mass * allBodies[i].a.x;
+            wallOffsetX = rightWall ? allBodies[i].radius : -allBodies[i].radius;
             setActive = true;
 
         }
-        if(allBodies[i].ys[j] >= (MAX_Y-1) || allBodies[i].ys[j] <= 0) {
+        if(allBodies[i].ys[j] + r >= (domain.height-1) || allBodies[i].ys[j] - r <= 0) {
 
-            if((allBodies[i].v.y > 0) == (allBodies[i].ys[j] >= (MAX_Y-1))) {
+            bool hitFloor = allBodies[i].ys[j] + r >= (domain.height-1);
+            if((allBodies[i].v.y > 0) == hitFloor) {
                 allBodies[i].v.y = -allBodies[i].v.y * ELASTICITY_RB;
             }
-            allBodies[i].extForces[j].force.y = -allBodies[i].mass * allBodies[i].a.y;
-            if(allBodies[i].ys[j] >= (MAX_Y-1)) collisionCount++;;
+            vertForce.y = -allBodies[i].mass * allBodies[i].a.y;
+            wallOffsetY = hitFloor ? allBodies[i].radius : -allBodies[i].radius;
+            if(hitFloor) collisionCount++;;
             setActive = true;
             
 
         }
 
         if (collisionCount > 1) {
-            for(int k = 0; k <= j; k++){
-                allBodies[i].extForces[k].force.x = 0;
-                allBodies[i].extForces[k].force.y = 0;
-                allBodies[i].extForces[k].isActive = false;
-            }
+            wallForce = constrVec(0.0, 0.0);
+            wallTorque = 0;
             allBodies[i].alpha = 0;
             allBodies[i].v.x = 0;
             allBodies[i].v.y = 0;
@@ -1877,39 +3919,69 @@ void checkCollisions(int i) {
         if (setActive) {
             //if((allBodies[i].omega > 0) == (allBodies[i].alpha > 0)) allBodies[i].omega = -allBodies[i].omega * ELASTICITY_RB;
             allBodies[i].omega *= ELASTICITY_RB * (0.001);
-            allBodies[i].extForces[j].r.x = allBodies[i].pxs[j] - allBodies[i].cx;
-            allBodies[i].extForces[j].r.y = allBodies[i].pys[j] - allBodies[i].cy;
-        } else {
-            allBodies[i].extForces[j].force.x = 0;
-            allBodies[i].extForces[j].force.y = 0;
+            Vector2D rVec = constrVec(allBodies[i].pxs[j] + wallOffsetX - allBodies[i].cx, allBodies[i].pys[j] + wallOffsetY - allBodies[i].cy);
+            wallForce = addVec2(&wallForce, &vertForce);
+            wallTorque += magnitudeCrossProd2D(&rVec, &vertForce);
         }
-        allBodies[i].extForces[j].isActive = setActive;
 
     }
 
+    if (collisionCount <= 1) {
+        allBodies[i].force = addVec2(&allBodies[i].force, &wallForce);
+        allBodies[i].torque += wallTorque;
+    }
+
 }
 
-void checkMouseLocation(int i) {
+// Picks the body under the cursor when the left button goes down on one, and lets go when it is released.
+void checkMouseLocation() {
 
     if (!mData.left) {
         currentMouseInteractionObj = -1;
         return;
     }
-    if((allBodies[i].minPX <= mData.x) && (mData.x <= allBodies[i].maxPX) && (allBodies[i].minPY <= mData.y) && (mData.y <= allBodies[i].maxPY)) {
-        if(currentMouseInteractionObj == -1) currentMouseInteractionObj = i;   
+    if (currentMouseInteractionObj != -1) return;
+
+    int hit = queryBodyAtPoint(mData.x, mData.y);
+    if (hit != RB_MAP_EMPTY) {
+        currentMouseInteractionObj = hit;
+        wakeRBIsland(hit);
+    }
+
+}
+
+// Right click on a body despawns it. Right click anywhere else spawns a random body there.
+void handleRBSpawnClicks() {
+
+    bool click = mData.right && !lastRightClick;
+    lastRightClick = mData.right;
+    if (!click) return;
+
+    int hit = queryBodyAtPoint(mData.x, mData.y);
+    if (hit != RB_MAP_EMPTY) {
+        despawnRigidBody(hit);
+        return;
     }
 
+    int margin = RB_SPAWN_SIZE + VERT_VARIANCE;
+    int centX = mData.x < margin ? margin : (mData.x > domain.width - 1 - margin ? domain.width - 1 - margin : mData.x);
+    int centY = mData.y < margin ? margin : (mData.y > domain.height - 1 - margin ? domain.height - 1 - margin : mData.y);
+    int shape = rand() % 3;
+    int numVerts = shape == RB_SHAPE_CIRCLE ? 1 : (shape == RB_SHAPE_CAPSULE ? 2 : QUAD_VERTICIES + rand() % 3);
+    spawnRigidBody(shape, numVerts, centX, centY, RB_SPAWN_SIZE);
+
 }
 
 void timeStepRBForceApplication() {
 
+    hudBeginPhase(HUD_PHASE_FORCES);
+    handleRBSpawnClicks();
+
     // model collisions with normal forces.
-    for (int i = 0; i < NUM_BODIES; i++) {   
-        for (int j = 0; j < VERTICIES_PER_BODY; j++) {
-            eraseRBs[i].xs[j] = allBodies[i].xs[j];
-            eraseRBs[i].ys[j] = allBodies[i].ys[j];
-            bookMarkedCollisions[i][j] = false;
-        }
+    for (int a = 0; a < numRBActive; a++) {   
+        int i = rbActive[a];
+        allBodies[i].lastC = constrVec(allBodies[i].cx, allBodies[i].cy);
+        allBodies[i].lastTheta = allBodies[i].theta;
 
         if (i==currentMouseInteractionObj) {
             allBodies[i].cx = mData.x;
@@ -1919,78 +3991,2172 @@ void timeStepRBForceApplication() {
             allBodies[i].v.y = M_PER_PX_RB * (float)mData.vy;
         }
     }
-    for (int i = 0; i < NUM_BODIES; i++) {   
+
+    checkMouseLocation();
+
+    for (int a = 0; a < numRBActive; a++) {   
+        int i = rbActive[a];
+
+        // Sleeping bodies cost nothing until a contact, the mouse or a reset wakes them.
+        if (allBodies[i].isAsleep) continue;
 
         if (i != currentMouseInteractionObj) {
 
             allBodies[i].a.x = 0;
             allBodies[i].a.y = G_RB;
             
-            float torque = 0;
-            for (int j = 0; j < MAX_EXTERNAL_FORCES; j++) {
-                if (!allBodies[i].extForces[j].isActive) continue;
-                allBodies[i].extForces[j].isActive = false;
-                // allBodies[i].a.x += allBodies[i].extForces[j].force.x / allBodies[i].mass;
-                // allBodies[i].a.y += allBodies[i].extForces[j].force.y / allBodies[i].mass;
-                torque += allBodies[i].extForces[j].r.x * allBodies[i].extForces[j].force.y - allBodies[i].extForces[j].r.y * allBodies[i].extForces[j].force.x;
-            }
-            
-            allBodies[i].alpha = torque / allBodies[i].I;
+            // allBodies[i].a.x += allBodies[i].force.x / allBodies[i].mass;
+            // allBodies[i].a.y += allBodies[i].force.y / allBodies[i].mass;
+            allBodies[i].alpha = allBodies[i].torque / allBodies[i].I;
             
 
         } 
+        allBodies[i].force = constrVec(0.0, 0.0);
+        allBodies[i].torque = 0;
+
+    }
+    hudEndPhase(HUD_PHASE_FORCES);
 
-        checkMouseLocation(i);
+    hudBeginPhase(HUD_PHASE_COLLISION);
+    PROFILE_BEGIN(PROFILE_RB_NARROW_PHASE);
+    narrowPhaseRB();
+    PROFILE_END(PROFILE_RB_NARROW_PHASE);
+    hudEndPhase(HUD_PHASE_COLLISION);
+
+    // Bodies resolve their contacts and move one at a time, so the two phases are timed body by body.
+    PROFILE_BEGIN(PROFILE_RB_RESOLVE);
+    for (int a = 0; a < numRBActive; a++) {   
+        int i = rbActive[a];
+
+        if (allBodies[i].isAsleep) continue;
+
+        hudBeginPhase(HUD_PHASE_COLLISION);
         checkCollisions(i);
+        if (isCoupledSim) applyFluidImpulse(i);
+        hudEndPhase(HUD_PHASE_COLLISION);
+
+        hudBeginPhase(HUD_PHASE_INTEGRATE);
         stepBodyVelocities(i);
 
         stepBodyPositions(i);
+        hudEndPhase(HUD_PHASE_INTEGRATE);
 
     }
+    PROFILE_END(PROFILE_RB_RESOLVE);
+
+    hudBeginPhase(HUD_PHASE_NEIGHBOURS);
+    updateRBIslands();
+    updateCollisionMap();
+    binBodiesToGrid();
+    hudEndPhase(HUD_PHASE_NEIGHBOURS);
 
 }
 
 // =======================================================================================================
-//                                                   MAIN
+//                                             COUPLED WORLD
 // =======================================================================================================
 
-void switchSimHandler() {
-    isFluidSim = !isFluidSim;
-    speedMult = 0;
-    resetSimHandler();
-}
+// Particles check the bodies binned into their own grid cell, or read the collision map when inside one.
+#define FLUID_BOUNDARY_PX       RB_GRID_MARGIN_PX // Particles are kept this far outside a body's surface
+#define FLUID_PARTICLE_MASS     1000.0 // Mass of one particle in body units. Sets how high bodies float.
+#define FLUID_ELASTICITY        0.1
+#define FLUID_MAX_DV            10.0 // Every particle pushes on the same body velocity, so the sum is capped
 
-void resetSimHandler() {
-    clearWholeScreen();
-    if (isFluidSim) {
-        initParticles(); 
-    }
-    else {
-        initRigidBodies();
+// Signed distance from (x, y) to the surface of body rbIdx, negative inside. normal points out of the body.
+float signedDistanceToRB(float x, float y, int rbIdx, Vector2D * normal) {
+
+    Vector2D closest;
+    float dist = closestPointOnRBCore(x, y, rbIdx, &closest);
+    bool inCore = pointIsInsideRBCore(x, y, rbIdx);
+
+    if (dist > EPSILON_RB) {
+        *normal = constrVec((x - closest.x) / dist, (y - closest.y) / dist);
+        if (inCore) *normal = multVec2(normal, -1);
+    } else {
+        // On the core itself: push away from the centre.
+        float dx = x - allBodies[rbIdx].cx;
+        float dy = y - allBodies[rbIdx].cy;
+        float mag = sqrt(dx*dx + dy*dy);
+        *normal = mag > EPSILON_RB ? constrVec(dx / mag, dy / mag) : constrVec(0.0, -1.0);
     }
-    // speedMult = 4;
-    // fastFowardHandler();
-}
+    return (inCore ? -dist : dist) - allBodies[rbIdx].radius;
 
-void fastFowardHandler(){
-    if(speedMult == 4)speedMult = 0;
-    else speedMult++;
-    SPF = speedArray[speedMult] * DEFAULT_SPF;
-    SPH_RB = speedArray[speedMult] * DEFAULT_SPH_RB;
 }
 
-int main(void){ // main for this simulation
+// Boundary handling between particle i and body b. A particle closer than the boundary margin is moved out
+// to it and loses the part of its velocity heading into the body's surface. The body gets the opposite
+// impulse, which is what floats it and lets the flow push it around.
+void pushParticleOffRB(int i, int b) {
 
-    // volatile int * sw_ptr = (volatile int *)SW_BASE;
+    float rbToSPH = SPH_RB / (SPF * PX_PER_M * M_PER_PX_RB); // Body velocity in particle units
+
+    float x = M_PER_PX_RB * PX_PER_M * allParticles[i].pX;
+    float y = M_PER_PX_RB * PX_PER_M * allParticles[i].pY;
+    Vector2D n;
+    float sd = signedDistanceToRB(x, y, b, &n);
+    if (sd >= M_PER_PX_RB * FLUID_BOUNDARY_PX) return;
+
+    float push = M_PER_PX_RB * FLUID_BOUNDARY_PX - sd;
+    x += n.x * push;
+    y += n.y * push;
+    allParticles[i].pX = floatMin(floatMax(M_PER_PX * PX_PER_M_RB * x, 0.0), M_PER_PX * (domain.width-1));
+    allParticles[i].pY = floatMin(floatMax(M_PER_PX * PX_PER_M_RB * y, 0.0), M_PER_PX * (domain.height-1));
+    allParticles[i].x = PX_PER_M * allParticles[i].pX;
+    allParticles[i].y = PX_PER_M * allParticles[i].pY;
+
+    // Velocity of the body's surface under the particle.
+    float rx = x - allBodies[b].cx;
+    float ry = y - allBodies[b].cy;
+    float svx = (allBodies[b].v.x - allBodies[b].omega * ry) * rbToSPH;
+    float svy = (allBodies[b].v.y + allBodies[b].omega * rx) * rbToSPH;
+
+    float relN = ((allParticles[i].vx - svx) * n.x + (allParticles[i].vy - svy) * n.y) / rbToSPH;
+    if (relN >= 0) return;
+
+    // Impulse along the normal, in body units, shared between the particle and the body.
+    Vector2D rVec = constrVec(rx, ry);
+    float rCrossN = magnitudeCrossProd2D(&rVec, &n);
+    float j = -(1 + FLUID_ELASTICITY) * relN /
+        (1 / FLUID_PARTICLE_MASS + 1 / allBodies[b].mass + rCrossN * rCrossN / allBodies[b].I);
+
+    allParticles[i].vx += j / FLUID_PARTICLE_MASS * n.x * rbToSPH;
+    allParticles[i].vy += j / FLUID_PARTICLE_MASS * n.y * rbToSPH;
+
+    Vector2D impulse = multVec2(&n, -j);
+    allBodies[b].fluidImpulse = addVec2(&allBodies[b].fluidImpulse, &impulse);
+    allBodies[b].fluidAngImpulse -= rCrossN * j;
+
+}
+
+// A particle inside a body is found with one read of the collision map. Otherwise only the bodies binned
+// into its grid cell can be within the boundary margin.
+void collideParticleWithBodies(int i) {
+
+    int inside = rbAtPixel(allParticles[i].x, allParticles[i].y);
+    if (inside != RB_MAP_EMPTY) {
+        pushParticleOffRB(i, inside);
+        return;
+    }
+
+    int gx = allParticles[i].x / GRID_CELL_PX;
+    int gy = allParticles[i].y / GRID_CELL_PX;
+    gx = gx < 0 ? 0 : (gx >= gridColumns ? gridColumns - 1 : gx);
+    gy = gy < 0 ? 0 : (gy >= gridRows ? gridRows - 1 : gy);
+    int cell = gy * gridColumns + gx;
+
+    for (int k = gridBodyStart[cell]; k < gridBodyStart[cell + 1]; k++) {
+        pushParticleOffRB(i, gridBodies[k]);
+    }
+
+}
+
+// Wakes sleeping bodies that took a real shove from the fluid. Smaller impulses on sleepers are dropped.
+void wakeBodiesHitByFluid() {
+
+    for (int a = 0; a < numRBActive; a++) {
+        int i = rbActive[a];
+        if (!allBodies[i].isAsleep) continue;
+        if (getMag(&allBodies[i].fluidImpulse) / allBodies[i].mass >= SLEEP_LINEAR_THRESH * SPH_RB) {
+            wakeRBIsland(i);
+            continue;
+        }
+        allBodies[i].fluidImpulse = constrVec(0.0, 0.0);
+        allBodies[i].fluidAngImpulse = 0;
+    }
+
+}
+
+// Hands the impulse gathered from the fluid to body i. Called after the walls so a body resting on the
+// floor can still be lifted.
+void applyFluidImpulse(int i) {
+
+    if (i != currentMouseInteractionObj) {
+        Vector2D dv = multVec2(&allBodies[i].fluidImpulse, 1 / allBodies[i].mass);
+        float dOmega = allBodies[i].fluidAngImpulse / allBodies[i].I;
+        float dvMag = getMag(&dv);
+        if (dvMag > FLUID_MAX_DV) {
+            dv = multVec2(&dv, FLUID_MAX_DV / dvMag);
+            dOmega *= FLUID_MAX_DV / dvMag;
+        }
+        allBodies[i].v = addVec2(&allBodies[i].v, &dv);
+        allBodies[i].omega += dOmega;
+    }
+    allBodies[i].fluidImpulse = constrVec(0.0, 0.0);
+    allBodies[i].fluidAngImpulse = 0;
+
+}
+
+void stepFluidBodyWakes() {
+    hudBeginPhase(HUD_PHASE_COLLISION);
+    wakeBodiesHitByFluid();
+    hudEndPhase(HUD_PHASE_COLLISION);
+}
+
+// One step of the combined scene. Body-body contacts still use the sweep in narrowPhaseRB.
+void timeStepCoupledWorld() {
+
+    timeStepGridParticleUpdate();
+    stepFluidBodyWakes();
+    timeStepRBForceApplication();
+
+}
+
+#ifdef COUPLED_BENCHMARK
+// Host benchmark: a box floating in NUM_PARTICLES particles. Build with
+//   gcc -O2 -DHOST_BUILD -DCOUPLED_BENCHMARK -DNUM_PARTICLES=2000 fluid_simulator.c -lm
+// Times the fluid alone, the box alone and both in one world over the same number of frames. The fluid
+// scenes start from the same state: the particles reset and left to settle, untimed, with the box
+// dropped in at the surface. A first untimed run warms up the caches, and only the steps are timed. The
+// HUD's per-phase breakdown for each scene is printed after it (to HUD_FILE if that is defined).
+//
+// The fluid needs room above it for the box to float in. It settles at about 20 px^2 a particle and
+// spreads slowly from there, so 5000 particles need a bigger domain than the board's: build with
+// -DMAX_X=640 -DMAX_Y=480 as well and run with 640x480. The surface is measured just beside the box, so
+// the particles it pushes aside don't drag it down and it follows the waves the box rides. Averaged over
+// the second half of the coupled run, the box's centre has to be no more than half its height above the
+// surface, as it is resting on top, and no more than BENCHMARK_FLOAT_MARGIN px below it, as it has sunk,
+// or the benchmark fails.
+#define BENCHMARK_FRAMES        300
+#define BENCHMARK_SETTLE_FRAMES 400
+#define BENCHMARK_BOX_DENSITY   0.5 // At BODY_DENSITY the particles can't hold the box up and it sinks
+#define BENCHMARK_FLOAT_RISE    RB_SPAWN_SIZE // Half the box's height
+#define BENCHMARK_FLOAT_MARGIN  (2 * RB_SPAWN_SIZE) // About the box's height
+#define BENCHMARK_SURFACE_SHARE 20 // The surface is where the top 1/20th of the particles start
+#define BENCHMARK_SURFACE_NEAR  (1.5 * RB_SPAWN_SIZE) // Particles this close to the box's centre are left out
+#define BENCHMARK_SURFACE_FAR   (4 * RB_SPAWN_SIZE) // And so are those this far from it
+
+#ifndef HOST_BUILD
+#error "COUPLED_BENCHMARK needs HOST_BUILD"
+#endif
+
+int benchmarkRowCounts[MAX_Y];
+
+// Row of the fluid's surface, px, over the columns near to x but not within BENCHMARK_SURFACE_NEAR of
+// it. A negative x takes in every column.
+int benchmarkSurfaceY(float x) {
+    int n = 0;
+    for (int y = 0; y < domain.height; y++) benchmarkRowCounts[y] = 0;
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        float d = fabsf(allParticles[i].x - x);
+        if (x >= 0 && (d < BENCHMARK_SURFACE_NEAR || d > BENCHMARK_SURFACE_FAR)) continue;
+        int y = allParticles[i].y < 0 ? 0 : (allParticles[i].y >= domain.height ? domain.height - 1 : allParticles[i].y);
+        benchmarkRowCounts[y]++;
+        n++;
+    }
+    int above = 0;
+    for (int y = 0; y < domain.height; y++) {
+        above += benchmarkRowCounts[y];
+        if (above > n / BENCHMARK_SURFACE_SHARE) return y;
+    }
+    return domain.height - 1;
+}
+
+// Runs one scene from a reset and returns the time per frame, ms. For the coupled scene *boxY and
+// *surfaceY are set to where the box's centre and the surface beside it were on average in the second
+// half, px.
+double benchmarkScene(bool fluid, bool box, int * boxIdx, float * boxY, float * surfaceY) {
+
+    isCoupledSim = fluid && box;
+    isFluidSim = fluid;
+    resetRBPool();
+    *boxIdx = -1;
+    if (fluid) {
+        initParticles();
+        for (int frame = 0; frame < BENCHMARK_SETTLE_FRAMES; frame++) timeStepGridParticleUpdate();
+    }
+    if (box) {
+        int y = fluid ? benchmarkSurfaceY(-1) : domain.height/3;
+        *boxIdx = spawnRigidBody(RB_SHAPE_POLYGON, QUAD_VERTICIES, domain.width/2, y, RB_SPAWN_SIZE);
+        allBodies[*boxIdx].mass *= (float) BENCHMARK_BOX_DENSITY / BODY_DENSITY;
+        allBodies[*boxIdx].I *= (float) BENCHMARK_BOX_DENSITY / BODY_DENSITY;
+    }
+    *boxY = 0;
+    *surfaceY = 0;
+
+    hudSetup();
+    long long ns = 0;
+    for (int frame = 0; frame < BENCHMARK_FRAMES; frame++) {
+        long long start = timeNanoseconds();
+        if (isCoupledSim) timeStepCoupledWorld();
+        else if (fluid) timeStepGridParticleUpdate();
+        else timeStepRBForceApplication();
+        ns += timeNanoseconds() - start;
+        if (isCoupledSim && frame >= BENCHMARK_FRAMES / 2) {
+            *boxY += allBodies[*boxIdx].cy / (BENCHMARK_FRAMES - BENCHMARK_FRAMES / 2);
+            *surfaceY += (float) benchmarkSurfaceY(allBodies[*boxIdx].cx) / (BENCHMARK_FRAMES - BENCHMARK_FRAMES / 2);
+        }
+        PROFILE_END_FRAME();
+    }
+    hudEndRun(BENCHMARK_FRAMES);
+    return ns / 1.0e6 / BENCHMARK_FRAMES;
+
+}
+
+// Returns 1 if the box didn't float.
+int runCoupledBenchmark() {
+
+    int boxIdx;
+    float boxY, surfaceY;
+    printf("%d particles, %d frames, domain %dx%d\n", NUM_PARTICLES, BENCHMARK_FRAMES, domain.width, domain.height);
+    benchmarkScene(true, true, &boxIdx, &boxY, &surfaceY);
+    double fluidMs = benchmarkScene(true, false, &boxIdx, &boxY, &surfaceY);
+    double bodyMs = benchmarkScene(false, true, &boxIdx, &boxY, &surfaceY);
+    double coupledMs = benchmarkScene(true, true, &boxIdx, &boxY, &surfaceY);
+    float sinking = boxY - surfaceY; // y grows downwards
+    bool floated = sinking >= -BENCHMARK_FLOAT_RISE && sinking <= BENCHMARK_FLOAT_MARGIN;
+
+    printf("fluid only   %8.3f ms/frame\n", fluidMs);
+    printf("box only     %8.4f ms/frame\n", bodyMs);
+    printf("coupled      %8.3f ms/frame (%.2fx the sum of the parts)\n", coupledMs, coupledMs / (fluidMs + bodyMs));
+    printf("on average box centre y %.1f px, surface y %.1f px, so %.1f px %s it: %s\n", boxY, surfaceY,
+           fabsf(sinking), sinking < 0 ? "above" : "below", floated ? "floating" : "not floating");
+    return floated ? 0 : 1;
+
+}
+#endif
+
+// =======================================================================================================
+//                                            SPATIAL QUERIES
+// =======================================================================================================
+
+// Area, point and ray queries over particles and bodies. They are answered from the structures the solvers
+// already keep: the particle grid (built at the start of each fluid step), the body lists in the same cells
+// and the collision map (both rebuilt at the end of each rigid body step). Coordinates are in px. Queries
+// that fill a buffer return how many results they wrote, at most maxResults.
+
+#define QUERY_PARTICLE_RADIUS   1.0 // Rays hit particles they pass this close to. At most GRID_CELL_PX.
+
+typedef struct QueryHit {
+
+    int index;
+    float x, y;
+    float t; // Distance along the ray
+
+} QueryHit;
+
+int bodyQueryStamp[MAX_BODIES]; // Bodies sit in many cells, so each query stamps the ones it has seen
+int bodyQueryEpoch = 0;
+
+void gridCellOfPoint(float x, float y, int * gx, int * gy) {
+    *gx = x / GRID_CELL_PX;
+    *gy = y / GRID_CELL_PX;
+    *gx = *gx < 0 ? 0 : (*gx >= gridColumns ? gridColumns - 1 : *gx);
+    *gy = *gy < 0 ? 0 : (*gy >= gridRows ? gridRows - 1 : *gy);
+}
+
+int queryParticlesInAABB(float x0, float y0, float x1, float y1, int * results, int maxResults) {
+
+    int gx0, gy0, gx1, gy1;
+    int count = 0;
+    gridCellOfPoint(x0, y0, &gx0, &gy0);
+    gridCellOfPoint(x1, y1, &gx1, &gy1);
+
+    for (int gy = gy0; gy <= gy1; gy++) {
+        for (int gx = gx0; gx <= gx1; gx++) {
+            int cell = gy * gridColumns + gx;
+            for (int k = gridParticleStart[cell]; k < gridParticleStart[cell + 1]; k++) {
+                int i = gridParticles[k];
+                float x = PX_PER_M * allParticles[i].pX;
+                float y = PX_PER_M * allParticles[i].pY;
+                if (x < x0 || x > x1 || y < y0 || y > y1) continue;
+                if (count == maxResults) return count;
+                results[count++] = i;
+            }
+        }
+    }
+    return count;
+
+}
+
+int queryParticlesInRadius(float cx, float cy, float r, int * results, int maxResults) {
+
+    int gx0, gy0, gx1, gy1;
+    int count = 0;
+    gridCellOfPoint(cx - r, cy - r, &gx0, &gy0);
+    gridCellOfPoint(cx + r, cy + r, &gx1, &gy1);
+
+    for (int gy = gy0; gy <= gy1; gy++) {
+        for (int gx = gx0; gx <= gx1; gx++) {
+            int cell = gy * gridColumns + gx;
+            for (int k = gridParticleStart[cell]; k < gridParticleStart[cell + 1]; k++) {
+                int i = gridParticles[k];
+                float dx = PX_PER_M * allParticles[i].pX - cx;
+                float dy = PX_PER_M * allParticles[i].pY - cy;
+                if (dx*dx + dy*dy >= r*r) continue;
+                if (count == maxResults) return count;
+                results[count++] = i;
+            }
+        }
+    }
+    return count;
+
+}
+
+// Bodies whose bounds overlap the box.
+int queryBodiesInAABB(float x0, float y0, float x1, float y1, int * results, int maxResults) {
+
+    int gx0, gy0, gx1, gy1;
+    int count = 0;
+    gridCellOfPoint(x0, y0, &gx0, &gy0);
+    gridCellOfPoint(x1, y1, &gx1, &gy1);
+    bodyQueryEpoch++;
+
+    for (int gy = gy0; gy <= gy1; gy++) {
+        for (int gx = gx0; gx <= gx1; gx++) {
+            int cell = gy * gridColumns + gx;
+            for (int k = gridBodyStart[cell]; k < gridBodyStart[cell + 1]; k++) {
+                int i = gridBodies[k];
+                if (bodyQueryStamp[i] == bodyQueryEpoch || rbActiveSlot[i] < 0) continue;
+                bodyQueryStamp[i] = bodyQueryEpoch;
+                if (allBodies[i].maxPX < x0 || allBodies[i].minPX > x1 || allBodies[i].maxPY < y0 || allBodies[i].minPY > y1) continue;
+                if (count == maxResults) return count;
+                results[count++] = i;
+            }
+        }
+    }
+    return count;
+
+}
+
+// Bodies whose surface comes within r of (cx, cy).
+int queryBodiesInRadius(float cx, float cy, float r, int * results, int maxResults) {
+
+    int gx0, gy0, gx1, gy1;
+    int count = 0;
+    gridCellOfPoint(cx - r, cy - r, &gx0, &gy0);
+    gridCellOfPoint(cx + r, cy + r, &gx1, &gy1);
+    bodyQueryEpoch++;
+
+    for (int gy = gy0; gy <= gy1; gy++) {
+        for (int gx = gx0; gx <= gx1; gx++) {
+            int cell = gy * gridColumns + gx;
+            for (int k = gridBodyStart[cell]; k < gridBodyStart[cell + 1]; k++) {
+                int i = gridBodies[k];
+                if (bodyQueryStamp[i] == bodyQueryEpoch || rbActiveSlot[i] < 0) continue;
+                bodyQueryStamp[i] = bodyQueryEpoch;
+                Vector2D n;
+                if (signedDistanceToRB(M_PER_PX_RB * cx, M_PER_PX_RB * cy, i, &n) > M_PER_PX_RB * r) continue;
+                if (count == maxResults) return count;
+                results[count++] = i;
+            }
+        }
+    }
+    return count;
+
+}
+
+// Body covering pixel (x, y), or RB_MAP_EMPTY.
+int queryBodyAtPoint(int x, int y) {
+    return rbAtPixel(x, y);
+}
+
+// First body along the ray from (ox, oy) in direction (dx, dy), walking the collision map half a pixel at a time.
+bool raycastBodies(float ox, float oy, float dx, float dy, float maxDist, QueryHit * hit) {
+
+    float len = sqrt(dx*dx + dy*dy);
+    if (len == 0) return false;
+    dx /= len;
+    dy /= len;
+
+    for (float t = 0; t <= maxDist; t += 0.5) {
+        float x = ox + dx * t;
+        float y = oy + dy * t;
+        int i = rbAtPixel(x + 0.5, y + 0.5);
+        if (i == RB_MAP_EMPTY) continue;
+        hit->index = i;
+        hit->x = x;
+        hit->y = y;
+        hit->t = t;
+        return true;
+    }
+    return false;
+
+}
+
+// Nearest particle the ray from (ox, oy) in direction (dx, dy) passes within QUERY_PARTICLE_RADIUS of.
+// Walks the grid cells the ray crosses in order and stops once no later cell can hold a nearer hit. A
+// particle can sit in the cell beside the ray's, so each cell's neighbours are searched with it. Off the
+// grid the walk goes on through the edge cells, since particles that drift off the domain are binned
+// there.
+bool raycastParticles(float ox, float oy, float dx, float dy, float maxDist, QueryHit * hit) {
+
+    float len = sqrt(dx*dx + dy*dy);
+    if (len == 0) return false;
+    dx /= len;
+    dy /= len;
+
+    int gx = floor(ox / GRID_CELL_PX);
+    int gy = floor(oy / GRID_CELL_PX);
+    int stepX = dx > 0 ? 1 : -1;
+    int stepY = dy > 0 ? 1 : -1;
+    float tMaxX = dx != 0 ? ((gx + (dx > 0)) * GRID_CELL_PX - ox) / dx : 1.0e38;
+    float tMaxY = dy != 0 ? ((gy + (dy > 0)) * GRID_CELL_PX - oy) / dy : 1.0e38;
+    float tDeltaX = dx != 0 ? GRID_CELL_PX / floatAbs(dx) : 1.0e38;
+    float tDeltaY = dy != 0 ? GRID_CELL_PX / floatAbs(dy) : 1.0e38;
+
+    hit->index = -1;
+    hit->t = maxDist;
+    float tEntry = 0;
+
+    while (tEntry - QUERY_PARTICLE_RADIUS <= hit->t) {
+        int cx, cy;
+        gridCellOfPoint(gx * GRID_CELL_PX, gy * GRID_CELL_PX, &cx, &cy);
+        for (int ny = cy - 1; ny <= cy + 1; ny++) {
+            if (ny < 0 || ny >= gridRows) continue;
+            for (int nx = cx - 1; nx <= cx + 1; nx++) {
+                if (nx < 0 || nx >= gridColumns) continue;
+                int cell = ny * gridColumns + nx;
+                for (int k = gridParticleStart[cell]; k < gridParticleStart[cell + 1]; k++) {
+                    int i = gridParticles[k];
+                    float px = PX_PER_M * allParticles[i].pX - ox;
+                    float py = PX_PER_M * allParticles[i].pY - oy;
+                    float t = px * dx + py * dy;
+                    if (t < 0 || t > hit->t) continue;
+                    if (floatAbs(px * dy - py * dx) > QUERY_PARTICLE_RADIUS) continue;
+                    if (t == hit->t && i >= hit->index && hit->index >= 0) continue; // Ties go to the lowest index
+                    hit->index = i;
+                    hit->x = ox + dx * t;
+                    hit->y = oy + dy * t;
+                    hit->t = t;
+                }
+            }
+        }
+
+        if (tMaxX < tMaxY) {
+            tEntry = tMaxX;
+            tMaxX += tDeltaX;
+            gx += stepX;
+        } else {
+            tEntry = tMaxY;
+            tMaxY += tDeltaY;
+            gy += stepY;
+        }
+    }
+    return hit->index >= 0;
+
+}
+
+#ifdef QUERY_TEST
+// Host check of the queries against brute force over every particle and body. Build with
+//   gcc -O2 -DHOST_BUILD -DQUERY_TEST fluid_simulator.c -lm
+// It runs the coupled scene for a while, rebins the particles so the grid matches where they are, then
+// compares QUERY_TEST_QUERIES random queries of each kind. Prints each mismatch and returns how many.
+#define QUERY_TEST_STEPS        100
+#define QUERY_TEST_QUERIES      2000
+#define QUERY_TEST_MAX_RADIUS   40
+
+#ifndef HOST_BUILD
+#error "QUERY_TEST needs HOST_BUILD"
+#endif
+
+int queryTestResults[NUM_PARTICLES];
+bool queryTestFound[NUM_PARTICLES];
+
+float queryTestCoordinate(int size) {
+    return (rand() % (size * 8)) / 8.0 - 4.0; // Sometimes a little off the domain
+}
+
+// Checks one query's results against the set brute force picked out in queryTestFound.
+int queryTestCompare(const char * name, int count, int n, int q) {
+    int bad = 0;
+    for (int k = 0; k < count; k++) {
+        int i = queryTestResults[k];
+        if (!queryTestFound[i]) bad++;
+        queryTestFound[i] = false;
+    }
+    for (int i = 0; i < n; i++) {
+        bad += queryTestFound[i];
+        queryTestFound[i] = false;
+    }
+    if (bad) printf("%s query %d: %d results differ from brute force\n", name, q, bad);
+    return bad != 0;
+}
+
+int runQueryTest() {
+
+    isFluidSim = true;
+    isCoupledSim = true;
+    initParticles();
+    initRigidBodies();
+    for (int k = 0; k < QUERY_TEST_STEPS; k++) timeStepCoupledWorld();
+    binParticlesToGrid();
+    srand(1);
+
+    int failed = 0;
+    int rayHits = 0;
+    for (int q = 0; q < QUERY_TEST_QUERIES; q++) {
+        float x0 = queryTestCoordinate(domain.width);
+        float y0 = queryTestCoordinate(domain.height);
+        float x1 = x0 + rand() % QUERY_TEST_MAX_RADIUS;
+        float y1 = y0 + rand() % QUERY_TEST_MAX_RADIUS;
+        float r = 1 + rand() % QUERY_TEST_MAX_RADIUS;
+
+        for (int i = 0; i < NUM_PARTICLES; i++) {
+            float x = PX_PER_M * allParticles[i].pX;
+            float y = PX_PER_M * allParticles[i].pY;
+            queryTestFound[i] = x >= x0 && x <= x1 && y >= y0 && y <= y1;
+        }
+        failed += queryTestCompare("particle box", queryParticlesInAABB(x0, y0, x1, y1, queryTestResults, NUM_PARTICLES), NUM_PARTICLES, q);
+
+        for (int i = 0; i < NUM_PARTICLES; i++) {
+            float dx = PX_PER_M * allParticles[i].pX - x0;
+            float dy = PX_PER_M * allParticles[i].pY - y0;
+            queryTestFound[i] = dx*dx + dy*dy < r*r;
+        }
+        failed += queryTestCompare("particle radius", queryParticlesInRadius(x0, y0, r, queryTestResults, NUM_PARTICLES), NUM_PARTICLES, q);
+
+        for (int a = 0; a < numRBActive; a++) {
+            int i = rbActive[a];
+            queryTestFound[i] = !(allBodies[i].maxPX < x0 || allBodies[i].minPX > x1 || allBodies[i].maxPY < y0 || allBodies[i].minPY > y1);
+        }
+        failed += queryTestCompare("body box", queryBodiesInAABB(x0, y0, x1, y1, queryTestResults, MAX_BODIES), MAX_BODIES, q);
+
+        for (int a = 0; a < numRBActive; a++) {
+            int i = rbActive[a];
+            Vector2D n;
+            queryTestFound[i] = signedDistanceToRB(M_PER_PX_RB * x0, M_PER_PX_RB * y0, i, &n) <= M_PER_PX_RB * r;
+        }
+        failed += queryTestCompare("body radius", queryBodiesInRadius(x0, y0, r, queryTestResults, MAX_BODIES), MAX_BODIES, q);
+
+        // Rays from inside the domain, some of them out past particles that drifted off it
+        float angle = (rand() % 3600) * 3.14159265 / 1800;
+        float ox = rand() % domain.width;
+        float oy = rand() % domain.height;
+        float maxDist = rand() % domain.width;
+        float dx = cos(angle);
+        float dy = sin(angle);
+        int nearest = -1;
+        float nearestT = maxDist;
+        for (int i = 0; i < NUM_PARTICLES; i++) {
+            float px = PX_PER_M * allParticles[i].pX - ox;
+            float py = PX_PER_M * allParticles[i].pY - oy;
+            float t = px * dx + py * dy;
+            if (t < 0 || t > nearestT || floatAbs(px * dy - py * dx) > QUERY_PARTICLE_RADIUS) continue;
+            if (t == nearestT && nearest >= 0 && i >= nearest) continue;
+            nearest = i;
+            nearestT = t;
+        }
+        QueryHit hit;
+        bool found = raycastParticles(ox, oy, dx, dy, maxDist, &hit);
+        rayHits += found;
+        if (found != (nearest >= 0) || (found && hit.index != nearest)) {
+            printf("particle ray query %d: hit %d at %.2f, brute force %d at %.2f\n", q, found ? hit.index : -1,
+                   found ? hit.t : 0, nearest, nearestT);
+            failed++;
+        }
+    }
+
+    printf("%d particles, %d bodies, %d queries of each kind (%d rays hit), %d failed\n", NUM_PARTICLES,
+           numRBActive, QUERY_TEST_QUERIES, rayHits, failed);
+    return failed;
+
+}
+#endif
+
+// =======================================================================================================
+//                                                RENDERER
+// =======================================================================================================
+
+// Only what changed is repainted. Each frame, everything that moved, changed colour, appeared or went away
+// adds its old and new bounds to a damage list. Overlapping rectangles are merged into a few regions, and
+// each region is redrawn with the pixel writes clipped to it. A settled scene writes nothing.
+//
+// Drawing goes through a command queue (see DISPLAY UTILS). When there is damage, the scene is queued as
+// commands for clears, dots, lines, discs and sprites, then sorted into layer and tile order, and each
+// region runs only the commands that touch it. The queue is emptied after every frame.
+// Bodies are drawn as outlines, or solid when RB_DRAW_FILLED is defined.
+//
+// The fluid is drawn either as one 2x2 dot per particle, or (fluidRenderMode) as a coarse density field
+// splatted from the particles and scaled up to the screen. The field costs about the same however many
+// particles there are.
+//
+// Frames alternate between two pixel buffers, so the buffer being drawn last showed the scene from two
+// frames back. Each buffer keeps its own damage list, and every change is added to both. A buffer's list
+// holds everything that changed since that buffer was last drawn, and is emptied once it is repaired.
+
+#define MAX_DAMAGE_RECTS        64
+#define DAMAGE_MERGE_SLACK      8 // Merge two rectangles if their union wastes at most this many pixels
+
+Rect damageRects[NUM_PIXEL_BUFFERS][MAX_DAMAGE_RECTS];
+int numDamageRects[NUM_PIXEL_BUFFERS];
+bool damageEverything = true; // Set by the UI handlers processInputEvents runs, read once per frame
+bool repaintAll;
+
+// What the screen shows right now.
+drawParticle drawnParticles[NUM_PARTICLES];
+short int drawnParticleColours[NUM_PARTICLES];
+DrawBody drawnRBs[MAX_BODIES];
+short int drawnRBColours[MAX_BODIES];
+Rect drawnRBBounds[MAX_BODIES];
+bool rbOnScreen[MAX_BODIES];
+mouseData drawnMouse;
+bool drawnFluid, drawnRigid;
+
+int rectArea(Rect * r) {
+    return (r->x1 - r->x0 + 1) * (r->y1 - r->y0 + 1);
+}
+
+bool rectsOverlap(Rect * a, Rect * b) {
+    return a->x0 <= b->x1 && b->x0 <= a->x1 && a->y0 <= b->y1 && b->y0 <= a->y1;
+}
+
+Rect rectUnion(Rect * a, Rect * b) {
+    Rect u = {a->x0 < b->x0 ? a->x0 : b->x0, a->y0 < b->y0 ? a->y0 : b->y0,
+              a->x1 > b->x1 ? a->x1 : b->x1, a->y1 > b->y1 ? a->y1 : b->y1};
+    return u;
+}
+
+// Next frame repaints the whole screen (mode switches and resets).
+void renderDamageAll() {
+    damageEverything = true;
+}
+
+// Adds a rectangle to buffer b's damage list.
+void addBufferDamage(int b, Rect r) {
+
+    Rect * list = damageRects[b];
+
+    // Fold in every rectangle that is cheap to merge with. Growing may make more of them cheap, so rescan.
+    bool merged = true;
+    while (merged) {
+        merged = false;
+        for (int k = 0; k < numDamageRects[b]; k++) {
+            Rect u = rectUnion(&r, &list[k]);
+            if (rectArea(&u) > rectArea(&r) + rectArea(&list[k]) + DAMAGE_MERGE_SLACK) continue;
+            r = u;
+            list[k] = list[--numDamageRects[b]];
+            merged = true;
+            break;
+        }
+    }
+
+    // Out of room: merge with whichever rectangle grows least.
+    if (numDamageRects[b] == MAX_DAMAGE_RECTS) {
+        int best = 0;
+        int bestGrowth = INT_MAX_C;
+        for (int k = 0; k < numDamageRects[b]; k++) {
+            Rect u = rectUnion(&r, &list[k]);
+            int growth = rectArea(&u) - rectArea(&list[k]);
+            if (growth < bestGrowth) {
+                bestGrowth = growth;
+                best = k;
+            }
+        }
+        Rect u = rectUnion(&r, &list[best]);
+        list[best] = list[--numDamageRects[b]];
+        addBufferDamage(b, u);
+        return;
+    }
+
+    list[numDamageRects[b]++] = r;
+
+}
+
+void addDamage(int x0, int y0, int x1, int y1) {
+
+    Rect r = {x0 < 0 ? 0 : x0, y0 < 0 ? 0 : y0, x1 > screen.width - 1 ? screen.width - 1 : x1, y1 > screen.height - 1 ? screen.height - 1 : y1};
+    if (r.x0 > r.x1 || r.y0 > r.y1 || repaintAll) return;
+
+    for (int b = 0; b < NUM_PIXEL_BUFFERS; b++) addBufferDamage(b, r);
+
+}
+
+// draw2b2 covers (x, y) and the pixels right of and above it.
+void damageParticleAt(int x, int y) {
+    addDamage(x, y - 1, x + 1, y);
+}
+
+void damageMouseAt(mouseData * data) {
+    int x = data->x;
+    int y = data->y;
+    if(x<MOUSE_RADIUS) x=MOUSE_RADIUS;
+    else if (x>screen.width-1-MOUSE_RADIUS) x = screen.width-1-MOUSE_RADIUS;
+    if(y<MOUSE_RADIUS) y=MOUSE_RADIUS;
+    else if (y>screen.height-1-MOUSE_RADIUS) y = screen.height-1-MOUSE_RADIUS;
+    addDamage(x - MOUSE_RADIUS, y - MOUSE_RADIUS, x + MOUSE_RADIUS, y + MOUSE_RADIUS);
+}
+
+bool rbOutlineChanged(int i) {
+    if (!rbOnScreen[i] || drawnRBColours[i] != allBodies[i].colour) return true;
+    for (int j = 0; j < allBodies[i].numVerts; j++) {
+        if (drawnRBs[i].xs[j] != allBodies[i].xs[j] || drawnRBs[i].ys[j] != allBodies[i].ys[j]) return true;
+    }
+    return false;
+}
+
+// ----- Density field -----
+// Each particle splats a tent of weight FIELD_DENSITY_UNIT onto the four nearest field cells, along with
+// its speed. Resting particles sit further apart than a cell, so the splat is blurred by a [1 2 1] pass
+// each way to close the holes between them. Cells at least FIELD_THRESHOLD dense are coloured through a palette by their mean speed, and
+// the rest are black. Nearest upscaling paints each cell as a FIELD_SCALE block. Bilinear upscaling
+// interpolates the density and speed at every pixel before thresholding, so the surface is smooth.
+
+#define FLUID_RENDER_PARTICLES          0
+#define FLUID_RENDER_FIELD_NEAREST      1
+#define FLUID_RENDER_FIELD_BILINEAR     2
+#ifndef FLUID_RENDER_MODE
+#define FLUID_RENDER_MODE               FLUID_RENDER_PARTICLES
+#endif
+
+#define FIELD_SCALE             4
+#define FIELD_MAX_W             (MAX_X / FIELD_SCALE)
+#define FIELD_MAX_H             (MAX_Y / FIELD_SCALE)
+#define FIELD_DENSITY_UNIT      64.0 // One particle's weight in the 8 bit density
+#define FIELD_THRESHOLD         24
+#define FIELD_PALETTE_SIZE      32
+
+int fluidRenderMode = FLUID_RENDER_MODE;
+int drawnFluidRenderMode;
+int fieldWidth = FIELD_MAX_W; // Cells covering the screen, set by splatFluidField
+int fieldHeight = FIELD_MAX_H;
+
+unsigned char fieldDensity[FIELD_MAX_H][FIELD_MAX_W];
+unsigned char fieldSpeed[FIELD_MAX_H][FIELD_MAX_W]; // Palette index
+unsigned char drawnFieldDensity[FIELD_MAX_H][FIELD_MAX_W];
+unsigned char drawnFieldSpeed[FIELD_MAX_H][FIELD_MAX_W];
+float fieldWeight[FIELD_MAX_H][FIELD_MAX_W];
+float fieldSpeedSum[FIELD_MAX_H][FIELD_MAX_W];
+float fieldBlurWeight[FIELD_MAX_H][FIELD_MAX_W];
+float fieldBlurSpeedSum[FIELD_MAX_H][FIELD_MAX_W];
+short int fieldPalette[FIELD_PALETTE_SIZE];
+bool fieldPaletteReady = false;
+short int fieldLine[MAX_X] __attribute__ ((aligned (8))); // One upscaled row, blitted to the screen at once
+
+// Same hue ramp as the particle colours, from still water down to red.
+void buildFieldPalette() {
+    for (int k = 0; k < FIELD_PALETTE_SIZE; k++) fieldPalette[k] = hueToRGB565(WATER_HUE - WATER_HUE * k / (FIELD_PALETTE_SIZE - 1));
+    fieldPaletteReady = true;
+}
+
+void splatFluidField() {
+
+    fieldWidth = screen.width / FIELD_SCALE;
+    fieldHeight = screen.height / FIELD_SCALE;
+
+    for (int cy = 0; cy < fieldHeight; cy++) {
+        for (int cx = 0; cx < fieldWidth; cx++) {
+            fieldWeight[cy][cx] = 0;
+            fieldSpeedSum[cy][cx] = 0;
+        }
+    }
+
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+
+        // Field coordinates of the particle, measured from the centre of cell (0, 0)
+        float u = allParticles[i].pX * PX_PER_M / FIELD_SCALE - 0.5;
+        float v = allParticles[i].pY * PX_PER_M / FIELD_SCALE - 0.5;
+        int cx = floor(u);
+        int cy = floor(v);
+        float fx = u - cx;
+        float fy = v - cy;
+        float speed = sqrt(allParticles[i].vx*allParticles[i].vx + allParticles[i].vy*allParticles[i].vy);
+
+        for (int k = 0; k < 4; k++) {
+            int x = cx + (k & 1);
+            int y = cy + (k >> 1);
+            if (x < 0 || x >= fieldWidth || y < 0 || y >= fieldHeight) continue;
+            float w = ((k & 1) ? fx : 1 - fx) * ((k >> 1) ? fy : 1 - fy);
+            fieldWeight[y][x] += w;
+            fieldSpeedSum[y][x] += w * speed;
+        }
+
+    }
+
+    // [1 2 1] / 4 across, into the blur buffers, then down, back into the splat buffers
+    for (int cy = 0; cy < fieldHeight; cy++) {
+        for (int cx = 0; cx < fieldWidth; cx++) {
+            int l = cx > 0 ? cx - 1 : cx;
+            int r = cx < fieldWidth - 1 ? cx + 1 : cx;
+            fieldBlurWeight[cy][cx] = 0.25 * (fieldWeight[cy][l] + 2 * fieldWeight[cy][cx] + fieldWeight[cy][r]);
+            fieldBlurSpeedSum[cy][cx] = 0.25 * (fieldSpeedSum[cy][l] + 2 * fieldSpeedSum[cy][cx] + fieldSpeedSum[cy][r]);
+        }
+    }
+    for (int cy = 0; cy < fieldHeight; cy++) {
+        int u = cy > 0 ? cy - 1 : cy;
+        int d = cy < fieldHeight - 1 ? cy + 1 : cy;
+        for (int cx = 0; cx < fieldWidth; cx++) {
+            fieldWeight[cy][cx] = 0.25 * (fieldBlurWeight[u][cx] + 2 * fieldBlurWeight[cy][cx] + fieldBlurWeight[d][cx]);
+            fieldSpeedSum[cy][cx] = 0.25 * (fieldBlurSpeedSum[u][cx] + 2 * fieldBlurSpeedSum[cy][cx] + fieldBlurSpeedSum[d][cx]);
+        }
+    }
+
+    float speedPerIndex = VELOCITY_COLOUR_SENSITIVITY * WATER_HUE / (FIELD_PALETTE_SIZE - 1);
+    for (int cy = 0; cy < fieldHeight; cy++) {
+        for (int cx = 0; cx < fieldWidth; cx++) {
+            float w = fieldWeight[cy][cx];
+            float d = w * FIELD_DENSITY_UNIT;
+            float k = w > 0 ? fieldSpeedSum[cy][cx] / w / speedPerIndex : 0;
+            fieldDensity[cy][cx] = d > 255 ? 255 : d;
+            fieldSpeed[cy][cx] = k > FIELD_PALETTE_SIZE - 1 ? FIELD_PALETTE_SIZE - 1 : k;
+        }
+    }
+
+}
+
+short int fieldColour(int density, int speed) {
+    return density >= FIELD_THRESHOLD ? fieldPalette[speed] : BLACK;
+}
+
+// Nearest upscaling only shows a cell's colour, so only that needs to match. Bilinear pixels blend the
+// raw values of neighbouring cells.
+bool fieldCellChanged(int cx, int cy) {
+    if (fluidRenderMode == FLUID_RENDER_FIELD_NEAREST) {
+        return fieldColour(fieldDensity[cy][cx], fieldSpeed[cy][cx]) != fieldColour(drawnFieldDensity[cy][cx], drawnFieldSpeed[cy][cx]);
+    }
+    return fieldDensity[cy][cx] != drawnFieldDensity[cy][cx] || fieldSpeed[cy][cx] != drawnFieldSpeed[cy][cx];
+}
+
+// Damages changed cells a row of runs at a time. A bilinear cell reaches into the pixels of its neighbours.
+void damageFluidField() {
+
+    int pad = fluidRenderMode == FLUID_RENDER_FIELD_BILINEAR ? FIELD_SCALE : 0;
+
+    for (int cy = 0; cy < fieldHeight; cy++) {
+        int cx = 0;
+        while (cx < fieldWidth) {
+            while (cx < fieldWidth && !fieldCellChanged(cx, cy)) cx++;
+            int runStart = cx;
+            while (cx < fieldWidth && fieldCellChanged(cx, cy)) cx++;
+            if (runStart == cx) continue;
+            addDamage(runStart * FIELD_SCALE - pad, cy * FIELD_SCALE - pad,
+                      cx * FIELD_SCALE - 1 + pad, (cy + 1) * FIELD_SCALE - 1 + pad);
+        }
+    }
+
+}
+
+// Paints the field over region, which it covers completely, a row at a time.
+void drawFluidField(Rect * region) {
+
+    int x0 = region->x0;
+    int x1 = region->x1;
+
+    if (fluidRenderMode == FLUID_RENDER_FIELD_NEAREST) {
+        for (int y = region->y0; y <= region->y1; y++) {
+            int cy = y / FIELD_SCALE;
+            if (y == region->y0 || y % FIELD_SCALE == 0) {
+                for (int x = x0; x <= x1; x++) fieldLine[x] = fieldColour(fieldDensity[cy][x / FIELD_SCALE], fieldSpeed[cy][x / FIELD_SCALE]);
+            }
+            blitSpan(fieldLine + x0, x0, x1, y);
+        }
+        return;
+    }
+
+    // Bilinear in eighths of a cell. A pixel centre sits at (2x - 3) / 8 cells from the centre of cell 0.
+    for (int y = region->y0; y <= region->y1; y++) {
+
+        int v = 2*y - 3;
+        int cy = v < 0 ? 0 : v >> 3;
+        int fy = v < 0 ? 0 : v & 7;
+        int cy1 = cy + 1 < fieldHeight ? cy + 1 : cy;
+
+        for (int x = x0; x <= x1; x++) {
+            int u = 2*x - 3;
+            int cx = u < 0 ? 0 : u >> 3;
+            int fx = u < 0 ? 0 : u & 7;
+            int cx1 = cx + 1 < fieldWidth ? cx + 1 : cx;
+            int w00 = (8 - fx) * (8 - fy), w10 = fx * (8 - fy), w01 = (8 - fx) * fy, w11 = fx * fy;
+            int density = (fieldDensity[cy][cx] * w00 + fieldDensity[cy][cx1] * w10 +
+                           fieldDensity[cy1][cx] * w01 + fieldDensity[cy1][cx1] * w11) >> 6;
+            int speed = (fieldSpeed[cy][cx] * w00 + fieldSpeed[cy][cx1] * w10 +
+                         fieldSpeed[cy1][cx] * w01 + fieldSpeed[cy1][cx1] * w11) >> 6;
+            fieldLine[x] = fieldColour(density, speed);
+        }
+        blitSpan(fieldLine + x0, x0, x1, y);
+
+    }
+
+}
+
+// The part of collectDamage that follows the simulation: the particles (or the field, splatted here) and
+// the bodies. The frame scheduler runs it as a job once the step is done, while the last swap is still
+// pending. collectDamage runs it again only if the scene was switched in between.
+bool sceneDamageReady = false;
+bool sceneDamageFluid, sceneDamageRigid; // What it was collected for
+
+void collectSceneDamage(bool showFluid, bool showRigid) {
+
+    bool fieldMode = fluidRenderMode != FLUID_RENDER_PARTICLES;
+
+    hudBeginPhase(HUD_PHASE_DAMAGE);
+    PROFILE_BEGIN(PROFILE_DAMAGE);
+    if (showFluid && fieldMode) {
+        if (!fieldPaletteReady) buildFieldPalette();
+        splatFluidField();
+        damageFluidField();
+    }
+    if (showFluid && !fieldMode) {
+        for (int i = 0; i < NUM_PARTICLES; i++) {
+            if (drawnParticles[i].x == allParticles[i].x && drawnParticles[i].y == allParticles[i].y &&
+                drawnParticleColours[i] == allParticles[i].colour) continue;
+            damageParticleAt(drawnParticles[i].x, drawnParticles[i].y);
+            damageParticleAt(allParticles[i].x, allParticles[i].y);
+        }
+    }
+
+    // Bodies that left the scene. Despawned slots go back to the pool once their outline is damaged.
+    for (int i = 0; i < MAX_BODIES; i++) {
+        if (rbOnScreen[i] && (rbActiveSlot[i] < 0 || !showRigid)) {
+            addDamage(drawnRBBounds[i].x0, drawnRBBounds[i].y0, drawnRBBounds[i].x1, drawnRBBounds[i].y1);
+            rbOnScreen[i] = false;
+        }
+    }
+    for (int k = 0; k < numRBPendingErase; k++) rbFreeList[numRBFree++] = rbPendingErase[k];
+    numRBPendingErase = 0;
+
+    if (showRigid) {
+        for (int a = 0; a < numRBActive; a++) {
+            int i = rbActive[a];
+            if (!rbOutlineChanged(i)) continue;
+            if (rbOnScreen[i]) addDamage(drawnRBBounds[i].x0, drawnRBBounds[i].y0, drawnRBBounds[i].x1, drawnRBBounds[i].y1);
+            Rect r = rbOutlineBounds(i);
+            addDamage(r.x0, r.y0, r.x1, r.y1);
+        }
+    }
+
+    sceneDamageReady = true;
+    sceneDamageFluid = showFluid;
+    sceneDamageRigid = showRigid;
+    PROFILE_END(PROFILE_DAMAGE);
+    hudEndPhase(HUD_PHASE_DAMAGE);
+
+}
+
+void prepareSceneDamage() {
+    collectSceneDamage(isFluidSim, !isFluidSim || isCoupledSim);
+}
+
+// Compares the scene with what was drawn last frame and records the difference. The cursor and buttons
+// are read here, just before drawing, so they are no older than before.
+void collectDamage(bool showFluid, bool showRigid) {
+
+    repaintAll = damageEverything || showFluid != drawnFluid || showRigid != drawnRigid ||
+                 fluidRenderMode != drawnFluidRenderMode;
+    damageEverything = false;
+
+    if (!sceneDamageReady || showFluid != sceneDamageFluid || showRigid != sceneDamageRigid) {
+        collectSceneDamage(showFluid, showRigid);
+    }
+    sceneDamageReady = false;
+
+    hudBeginPhase(HUD_PHASE_DAMAGE);
+    if (drawnMouse.x != mData.x || drawnMouse.y != mData.y || drawnMouse.left != mData.left) {
+        damageMouseAt(&drawnMouse);
+        damageMouseAt(&mData);
+    }
+
+    UIState ui = currentUIState();
+    if (uiStatesDiffer(&ui, &uiState)) addDamage(UI_X0, UI_Y0, UI_X1, UI_Y1);
+    uiState = ui;
+
+    if (repaintAll) {
+        for (int b = 0; b < NUM_PIXEL_BUFFERS; b++) {
+            numDamageRects[b] = 1;
+            damageRects[b][0] = screenRect();
+        }
+        repaintAll = false; // The next frame's scene damage may be collected before its collectDamage
+    }
+    hudEndPhase(HUD_PHASE_DAMAGE);
+
+}
+
+// ----- Rasteriser -----
+// The frame's commands are counting-sorted by layer, then by the RENDER_TILE_PX tile holding their top
+// left corner, row by row. Each region is then drawn back to front, and top to bottom within a layer.
+// A region only visits the tiles its commands could start in: its own, widened by the largest command
+// in each layer.
+
+#define RENDER_TILE_PX          32
+#define RENDER_MAX_TILES        (((MAX_X + RENDER_TILE_PX - 1) / RENDER_TILE_PX) * ((MAX_Y + RENDER_TILE_PX - 1) / RENDER_TILE_PX))
+#define RENDER_MAX_BINS         (RENDER_LAYERS * RENDER_MAX_TILES)
+
+int renderOrder[RENDER_QUEUE_SIZE]; // Ring slots in drawing order
+int renderBinStart[RENDER_MAX_BINS + 1];
+int renderBinCursor[RENDER_MAX_BINS];
+int renderTileColumns, renderTileRows, renderTiles; // Tiles covering the screen, set by sortRenderQueue
+int renderLayerReach[RENDER_LAYERS][2]; // Widest and tallest command in each layer, px
+int renderCommandsQueued = 0; // Last frame
+int renderCommandsRun = 0; // Last frame, once per region a command was drawn into
+
+int renderTileColumn(int x) {
+    return x < 0 ? 0 : (x >= screen.width ? renderTileColumns - 1 : x / RENDER_TILE_PX);
+}
+
+int renderTileRow(int y) {
+    return y < 0 ? 0 : (y >= screen.height ? renderTileRows - 1 : y / RENDER_TILE_PX);
+}
+
+int renderBinOf(RenderCommand * c) {
+    return c->layer * renderTiles + renderTileRow(c->y0) * renderTileColumns + renderTileColumn(c->x0);
+}
+
+void sortRenderQueue() {
+
+    int n = renderQueueHead - renderQueueTail;
+    int bins;
+
+    renderTileColumns = (screen.width + RENDER_TILE_PX - 1) / RENDER_TILE_PX;
+    renderTileRows = (screen.height + RENDER_TILE_PX - 1) / RENDER_TILE_PX;
+    renderTiles = renderTileColumns * renderTileRows;
+    bins = RENDER_LAYERS * renderTiles;
+
+    for (int b = 0; b <= bins; b++) renderBinStart[b] = 0;
+    for (int l = 0; l < RENDER_LAYERS; l++) renderLayerReach[l][0] = renderLayerReach[l][1] = 0;
+
+    for (int k = 0; k < n; k++) {
+        RenderCommand * c = &renderQueue[(renderQueueTail + k) % RENDER_QUEUE_SIZE];
+        renderBinStart[renderBinOf(c) + 1]++;
+        if (c->x1 - c->x0 > renderLayerReach[c->layer][0]) renderLayerReach[c->layer][0] = c->x1 - c->x0;
+        if (c->y1 - c->y0 > renderLayerReach[c->layer][1]) renderLayerReach[c->layer][1] = c->y1 - c->y0;
+    }
+    for (int b = 0; b < bins; b++) {
+        renderBinStart[b + 1] += renderBinStart[b];
+        renderBinCursor[b] = renderBinStart[b];
+    }
+    for (int k = 0; k < n; k++) {
+        int slot = (renderQueueTail + k) % RENDER_QUEUE_SIZE;
+        renderOrder[renderBinCursor[renderBinOf(&renderQueue[slot])]++] = slot;
+    }
+
+    renderCommandsQueued = n;
+
+}
+
+void runRenderCommand(RenderCommand * c, Rect * region) {
+
+    Rect bounds = {c->x0, c->y0, c->x1, c->y1};
+    int v = c->arg[0];
+
+    switch (c->type) {
+        case RC_CLEAR:
+        case RC_RECT:
+            fillRect(&bounds, c->colour);
+            break;
+        case RC_FIELD: {
+            Rect r = {bounds.x0 > region->x0 ? bounds.x0 : region->x0, bounds.y0 > region->y0 ? bounds.y0 : region->y0,
+                      bounds.x1 < region->x1 ? bounds.x1 : region->x1, bounds.y1 < region->y1 ? bounds.y1 : region->y1};
+            drawFluidField(&r);
+            break;
+        }
+        case RC_POINT:
+            draw2b2(c->arg[0], c->arg[1], c->colour);
+            break;
+        case RC_POLYLINE:
+            for (int j = 1; j < c->arg[1]; j++) {
+                int a = (v + j - 1) % RENDER_VERTEX_RING;
+                int b = (v + j) % RENDER_VERTEX_RING;
+                drawBresenhamLine(renderVerts[a][0], renderVerts[a][1], renderVerts[b][0], renderVerts[b][1], c->colour);
+            }
+            if (c->arg[2]) {
+                int a = (v + c->arg[1] - 1) % RENDER_VERTEX_RING;
+                drawBresenhamLine(renderVerts[a][0], renderVerts[a][1], renderVerts[v][0], renderVerts[v][1], c->colour);
+            }
+            break;
+        case RC_POLYGON_FILL: {
+            int xs[VERTICIES_PER_BODY];
+            int ys[VERTICIES_PER_BODY];
+            for (int j = 0; j < c->arg[1]; j++) {
+                xs[j] = renderVerts[(v + j) % RENDER_VERTEX_RING][0];
+                ys[j] = renderVerts[(v + j) % RENDER_VERTEX_RING][1];
+            }
+            fillConvexPolygon(xs, ys, c->arg[1], c->colour);
+            break;
+        }
+        case RC_ARC:
+            drawRBArc(renderVerts[v][0], renderVerts[v][1], c->arg[1], c->arg[2], c->arg[3], c->colour);
+            break;
+        case RC_DISC:
+            fillDisc(renderVerts[v][0], renderVerts[v][1], c->arg[1], c->colour);
+            break;
+        case RC_SPRITE:
+            blitRectKeyed(c->sprite, c->arg[0], c->x0, c->y0, c->x1 - c->x0 + 1, c->y1 - c->y0 + 1, c->colour);
+            break;
+    }
+
+}
+
+// Draws every queued command that touches region, with the pixel writes clipped to it.
+void rasteriseRegion(Rect * region) {
+
+    clipRect = *region;
+
+    for (int l = 0; l < RENDER_LAYERS; l++) {
+        int tx0 = renderTileColumn(region->x0 - renderLayerReach[l][0]);
+        int ty0 = renderTileRow(region->y0 - renderLayerReach[l][1]);
+        int tx1 = renderTileColumn(region->x1);
+        int ty1 = renderTileRow(region->y1);
+        for (int ty = ty0; ty <= ty1; ty++) {
+            for (int tx = tx0; tx <= tx1; tx++) {
+                int bin = l * renderTiles + ty * renderTileColumns + tx;
+                for (int k = renderBinStart[bin]; k < renderBinStart[bin + 1]; k++) {
+                    RenderCommand * c = &renderQueue[renderOrder[k]];
+                    Rect bounds = {c->x0, c->y0, c->x1, c->y1};
+                    if (!rectsOverlap(&bounds, region)) continue;
+                    runRenderCommand(c, region);
+                    renderCommandsRun++;
+                }
+            }
+        }
+    }
+
+    clipRect = screenRect();
+
+}
+
+// Queues the whole scene. The background clear (or the fluid field, which covers the screen) goes first,
+// then the UI and cursor, so if the queue ever fills it is particles and bodies that go missing. Drawing
+// order comes from the layers, not from the order commands were queued in.
+void queueSceneCommands(bool showFluid, bool showRigid) {
+
+    bool fieldMode = fluidRenderMode != FLUID_RENDER_PARTICLES;
+
+    queueRenderCommand(showFluid && fieldMode ? RC_FIELD : RC_CLEAR, RENDER_LAYER_BACKGROUND, BLACK, 0, 0, screen.width - 1, screen.height - 1);
+    queueUICommands();
+    queueCursorCommands(&mData, WHITE);
+    if (showFluid && !fieldMode) queueParticleCommands();
+    if (showRigid) {
+        for (int a = 0; a < numRBActive; a++) {
+#ifdef RB_DRAW_FILLED
+            queueBodyCommands(rbActive[a], true);
+#else
+            queueBodyCommands(rbActive[a], false);
+#endif
+        }
+    }
+
+}
+
+#ifdef HOST_BUILD
+// Lists the frame's commands in drawing order. Call between sortRenderQueue and the end of the frame.
+void printRenderQueue(FILE * out) {
+    const char * names[] = {"clear", "field", "point", "polyline", "polygon", "arc", "disc", "rect", "sprite"};
+    for (int k = 0; k < renderCommandsQueued; k++) {
+        RenderCommand * c = &renderQueue[renderOrder[k]];
+        fprintf(out, "%5d layer %d %-8s colour %04hx bounds (%d, %d)-(%d, %d) args %d %d %d %d\n", k, c->layer,
+                names[c->type], c->colour, c->x0, c->y0, c->x1, c->y1, c->arg[0], c->arg[1], c->arg[2], c->arg[3]);
+    }
+}
+#endif
+
+// Remembers what is now on screen for the next collectDamage.
+void recordDrawnScene(bool showFluid, bool showRigid) {
+
+    if (showFluid && fluidRenderMode != FLUID_RENDER_PARTICLES) {
+        memcpy(drawnFieldDensity, fieldDensity, sizeof fieldDensity);
+        memcpy(drawnFieldSpeed, fieldSpeed, sizeof fieldSpeed);
+    } else if (showFluid) {
+        for (int i = 0; i < NUM_PARTICLES; i++) {
+            drawnParticles[i].x = allParticles[i].x;
+            drawnParticles[i].y = allParticles[i].y;
+            drawnParticleColours[i] = allParticles[i].colour;
+        }
+    }
+    if (showRigid) {
+        for (int a = 0; a < numRBActive; a++) {
+            int i = rbActive[a];
+            for (int j = 0; j < allBodies[i].numVerts; j++) {
+                drawnRBs[i].xs[j] = allBodies[i].xs[j];
+                drawnRBs[i].ys[j] = allBodies[i].ys[j];
+            }
+            drawnRBColours[i] = allBodies[i].colour;
+            drawnRBBounds[i] = rbOutlineBounds(i);
+            rbOnScreen[i] = true;
+        }
+    }
+    drawnMouse = mData;
+    drawnFluid = showFluid;
+    drawnRigid = showRigid;
+    drawnFluidRenderMode = fluidRenderMode;
+
+}
+
+void renderFrame() {
+
+    bool showFluid = isFluidSim;
+    bool showRigid = !isFluidSim || isCoupledSim;
+
+    collectDamage(showFluid, showRigid);
+
+    // Regions go top to bottom, like the commands inside them.
+    hudBeginPhase(HUD_PHASE_DRAW);
+    PROFILE_BEGIN(PROFILE_DRAW);
+    Rect * regions = damageRects[backBuffer];
+    int numRegions = numDamageRects[backBuffer];
+    for (int k = 1; k < numRegions; k++) {
+        Rect r = regions[k];
+        int j = k;
+        for (; j > 0 && regions[j - 1].y0 > r.y0; j--) regions[j] = regions[j - 1];
+        regions[j] = r;
+    }
+    renderCommandsQueued = 0;
+    renderCommandsRun = 0;
+    if (numRegions > 0) {
+        queueSceneCommands(showFluid, showRigid);
+        sortRenderQueue();
+        for (int k = 0; k < numRegions; k++) rasteriseRegion(&regions[k]);
+        clearRenderQueue();
+    }
+    recordDrawnScene(showFluid, showRigid);
+    PROFILE_END(PROFILE_DRAW);
+    hudEndPhase(HUD_PHASE_DRAW);
+
+#ifdef CAPTURE_FILE
+    captureFrame(regions, numRegions);
+#endif
+
+    numDamageRects[backBuffer] = 0;
+
+}
+
+// =======================================================================================================
+//                                              FRAME CAPTURE
+// =======================================================================================================
+
+// Host builds with CAPTURE_FILE defined append every drawn frame to that file, so the output can be
+// reviewed without a monitor. A frame is stored as the regions redrawn in it. They cover everything that
+// changed since the buffer was last drawn two frames back, so pasting them over the previous frame
+// rebuilds each frame exactly. CAPTURE_FULL_FRAMES stores whole frames instead.
+//
+// The main loop only copies the regions into a slot of a preallocated pool, and a writer thread streams
+// full slots to the file. If the writer falls behind and every slot is taken, the frame is dropped and
+// counted rather than stalling the loop. If a write fails, say on a full disk, the error is reported once,
+// captureFailed is set and the rest of the frames are thrown away. Building with CAPTURE_READER instead
+// gives a tiny reader that turns a capture into a Y4M video or a sequence of PPM images.
+//
+// The file is a CaptureFileHeader, then for each frame a CaptureFrameHeader, its numRects inclusive
+// rectangles as 4 uint16s each, and the pixels of each rectangle row by row as RGB565. All little-endian.
+
+#define CAPTURE_MAGIC           0x50414353 // "SCAP"
+#define CAPTURE_FRAME_MAGIC     0x4d415246 // "FRAM"
+#define CAPTURE_POOL_SLOTS      8
+#define CAPTURE_SLOT_BYTES      (sizeof(CaptureFrameHeader) + MAX_DAMAGE_RECTS * 4 * sizeof(uint16_t) + MAX_X * MAX_Y * 2)
+
+typedef struct CaptureFileHeader {
+
+    uint32_t magic;
+    uint16_t width, height;
+    uint16_t fps;
+    uint16_t reserved;
+
+} CaptureFileHeader;
+
+typedef struct CaptureFrameHeader {
+
+    uint32_t magic;
+    uint32_t frame;
+    uint16_t numRects; // 0 when nothing changed
+    uint16_t reserved;
+
+} CaptureFrameHeader;
+
+#ifdef CAPTURE_FILE
+#ifndef HOST_BUILD
+#error "CAPTURE_FILE needs HOST_BUILD"
+#endif
+
+unsigned char capturePool[CAPTURE_POOL_SLOTS][CAPTURE_SLOT_BYTES];
+size_t captureSlotBytes[CAPTURE_POOL_SLOTS];
+unsigned int captureHead = 0; // Both count up forever and are taken mod the pool size
+unsigned int captureTail = 0;
+pthread_mutex_t captureLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t captureReady = PTHREAD_COND_INITIALIZER;
+pthread_t captureThread;
+FILE * captureOut = NULL;
+bool captureStarted = false;
+bool captureStopping = false;
+bool captureResync = true; // The next frame is stored whole: it is the first, or the one before it was dropped
+bool captureFailed = false; // Set by the writer. Read it once captureFinish has returned.
+unsigned int captureFrames = 0;
+int captureDropped = 0;
+long long captureBytes = 0;
+long long captureCopyNs = 0; // Time the main loop spent copying frames into the pool
+
+void * captureWriter(void * arg) {
+
+    (void) arg;
+    pthread_mutex_lock(&captureLock);
+    while (true) {
+        while (captureTail == captureHead && !captureStopping) pthread_cond_wait(&captureReady, &captureLock);
+        if (captureTail == captureHead) break;
+        int slot = captureTail % CAPTURE_POOL_SLOTS;
+        pthread_mutex_unlock(&captureLock);
+        if (!captureFailed && fwrite(capturePool[slot], 1, captureSlotBytes[slot], captureOut) != captureSlotBytes[slot]) {
+            perror(CAPTURE_FILE);
+            captureFailed = true;
+        }
+        pthread_mutex_lock(&captureLock);
+        captureTail++;
+    }
+    pthread_mutex_unlock(&captureLock);
+    return NULL;
+
+}
+
+void captureSetup() {
+
+    captureStarted = true;
+    captureOut = fopen(CAPTURE_FILE, "wb");
+    if (!captureOut) {
+        perror(CAPTURE_FILE);
+        return;
+    }
+
+    CaptureFileHeader header = {CAPTURE_MAGIC, screen.width, screen.height, HOST_VSYNC_HZ > 0 ? HOST_VSYNC_HZ : 60, 0};
+    if (fwrite(&header, sizeof header, 1, captureOut) != 1 || pthread_create(&captureThread, NULL, captureWriter, NULL) != 0) {
+        perror(CAPTURE_FILE);
+        fclose(captureOut);
+        captureOut = NULL;
+        captureFailed = true;
+    }
+
+}
+
+// Copies the back buffer's redrawn regions into a free slot and hands it to the writer.
+void captureFrame(Rect * regions, int numRegions) {
+
+    if (!captureStarted) captureSetup();
+    if (!captureOut) return;
+
+    long long start = timeNanoseconds();
+
+    pthread_mutex_lock(&captureLock);
+    bool full = captureHead - captureTail >= CAPTURE_POOL_SLOTS;
+    pthread_mutex_unlock(&captureLock);
+    if (full) {
+        captureDropped++;
+        captureFrames++;
+        captureResync = true;
+        return;
+    }
+
+    // Overlapping regions would store some pixels twice. Past a screenful, one rectangle is cheaper.
+    Rect whole = screenRect();
+    int area = 0;
+    for (int k = 0; k < numRegions; k++) area += rectArea(&regions[k]);
+#ifdef CAPTURE_FULL_FRAMES
+    captureResync = true;
+#endif
+    if (captureResync || area > rectArea(&whole)) {
+        regions = &whole;
+        numRegions = 1;
+        captureResync = false;
+    }
+
+    int slot = captureHead % CAPTURE_POOL_SLOTS;
+    unsigned char * out = capturePool[slot];
+    CaptureFrameHeader header = {CAPTURE_FRAME_MAGIC, captureFrames++, numRegions, 0};
+    memcpy(out, &header, sizeof header);
+    out += sizeof header;
+    for (int k = 0; k < numRegions; k++) {
+        uint16_t r[4] = {regions[k].x0, regions[k].y0, regions[k].x1, regions[k].y1};
+        memcpy(out, r, sizeof r);
+        out += sizeof r;
+    }
+    for (int k = 0; k < numRegions; k++) {
+        int rowBytes = (regions[k].x1 - regions[k].x0 + 1) * 2;
+        for (int y = regions[k].y0; y <= regions[k].y1; y++) {
+            memcpy(out, (const void *) &fbRows[y][regions[k].x0], rowBytes);
+            out += rowBytes;
+        }
+    }
+    captureSlotBytes[slot] = out - capturePool[slot];
+    captureBytes += captureSlotBytes[slot];
+    captureCopyNs += timeNanoseconds() - start;
+
+    pthread_mutex_lock(&captureLock);
+    captureHead++;
+    pthread_cond_signal(&captureReady);
+    pthread_mutex_unlock(&captureLock);
+
+}
+
+// Lets the writer drain the pool and closes the file.
+void captureFinish() {
+
+    if (!captureOut) return;
+    pthread_mutex_lock(&captureLock);
+    captureStopping = true;
+    pthread_cond_signal(&captureReady);
+    pthread_mutex_unlock(&captureLock);
+    pthread_join(captureThread, NULL);
+    if (fclose(captureOut) != 0 && !captureFailed) {
+        perror(CAPTURE_FILE);
+        captureFailed = true;
+    }
+    captureOut = NULL;
+
+}
+#endif
+
+#ifdef CAPTURE_READER
+// Build with
+//   gcc -O2 -DHOST_BUILD -DCAPTURE_READER fluid_simulator.c -lm -o capture_reader
+// and run as capture_reader in.cap out.y4m, or with any other output name, say out, to get out_00000.ppm,
+// out_00001.ppm and so on. Y4M frames are 4:4:4 BT.601 studio range.
+#ifndef HOST_BUILD
+#error "CAPTURE_READER needs HOST_BUILD"
+#endif
+
+void rgb565ToRGB(uint16_t p, int * r, int * g, int * b) {
+    *r = (p >> 11) & 0x1F;
+    *g = (p >> 5) & 0x3F;
+    *b = p & 0x1F;
+    *r = (*r << 3) | (*r >> 2);
+    *g = (*g << 2) | (*g >> 4);
+    *b = (*b << 3) | (*b >> 2);
+}
+
+// Writes the canvas as the next Y4M frame, or as its own PPM when video is NULL.
+bool writeCaptureFrame(uint16_t * canvas, int w, int hgt, unsigned char * plane, FILE * video, const char * prefix, int index) {
+
+    if (video) {
+        // Planes Y, then Cb, then Cr
+        for (int i = 0; i < w * hgt; i++) {
+            int r, g, b;
+            rgb565ToRGB(canvas[i], &r, &g, &b);
+            plane[i] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+            plane[w * hgt + i] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+            plane[2 * w * hgt + i] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+        }
+        fprintf(video, "FRAME\n");
+        fwrite(plane, 1, w * hgt * 3, video);
+        return true;
+    }
+
+    char name[1024];
+    snprintf(name, sizeof name, "%s_%05d.ppm", prefix, index);
+    FILE * ppm = fopen(name, "wb");
+    if (!ppm) {
+        perror(name);
+        return false;
+    }
+    for (int i = 0; i < w * hgt; i++) {
+        int r, g, b;
+        rgb565ToRGB(canvas[i], &r, &g, &b);
+        plane[3 * i] = r;
+        plane[3 * i + 1] = g;
+        plane[3 * i + 2] = b;
+    }
+    fprintf(ppm, "P6\n%d %d\n255\n", w, hgt);
+    fwrite(plane, 1, w * hgt * 3, ppm);
+    fclose(ppm);
+    return true;
+
+}
+
+int runCaptureReader(int argc, char ** argv) {
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s capture out.y4m|out\n", argv[0]);
+        return 1;
+    }
+    FILE * in = fopen(argv[1], "rb");
+    if (!in) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    CaptureFileHeader header;
+    if (fread(&header, sizeof header, 1, in) != 1 || header.magic != CAPTURE_MAGIC) {
+        fprintf(stderr, "%s: not a capture\n", argv[1]);
+        return 1;
+    }
+    int w = header.width;
+    int hgt = header.height;
+    uint16_t * canvas = calloc(w * hgt, sizeof *canvas);
+    unsigned char * plane = malloc(w * hgt * 3);
+    if (w == 0 || hgt == 0 || !canvas || !plane) {
+        fprintf(stderr, "%s: can't hold a %dx%d frame\n", argv[1], w, hgt);
+        return 1;
+    }
+
+    size_t nameLen = strlen(argv[2]);
+    FILE * video = NULL;
+    if (nameLen > 4 && strcmp(argv[2] + nameLen - 4, ".y4m") == 0) {
+        video = fopen(argv[2], "wb");
+        if (!video) {
+            perror(argv[2]);
+            return 1;
+        }
+        fprintf(video, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", w, hgt, header.fps);
+    }
+
+    // A dropped frame shows the one before it again, so the output keeps the capture's timing. A truncated
+    // capture ends at its last whole frame. A rectangle off the canvas means the file is corrupt.
+    int frames = 0;
+    int dropped = 0;
+    int status = 0;
+    CaptureFrameHeader frame;
+    while (fread(&frame, sizeof frame, 1, in) == 1 && frame.magic == CAPTURE_FRAME_MAGIC) {
+
+        uint16_t rects[MAX_DAMAGE_RECTS][4];
+        if (frame.numRects > MAX_DAMAGE_RECTS || fread(rects, sizeof rects[0], frame.numRects, in) != frame.numRects) break;
+        for (int k = 0; k < frame.numRects; k++) {
+            if (rects[k][0] > rects[k][2] || rects[k][1] > rects[k][3] || rects[k][2] >= w || rects[k][3] >= hgt) {
+                fprintf(stderr, "%s: frame %u has rectangle (%d, %d)-(%d, %d) off the %dx%d screen\n", argv[1], frame.frame,
+                        rects[k][0], rects[k][1], rects[k][2], rects[k][3], w, hgt);
+                status = 1;
+                goto done;
+            }
+        }
+
+        for (; frames < (int) frame.frame; frames++, dropped++) {
+            if (!writeCaptureFrame(canvas, w, hgt, plane, video, argv[2], frames)) return 1;
+        }
+
+        for (int k = 0; k < frame.numRects; k++) {
+            int rowPixels = rects[k][2] - rects[k][0] + 1;
+            for (int y = rects[k][1]; y <= rects[k][3]; y++) {
+                if (fread(&canvas[y * w + rects[k][0]], 2, rowPixels, in) != (size_t) rowPixels) goto done;
+            }
+        }
+        if (!writeCaptureFrame(canvas, w, hgt, plane, video, argv[2], frames++)) return 1;
+
+    }
+
+done:
+    if (video) fclose(video);
+    fclose(in);
+    fprintf(stderr, "%d frames, %d of them repeats standing in for dropped ones\n", frames, dropped);
+    return status;
+
+}
+#endif
+
+// =======================================================================================================
+//                                             FRAME SCHEDULER
+// =======================================================================================================
+
+// Once a frame is drawn its swap is requested straight away, and the work for the next frame runs as
+// jobs while the controller waits for vsync: the simulation step, pass by pass, then the scene half of
+// the damage collection. The loop only spins on the status bit if the jobs run out first, and that spin
+// is the HUD's "wait" phase. A frame whose jobs were still running when the swap landed counts as an
+// overrun. The next frame is then drawn as soon as they finish, rather than a whole vsync later.
+//
+// The board steps the simulation against wall time: each frame runs as many steps as TIME_TICK_HZ
+// ticks have passed since the last one, so its speed no longer depends on how long drawing took. The tick
+// rate is the vsync rate, and the steps trail the ticks by about two, so a frame that keeps up runs one
+// step even when the timer and vsync drift in phase and it sees no tick or two go by. A frame runs at most
+// SIM_MAX_STEPS_PER_FRAME, and only one after a frame that overran. Debt past that is dropped, so when a
+// step costs more than a tick the simulation slows down, rather than every frame running the most steps
+// and taking ever longer. A build with INPUT_REPLAY runs exactly one step a frame instead.
+
+#define MAX_FRAME_JOBS          32
+#define SIM_MAX_STEPS_PER_FRAME 3
+
+typedef void (*FrameJob)(void);
+
+FrameJob frameJobs[MAX_FRAME_JOBS];
+int numFrameJobs = 0;
+int frameOverruns = 0; // Since the HUD last showed them
+bool frameOverran = false; // The last frame's jobs were still running when its swap landed
+unsigned int simTicksDone = 0; // Ticks the simulation has been stepped (or paused) through
+int simSteps = 0; // Since the HUD last showed them
+
+void queueFrameJob(FrameJob job) {
+    if (numFrameJobs < MAX_FRAME_JOBS) frameJobs[numFrameJobs++] = job;
+}
+
+// The same step as timeStepCoupledWorld, timeStepGridParticleUpdate or timeStepRBForceApplication.
+void queueSimulationJobs() {
+
+    if (isFluidSim) {
+        queueFrameJob(stepFluidNeighbours);
+        queueFrameJob(stepFluidDensities);
+        queueFrameJob(stepFluidAccelerations);
+        queueFrameJob(stepFluidParticles);
+    }
+    if (isCoupledSim) {
+        queueFrameJob(stepFluidBodyCollisions);
+        queueFrameJob(stepFluidBodyWakes);
+    }
+    if (!isFluidSim || isCoupledSim) queueFrameJob(timeStepRBForceApplication);
+    simSteps++;
+
+}
+
+// How many steps are owed to the ticks since the last call. One step covers anything from one to three
+// ticks owed, and the rest is kept in hand. Paused frames call it too, so play doesn't resume with a
+// burst of steps.
+int simStepsDue() {
+
+#ifdef INPUT_REPLAY
+    return 1; // Replayed events are keyed by frame, so the steps between them must not depend on timing
+#else
+    unsigned int ticks = timeTicks();
+    int owed = (int) (ticks - simTicksDone);
+    int steps = owed <= 0 ? 0 : owed <= 3 ? 1 : owed - 2;
+    int limit = frameOverran ? 1 : SIM_MAX_STEPS_PER_FRAME;
+    if (steps > limit) {
+        steps = limit;
+        simTicksDone = ticks - 2;
+    } else {
+        simTicksDone += steps;
+    }
+    return steps;
+#endif
+
+}
+
+// Swaps the buffers and runs the queued jobs while the swap is pending. Returns once both are done.
+void presentFrame() {
+
+    requestBufferSwap();
+    bool pending = bufferSwapPending();
+
+    for (int k = 0; k < numFrameJobs; k++) frameJobs[k]();
+    numFrameJobs = 0;
+    frameOverran = pending && !bufferSwapPending();
+    frameOverruns += frameOverran;
+
+    hudBeginPhase(HUD_PHASE_WAIT);
+    PROFILE_BEGIN(PROFILE_VSYNC_WAIT);
+    while (bufferSwapPending());
+    PROFILE_END(PROFILE_VSYNC_WAIT);
+    hudEndPhase(HUD_PHASE_WAIT);
+
+}
+
+#ifdef RENDER_BENCHMARK
+// Host benchmark of the whole frame loop, drawn and swapped through the host display backend. Build with
+//   gcc -O2 -DHOST_BUILD -DRENDER_BENCHMARK fluid_simulator.c -lm
+// and add -DHOST_VSYNC_HZ=0 to run unthrottled. Run it with a screen size, say 1280x720 (built with MAX_X
+// and MAX_Y at least that), and optionally a different simulation domain after it. Each scene runs with
+// the cursor sweeping across it, or driven by the input trace built in with INPUT_REPLAY. Then one more
+// frame is drawn and checked against a full repaint of the same scene, so a bad pixel means damage went
+// missing. The repaint is drawn from the same queue, so a dropped command would be missing from both
+// and is reported separately. Either one fails the benchmark.
+#define RENDER_BENCHMARK_FRAMES 300
+
+#ifndef HOST_BUILD
+#error "RENDER_BENCHMARK needs HOST_BUILD"
+#endif
+
+short int renderBenchmarkFrame[MAX_Y * HOST_MAX_STRIDE];
+
+// Returns false if any pixel was wrong or any command dropped.
+bool renderBenchmarkScene(const char * name, bool fluid, bool coupled) {
+
+    isFluidSim = fluid;
+    isCoupledSim = coupled;
+    resetSimHandler();
+    hudSetup();
+
+    int swaps = hostSwaps;
+    int dropped = renderCommandsDropped;
+#ifdef CAPTURE_FILE
+    long long captureNs = captureCopyNs;
+    long long captureStartBytes = captureBytes;
+    int captureStartDropped = captureDropped;
+#endif
+    long long start = timeNanoseconds();
+#ifdef INPUT_REPLAY
+    restartInputReplay();
+#endif
+    for (int frame = 0; frame < RENDER_BENCHMARK_FRAMES; frame++) {
+#ifdef INPUT_REPLAY
+        processInputEvents();
+#else
+        mData.x = (frame * 3) % screen.width;
+        mData.y = screen.height / 4 + (frame % 40);
+#endif
+        renderFrame();
+        prevmData = mData;
+        queueSimulationJobs();
+        queueFrameJob(prepareSceneDamage);
+        presentFrame();
+        hudEndFrame();
+        PROFILE_END_FRAME();
+    }
+    double ms = (timeNanoseconds() - start) / 1.0e6 / RENDER_BENCHMARK_FRAMES;
+    swaps = hostSwaps - swaps;
+
+    renderFrame();
+    memcpy(renderBenchmarkFrame, (void *) CURRENT_BACK_BUFFER_ADDRESS, screen.height * screen.stride * sizeof(short int));
+    Rect full = screenRect();
+    queueSceneCommands(isFluidSim, !isFluidSim || isCoupledSim);
+    sortRenderQueue();
+    rasteriseRegion(&full);
+    clearRenderQueue();
+    int bad = 0;
+    for (int y = 0; y < screen.height; y++) {
+        for (int x = 0; x < screen.width; x++) bad += renderBenchmarkFrame[y * screen.stride + x] != fbRows[y][x];
+    }
+    dropped = renderCommandsDropped - dropped;
+
+    printf("%-8s %7.3f ms/frame  %5.1f fps  %d swaps  %d bad pixels  %d commands dropped\n", name, ms, 1000.0 / ms,
+           swaps, bad, dropped);
+#ifdef CAPTURE_FILE
+    printf("         capture %.1f us/frame copying, %.1f KB/frame, %d dropped\n",
+           (captureCopyNs - captureNs) / 1000.0 / RENDER_BENCHMARK_FRAMES,
+           (captureBytes - captureStartBytes) / 1024.0 / RENDER_BENCHMARK_FRAMES, captureDropped - captureStartDropped);
+#endif
+#ifdef INPUT_REPLAY
+    return bad == 0 && dropped == 0 && !inputReplayFailed;
+#else
+    return bad == 0 && dropped == 0;
+#endif
+
+}
+
+// Returns the number of scenes that failed their check.
+int runRenderBenchmark() {
+
+    play = true;
+    vgaSetup();
+    printf("display: %s %dx%d, domain %dx%d, vsync %d Hz, %d particles\n", display->name, screen.width, screen.height,
+           domain.width, domain.height, HOST_VSYNC_HZ, NUM_PARTICLES);
+    int failed = !renderBenchmarkScene("bodies", false, false);
+    failed += !renderBenchmarkScene("fluid", true, false);
+    failed += !renderBenchmarkScene("coupled", true, true);
+#ifdef CAPTURE_FILE
+    captureFinish();
+    failed += captureFailed;
+#endif
+    return failed;
+
+}
+#endif
+
+// =======================================================================================================
+//                                            PERFORMANCE HUD
+// =======================================================================================================
+
+// Frame rate, time per phase and the sizes of the scene, averaged over HUD_UPDATE_FRAMES frames, and the
+// render queue's counts for the last frame. On the board the text goes into the FPGA character buffer,
+// which the VGA controller lays over the pixel buffer, so showing it costs no pixel writes. The host build
+// prints the same lines to stdout, or to HUD_FILE if that is defined.
+//
+// Time comes from timeNow (see TIMEKEEPING), cut down to 32 bits, which is plenty for one period.
+
+#define CHAR_BUF_COLUMNS        80
+#define CHAR_BUF_ROWS           60
+#define HUD_UPDATE_FRAMES       30
+#define HUD_COLUMN              1
+#define HUD_ROW                 1
+#define HUD_LINES               4
+#define HUD_TICKS_PER_US        TIME_TICKS_PER_US
+
+const char * hudPhaseNames[HUD_NUM_PHASES] = {"nbr", "dens", "frc", "int", "col", "dmg", "draw", "wait"};
+unsigned int hudPhaseStart[HUD_NUM_PHASES];
+unsigned int hudPhaseTicks[HUD_NUM_PHASES]; // Summed over the frames since the last update
+unsigned int hudPeriodStart;
+int hudFrames = 0;
+char hudText[HUD_LINES][CHAR_BUF_COLUMNS + 1];
+#ifdef HOST_BUILD
+FILE * hudOut;
+#endif
+
+unsigned int hudTicks() {
+    return (unsigned int) timeNow();
+}
+
+void hudBeginPhase(int phase) {
+    hudPhaseStart[phase] = hudTicks();
+}
+
+void hudEndPhase(int phase) {
+    hudPhaseTicks[phase] += hudTicks() - hudPhaseStart[phase];
+}
+
+// Blanks the character buffer and starts the first period.
+void hudSetup() {
+
+#ifdef HOST_BUILD
+#ifdef HUD_FILE
+    if (!hudOut) hudOut = fopen(HUD_FILE, "w");
+#endif
+    if (!hudOut) hudOut = stdout;
+#else
+    for (int row = 0; row < CHAR_BUF_ROWS; row++) {
+        for (int col = 0; col < CHAR_BUF_COLUMNS; col++) {
+            *(volatile char *) (FPGA_CHAR_BASE + (row << 7) + col) = ' ';
+        }
+    }
+#endif
+
+    for (int p = 0; p < HUD_NUM_PHASES; p++) hudPhaseTicks[p] = 0;
+    hudFrames = 0;
+    hudPeriodStart = hudTicks();
+
+}
+
+#ifndef HOST_BUILD
+// Writes one line at (HUD_COLUMN, row), padding with spaces so a shorter line clears a longer one.
+void hudWriteLine(int row, char * text) {
+    volatile char * charPtr = (volatile char *) (FPGA_CHAR_BASE + (row << 7) + HUD_COLUMN);
+    int col = HUD_COLUMN;
+    for (; *text && col < CHAR_BUF_COLUMNS; col++) *charPtr++ = *text++;
+    for (; col < CHAR_BUF_COLUMNS; col++) *charPtr++ = ' ';
+}
+#endif
+
+// Shows the averages over the last hudFrames frames and starts the sums again.
+void hudShow() {
+
+    unsigned int now = hudTicks();
+    float periodUs = (float) (now - hudPeriodStart) / HUD_TICKS_PER_US;
+    float fps = periodUs > 0 ? hudFrames * 1000000.0 / periodUs : 0;
+
+    bool showBodies = !isFluidSim || isCoupledSim;
+    int numAsleep = 0;
+    for (int a = 0; showBodies && a < numRBActive; a++) numAsleep += allBodies[rbActive[a]].isAsleep;
+
+    int len = snprintf(hudText[0], sizeof hudText[0], "fps %5.1f  frame %6.2f ms  overruns %d  steps/s %.1f  mouse isr %.1f us",
+                       fps, periodUs / hudFrames / 1000.0, frameOverruns, periodUs > 0 ? simSteps * 1000000.0 / periodUs : 0,
+                       (float) mouseIsrTicks / HUD_TICKS_PER_US);
+    frameOverruns = 0;
+    simSteps = 0;
+    mouseIsrTicks = 0;
+    len = snprintf(hudText[1], sizeof hudText[1], "ms");
+    for (int p = 0; p < HUD_NUM_PHASES; p++) {
+        float ms = (float) hudPhaseTicks[p] / HUD_TICKS_PER_US / hudFrames / 1000.0;
+        len += snprintf(hudText[1] + len, sizeof hudText[1] - len, " %s %.2f", hudPhaseNames[p], ms);
+        hudPhaseTicks[p] = 0;
+    }
+    snprintf(hudText[2], sizeof hudText[2], "particles %d  bodies %d (%d asleep)  contacts %d  pairs %d (%d dropped)",
+             isFluidSim ? NUM_PARTICLES : 0, showBodies ? numRBActive : 0, numAsleep,
+             numRBContacts, numRBCandidatePairs, rbCandidatePairsDropped);
+    snprintf(hudText[3], sizeof hudText[3], "cmds %d queued  %d run  %d dropped", renderCommandsQueued,
+             renderCommandsRun, renderCommandsDropped);
+
+#ifdef HOST_BUILD
+    fprintf(hudOut, "%s | %s | %s | %s\n", hudText[0], hudText[1], hudText[2], hudText[3]);
+    fflush(hudOut);
+#else
+    for (int l = 0; l < HUD_LINES; l++) hudWriteLine(HUD_ROW + l, hudText[l]);
+#endif
+
+    hudFrames = 0;
+    hudPeriodStart = now;
+
+}
+
+// Call once a frame. Every HUD_UPDATE_FRAMES frames the averages are shown and the sums start again.
+void hudEndFrame() {
+    if (++hudFrames >= HUD_UPDATE_FRAMES) hudShow();
+}
+
+// For a run of frames that skipped hudEndFrame, to keep the output out of a timed loop: shows the
+// averages over all of them at once.
+void hudEndRun(int frames) {
+    hudFrames = frames;
+    hudShow();
+}
+
+// =======================================================================================================
+//                                                PROFILER
+// =======================================================================================================
+
+// Building with PROFILE times the hot paths, one scope each (the PROFILE_ list under FLUID SIMULATION
+// UTILS), in cycles: the A9's PMU cycle counter on the board, rdtsc on an x86 host and timeNow on any
+// other. Each scope keeps its last PROFILE_RING_SIZE samples in a ring. Every PROFILE_DUMP_FRAMES frames
+// the min, mean, 99th percentile and max of each scope are written out, over the JTAG UART on the board
+// or to PROFILE_FILE (else stdout) on the host, and the counts start again. A scope that ran more often
+// than the ring holds is summed up from its last n samples, and calls says how many there were in all.
+// Without PROFILE none of this is built and the scope macros are empty.
+
+#ifdef PROFILE
+#define PROFILE_RING_SIZE       512
+#define PROFILE_DUMP_FRAMES     300
+
+#if defined(HOST_BUILD) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+
+const char * profileScopeNames[PROFILE_NUM_SCOPES] = {"fluid nbr", "fluid dens", "fluid frc", "fluid int",
+                                                       "fluid col", "rb narrow", "rb resolve", "damage", "draw",
+                                                       "vsync wait"};
+unsigned int profileSamples[PROFILE_NUM_SCOPES][PROFILE_RING_SIZE];
+unsigned int profileCount[PROFILE_NUM_SCOPES]; // Samples since the last dump, the last PROFILE_RING_SIZE kept
+unsigned int profileStart[PROFILE_NUM_SCOPES];
+int profileFrames = 0;
+bool profileStarted = false;
+#ifdef HOST_BUILD
+FILE * profileOut;
+#endif
+
+unsigned int profileCycles() {
+#if defined(HOST_BUILD) && (defined(__x86_64__) || defined(__i386__))
+    return (unsigned int) __rdtsc();
+#elif defined(HOST_BUILD)
+    return (unsigned int) timeNow();
+#else
+    unsigned int cycles;
+    __asm__ volatile ("mrc p15, 0, %0, c9, c13, 0" : "=r"(cycles)); // PMCCNTR
+    return cycles;
+#endif
+}
+
+// Starts the cycle counter on the board, and opens the output on the host.
+void profileSetup() {
+#ifdef HOST_BUILD
+#ifdef PROFILE_FILE
+    profileOut = fopen(PROFILE_FILE, "w");
+#endif
+    if (!profileOut) profileOut = stdout;
+#else
+    __asm__ volatile ("mcr p15, 0, %0, c9, c12, 0" :: "r"(0b101)); // PMCR: enable, reset the cycle counter
+    __asm__ volatile ("mcr p15, 0, %0, c9, c12, 1" :: "r"(1u << 31)); // PMCNTENSET: count cycles
+#endif
+    profileStarted = true;
+}
+
+void profileBegin(int scope) {
+    profileStart[scope] = profileCycles();
+}
+
+void profileEnd(int scope) {
+    unsigned int cycles = profileCycles() - profileStart[scope];
+    profileSamples[scope][profileCount[scope]++ % PROFILE_RING_SIZE] = cycles;
+}
+
+int compareCycles(const void * a, const void * b) {
+    unsigned int x = *(const unsigned int *) a;
+    unsigned int y = *(const unsigned int *) b;
+    return (x > y) - (x < y);
+}
+
+void profileWrite(const char * text) {
+#ifdef HOST_BUILD
+    fputs(text, profileOut);
+#else
+    jtagUartWrite(text);
+#endif
+}
+
+void profileDump() {
+
+    static unsigned int sorted[PROFILE_RING_SIZE];
+    char line[128];
+
+    snprintf(line, sizeof line, "%-10s %7s %5s %10s %10s %10s %10s  (cycles, last %d frames)\n", "scope", "calls",
+             "n", "min", "mean", "p99", "max", profileFrames);
+    profileWrite(line);
+
+    for (int s = 0; s < PROFILE_NUM_SCOPES; s++) {
+        int n = profileCount[s] < PROFILE_RING_SIZE ? profileCount[s] : PROFILE_RING_SIZE;
+        if (n == 0) continue;
+        double sum = 0;
+        for (int k = 0; k < n; k++) {
+            sorted[k] = profileSamples[s][k];
+            sum += sorted[k];
+        }
+        qsort(sorted, n, sizeof sorted[0], compareCycles);
+        snprintf(line, sizeof line, "%-10s %7u %5d %10u %10.0f %10u %10u\n", profileScopeNames[s], profileCount[s],
+                 n, sorted[0], sum / n, sorted[(n * 99 - 1) / 100], sorted[n - 1]);
+        profileWrite(line);
+        profileCount[s] = 0;
+    }
+
+#ifdef HOST_BUILD
+    fflush(profileOut);
+#endif
+
+}
+
+// Call once a frame, after the frame's last scope.
+void profileEndFrame() {
+    if (!profileStarted) {
+        profileSetup();
+        for (int s = 0; s < PROFILE_NUM_SCOPES; s++) profileCount[s] = 0; // Timed before the counter ran
+        return;
+    }
+    if (++profileFrames < PROFILE_DUMP_FRAMES) return;
+    profileDump();
+    profileFrames = 0;
+}
+#endif
+
+// =======================================================================================================
+//                                                   MAIN
+// =======================================================================================================
+
+// Cycles rigid bodies -> fluid -> both in one world.
+void switchSimHandler() {
+    isCoupledSim = isFluidSim && !isCoupledSim;
+    isFluidSim = !isFluidSim || isCoupledSim;
+    speedMult = 0;
+    resetSimHandler();
+}
+
+void resetSimHandler() {
+    renderDamageAll();
+    if (isFluidSim) {
+        initParticles(); 
+    }
+    if (!isFluidSim || isCoupledSim) {
+        initRigidBodies();
+    }
+    // speedMult = 4;
+    // fastFowardHandler();
+}
+
+void fastFowardHandler(){
+    if(speedMult == 4)speedMult = 0;
+    else speedMult++;
+    SPF = speedArray[speedMult] * DEFAULT_SPF;
+    SPH_RB = speedArray[speedMult] * DEFAULT_SPH_RB;
+}
+
+#if defined(COUPLED_BENCHMARK) || defined(RENDER_BENCHMARK)
+// Reads a size given as WxH on the command line.
+bool parseSize(const char * text, int * width, int * height) {
+    return sscanf(text, "%dx%d", width, height) == 2;
+}
+#endif
+
+#ifdef COUPLED_BENCHMARK
+// Optionally takes the simulation domain, WxH. There is no screen.
+int main(int argc, char ** argv){
+    int w, h;
+    if (argc > 1 && !(parseSize(argv[1], &w, &h) && setSimDomain(w, h))) {
+        fprintf(stderr, "bad domain %s, at most %dx%d\n", argv[1], MAX_X, MAX_Y);
+        return 1;
+    }
+    return runCoupledBenchmark();
+}
+#elif defined(RENDER_BENCHMARK)
+// Optionally takes the screen size, then the simulation domain, as WxH. The domain defaults to the screen.
+int main(int argc, char ** argv){
+    int w, h;
+    if (argc > 1 && !(parseSize(argv[1], &w, &h) && setDisplayGeometry(w, h) && setSimDomain(w, h))) {
+        fprintf(stderr, "bad screen size %s, at most %dx%d\n", argv[1], MAX_X, MAX_Y);
+        return 1;
+    }
+    if (argc > 2 && !(parseSize(argv[2], &w, &h) && setSimDomain(w, h))) {
+        fprintf(stderr, "bad domain %s, at most %dx%d\n", argv[2], MAX_X, MAX_Y);
+        return 1;
+    }
+    return runRenderBenchmark() ? 1 : 0;
+}
+#elif defined(CAPTURE_READER)
+int main(int argc, char ** argv){
+    return runCaptureReader(argc, argv);
+}
+#elif defined(QUERY_TEST)
+int main(void){
+    return runQueryTest() ? 1 : 0;
+}
+#elif defined(PS2_TEST)
+int main(void){
+    return runPS2Test() ? 1 : 0;
+}
+#else
+int main(void){ // main for this simulation
+
+    // volatile int * sw_ptr = (volatile int *)SW_BASE;
 
     play = true;
     initParticles();
     initRigidBodies();
 
+    timeSetup();
     intializeMouse(&mData);
     prevmData = mData;
 
     vgaSetup();
+    hudSetup();
 
     // Program loop
     while(1) {
@@ -1999,38 +6165,26 @@ int main(void){ // main for this simulation
 
         // if(errSt!=errStLast) resetSimHandler();
         // errStLast = errSt;
-        // if (isFluidSim != lastFluidSim) {
-        //     if (lastFluidSim) eraseParticles();
-        //     else eraseBodies();
-        // }
 
-        
-        lastFluidSim = isFluidSim;
-        // Erase Stuff
-        if (isFluidSim) eraseParticles();
-        else eraseBodies();
-
-        drawMouse(&prevmData, BLACK);
+        // Mouse movement and clicks since the last frame
+        processInputEvents();
 
+        lastFluidSim = isFluidSim;
         // Draw Stuff
-        if (isFluidSim) drawParticles();
-        else drawBodies();
-
-        drawButtons();
-        drawMouse(&mData, WHITE);
+        renderFrame();
         prevmData = mData;
         
-        // Update Stuff 
-        if(play){
-            if (isFluidSim) timeStepBucketwiseParticleUpdate();
-            else timeStepRBForceApplication();
-        }
-
-        // Wait for Stuff
-        waitForVsync();
+        // Update Stuff while the swap waits for vsync, as many steps as wall time asks for
+        int steps = simStepsDue();
+        for (int k = 0; play && k < steps; k++) queueSimulationJobs();
+        queueFrameJob(prepareSceneDamage);
+        presentFrame();
+        hudEndFrame();
+        PROFILE_END_FRAME();
 
     }
 
     return 0;
 
-}
\ No newline at end of file
+}
+#endif
@@ -2,8 +2,8 @@
 #include <stdio.h>
 
 #define PS2_BASE 0xFF200100
-#define MAX_X 319
-#define MAX_Y 239
+#define MAX_X 320
+#define MAX_Y 240
 #define FPGA_PIXEL_BUF_BASE		0xff203020
 #define MOUSE_RADIUS 2
 #define BUTTON_X 301